@@ -0,0 +1,209 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * Microbenchmark of the bitmap entry scans: bit by bit loops, as the
+ * bitmap code used to do, against the scalar and AVX2 word kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "utils.h"
+#include "bitops.h"
+
+/* Scalar kernels, see scalar.c */
+int bitops_scalar_find_next_set(const u_char *bmp,u_int start,u_int nbits);
+int bitops_scalar_find_next_clear(const u_char *bmp,u_int start,u_int nbits);
+u_int bitops_scalar_count_set(const u_char *bmp,u_int nbits);
+
+/* Size of a full bitmap entry bitmap, in bytes */
+#define BENCH_BMP_SIZE  496
+
+/* Number of items allocated for the iteration test */
+#define BENCH_ALLOCATED  40
+
+#define BENCH_DEFAULT_LOOPS  100000
+
+typedef int (*bench_find_t)(const u_char *bmp,u_int start,u_int nbits);
+typedef u_int (*bench_count_t)(const u_char *bmp,u_int nbits);
+
+struct bench_impl {
+   const char *name;
+   bench_find_t find_next_set,find_next_clear;
+   bench_count_t count_set;
+};
+
+/* Bit by bit reference versions */
+static inline int bench_bit_get(const u_char *bmp,u_int i)
+{
+   return((bmp[i >> 3] >> (i & 7)) & 1);
+}
+
+static int bench_loop_find_next_set(const u_char *bmp,u_int start,
+                                    u_int nbits)
+{
+   u_int i;
+
+   for(i=start;i<nbits;i++)
+      if (bench_bit_get(bmp,i))
+         return(i);
+
+   return(-1);
+}
+
+static int bench_loop_find_next_clear(const u_char *bmp,u_int start,
+                                      u_int nbits)
+{
+   u_int i;
+
+   for(i=start;i<nbits;i++)
+      if (!bench_bit_get(bmp,i))
+         return(i);
+
+   return(-1);
+}
+
+static u_int bench_loop_count_set(const u_char *bmp,u_int nbits)
+{
+   u_int i,count = 0;
+
+   for(i=0;i<nbits;i++)
+      count += bench_bit_get(bmp,i);
+
+   return(count);
+}
+
+static const struct bench_impl bench_impls[] = {
+   { "bit loop", bench_loop_find_next_set, bench_loop_find_next_clear,
+     bench_loop_count_set },
+   { "scalar", bitops_scalar_find_next_set, bitops_scalar_find_next_clear,
+     bitops_scalar_count_set },
+   { "libvmfs", bitops_find_next_set, bitops_find_next_clear,
+     bitops_count_set },
+};
+
+#define BENCH_IMPLS  (sizeof(bench_impls) / sizeof(bench_impls[0]))
+
+/* Prevent the compiler from dropping the calls */
+static volatile u_int bench_sink;
+
+static double bench_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return((ts.tv_sec * 1e9) + ts.tv_nsec);
+}
+
+/* Find the first free item, only the last one being free */
+static void bench_find_free(const struct bench_impl *impl,const u_char *bmp,
+                            u_int nbits)
+{
+   bench_sink += impl->find_next_clear(bmp,0,nbits);
+}
+
+/* Count the free items */
+static void bench_count_free(const struct bench_impl *impl,const u_char *bmp,
+                             u_int nbits)
+{
+   bench_sink += nbits - impl->count_set(bmp,nbits);
+}
+
+/* Iterate over the allocated items */
+static void bench_foreach(const struct bench_impl *impl,const u_char *bmp,
+                          u_int nbits)
+{
+   int i;
+
+   for(i=impl->find_next_set(bmp,0,nbits);i >= 0;
+       i=impl->find_next_set(bmp,i+1,nbits))
+      bench_sink += i;
+}
+
+/* All items allocated but the last one, and a few spread over the entry */
+static u_char bench_full[BENCH_BMP_SIZE],bench_sparse[BENCH_BMP_SIZE];
+
+static const struct bench_test {
+   const char *name;
+   void (*run)(const struct bench_impl *impl,const u_char *bmp,u_int nbits);
+   const u_char *bmp;
+} bench_tests[] = {
+   { "find first free, last item free", bench_find_free, bench_full },
+   { "count free items", bench_count_free, bench_full },
+   { "iterate over allocated items", bench_foreach, bench_sparse },
+};
+
+#define BENCH_TESTS  (sizeof(bench_tests) / sizeof(bench_tests[0]))
+
+int main(int argc,char *argv[])
+{
+   u_int i,j,nbits = BENCH_BMP_SIZE * 8;
+   u_long n,loops = BENCH_DEFAULT_LOOPS;
+   double start;
+
+   if (argc > 2) {
+      fprintf(stderr,"Syntax: %s [loops]\n",argv[0]);
+      return(1);
+   }
+
+   if ((argc == 2) && !(loops = strtoul(argv[1],NULL,0))) {
+      fprintf(stderr,"Invalid loop count: %s\n",argv[1]);
+      return(1);
+   }
+
+   memset(bench_full,0xff,sizeof(bench_full));
+   bench_full[BENCH_BMP_SIZE - 1] &= 0x7f;
+
+   for(i=0;i<BENCH_ALLOCATED;i++) {
+      j = (i * nbits) / BENCH_ALLOCATED + (i % 7);
+      bench_sparse[j >> 3] |= 1 << (j & 7);
+   }
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_AVX2)
+   __builtin_cpu_init();
+   printf("AVX2 kernels: %s\n",
+          __builtin_cpu_supports("avx2") ? "used" : "not supported by the CPU");
+#else
+   printf("AVX2 kernels: not built\n");
+#endif
+   printf("%u-bit entry bitmap, %lu loops, ns per call\n\n",nbits,loops);
+   printf("%-34s","");
+
+   for(i=0;i<BENCH_IMPLS;i++)
+      printf("%10s",bench_impls[i].name);
+
+   printf("\n");
+
+   for(j=0;j<BENCH_TESTS;j++) {
+      printf("%-34s",bench_tests[j].name);
+
+      for(i=0;i<BENCH_IMPLS;i++) {
+         start = bench_now();
+
+         for(n=0;n<loops;n++)
+            bench_tests[j].run(&bench_impls[i],bench_tests[j].bmp,nbits);
+
+         printf("%10.1f",(bench_now() - start) / loops);
+      }
+
+      printf("\n");
+   }
+
+   return(0);
+}
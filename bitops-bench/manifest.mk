@@ -0,0 +1,2 @@
+bitops-bench_OPTIONS := noinst
+REQUIRES := libvmfs
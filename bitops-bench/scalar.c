@@ -0,0 +1,28 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * The bit scanning kernels of libvmfs, built again without AVX2 and under
+ * other names, so that both versions can be compared in a single run.
+ */
+
+#define NO_AVX2 1
+#define bitops_find_next_set    bitops_scalar_find_next_set
+#define bitops_find_next_clear  bitops_scalar_find_next_clear
+#define bitops_count_set        bitops_scalar_count_set
+
+#include "bitops.c"
@@ -27,7 +27,12 @@ $(call LINK_CHECK,dlopen,-ldl)
 ifeq (,$(HAS_DLOPEN))
 $(call LINK_CHECK,dlopen)
 endif
+$(call LINK_CHECK,pthread_create,-lpthread)
+ifeq (,$(HAS_PTHREAD_CREATE))
+$(call LINK_CHECK,pthread_create)
+endif
 $(call LINK_CHECK,posix_memalign)
+$(call HEADER_CHECK,io_uring,linux/io_uring.h)
 
 # Generate cache file
 $(shell ($(foreach var,$(filter-out $(__VARS) __%,$(.VARIABLES)),echo '$(var) = $($(var))';)) > config.cache)
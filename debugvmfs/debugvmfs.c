@@ -309,6 +309,54 @@ static int cmd_get_file_block(vmfs_dir_t *base_dir,int argc,char *argv[])
    return ret;
 }
 
+/* 
+ * Show file fragmentation: the number of runs of physically contiguous
+ * file blocks, and a score going from 0 (a single run) to 100 (no two
+ * consecutive blocks are adjacent).
+ */
+static int cmd_file_frag(vmfs_dir_t *base_dir,int argc,char *argv[])
+{
+   vmfs_file_t *f;
+   uint32_t blk_id,item,prev_item = 0;
+   uint64_t blk_size;
+   u_int blocks = 0,runs = 0;
+   off_t pos;
+
+   if (argc < 1) {
+      fprintf(stderr,"Usage: file_frag <filespec>\n");
+      return(-1);
+   }
+
+   if (!(f = vmfs_file_open_from_filespec(base_dir,argv[0]))) {
+      fprintf(stderr,"Unable to open file '%s'\n",argv[0]);
+      return(-1);
+   }
+
+   blk_size = vmfs_fs_get_blocksize(vmfs_dir_get_fs(base_dir));
+
+   for(pos=0;pos<f->inode->size;pos+=blk_size) {
+      if (vmfs_inode_get_block(f->inode,pos,&blk_id) || !blk_id ||
+          (VMFS_BLK_TYPE(blk_id) != VMFS_BLK_TYPE_FB))
+         continue;
+
+      item = VMFS_BLK_FB_ITEM(blk_id);
+
+      if (!blocks || (item != prev_item + 1))
+         runs++;
+
+      prev_item = item;
+      blocks++;
+   }
+
+   printf("File blocks   : %u\n",blocks);
+   printf("Extents       : %u\n",runs);
+   printf("Fragmentation : %u\n",
+          (blocks > 1) ? ((runs - 1) * 100) / (blocks - 1) : 0);
+
+   vmfs_file_close(f);
+   return(0);
+}
+
 /* Check volume bitmaps */
 static int cmd_check_vol_bitmaps(vmfs_dir_t *base_dir,int argc,char *argv[])
 {
@@ -500,6 +548,7 @@ struct cmd cmd_array[] = {
    { "mkdir", "Create a directory", cmd_mkdir },
    { "df", "Show available free space", cmd_df },
    { "get_file_block", "Get file block", cmd_get_file_block },
+   { "file_frag", "Show file fragmentation", cmd_file_frag },
    { "check_vol_bitmaps", "Check volume bitmaps", cmd_check_vol_bitmaps },
    { "show_heartbeats", "Show active heartbeats", cmd_show_heartbeats },
    { "read_block", "Read a block", cmd_read_block },
@@ -667,6 +716,8 @@ int main(int argc,char *argv[])
 
 #ifdef VMFS_WRITE
    flags.read_write = 1;
+#else
+   flags.mmap = 1;
 #endif
 
    flags.allow_missing_extents = 1;
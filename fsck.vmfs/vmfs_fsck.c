@@ -46,6 +46,16 @@ struct vmfs_dir_map {
    vmfs_dir_map_t *child_list,*child_last;
 };
 
+/* 
+ * The inode scan reads the FDC in windows of VMFS_FSCK_SCAN_REQS chunks,
+ * read together so that they can be kept in flight on the device.
+ */
+#define VMFS_FSCK_SCAN_CHUNK  0x10000
+#define VMFS_FSCK_SCAN_REQS   16
+
+/* Largest value of the aio_depth flag */
+#define VMFS_FSCK_AIO_DEPTH_MAX  1023
+
 /* 
  * Block mapping, which allows to keep track of inodes given a block number.
  * Used for troubleshooting/debugging/future fsck.
@@ -267,6 +277,36 @@ static int vmfs_fsck_store_inode(const vmfs_fs_t *fs,vmfs_blk_map_t **ht,
    return(0);
 }
 
+/* 
+ * Read a window of the FDC file, as a batch of chunks kept in flight
+ * together. Returns the end of the data read.
+ */
+static off_t vmfs_fsck_read_fdc(const vmfs_fs_t *fs,off_t start,u_char *buf)
+{
+   vmfs_io_req_t reqs[VMFS_FSCK_SCAN_REQS];
+   uint64_t file_size;
+   off_t end;
+   int i,n;
+
+   file_size = vmfs_file_get_size(fs->fdc->f);
+   end = m_min(start + VMFS_FSCK_SCAN_REQS * VMFS_FSCK_SCAN_CHUNK,file_size);
+
+   for(i=0,n=0;start + i * VMFS_FSCK_SCAN_CHUNK < end;i++,n++) {
+      reqs[n].pos = start + i * VMFS_FSCK_SCAN_CHUNK;
+      reqs[n].buf = buf + i * VMFS_FSCK_SCAN_CHUNK;
+      reqs[n].len = m_min(VMFS_FSCK_SCAN_CHUNK,end - reqs[n].pos);
+   }
+
+   vmfs_file_read_batch(fs->fdc->f,reqs,n);
+
+   /* Only keep the data read up to the first failed chunk */
+   for(i=0;i<n;i++)
+      if (reqs[i].res != reqs[i].len)
+         return(reqs[i].pos);
+
+   return(end);
+}
+
 /* Iterate over all inodes of the FS and get all block mappings  */
 int vmfs_fsck_get_all_block_mappings(const vmfs_fs_t *fs,
                                      vmfs_fsck_info_t *fi)
@@ -274,19 +314,38 @@ int vmfs_fsck_get_all_block_mappings(const vmfs_fs_t *fs,
    vmfs_inode_t inode;
    vmfs_bitmap_header_t *fdc_bmp;
    uint32_t entry,item;
+   off_t pos,start,end;
+   u_char *buf;
    int i;
 
    fdc_bmp = &fs->fdc->bmh;
 
    printf("Scanning %u FDC entries...\n",fdc_bmp->total_items);
 
+   if (!(buf = iobuffer_alloc(VMFS_FSCK_SCAN_REQS * VMFS_FSCK_SCAN_CHUNK)))
+      return(-1);
+
+   start = end = 0;
+
    for(i=0;i<fdc_bmp->total_items;i++) {
       entry = i / fdc_bmp->items_per_bitmap_entry;
       item  = i % fdc_bmp->items_per_bitmap_entry;
 
+      /* Read ahead the next window of inodes */
+      pos = vmfs_bitmap_get_item_pos(fs->fdc,entry,item);
+
+      if ((pos < start) || (pos + fdc_bmp->data_size > end)) {
+         start = pos - (pos % VMFS_FSCK_SCAN_CHUNK);
+         end = vmfs_fsck_read_fdc(fs,start,buf);
+      }
+
       /* Skip undefined/deleted inodes */
-      if ((vmfs_inode_get(fs, VMFS_BLK_FD_BUILD(entry, item, 0), &inode) == -1) ||
-          !inode.nlink)
+      if (pos + fdc_bmp->data_size <= end) {
+         if ((vmfs_inode_read(&inode,buf + (pos - start)) == -1) ||
+             !inode.nlink)
+            continue;
+      } else if ((vmfs_inode_get(fs, VMFS_BLK_FD_BUILD(entry, item, 0),
+                                 &inode) == -1) || !inode.nlink)
          continue;
 
       inode.fs = fs;
@@ -294,6 +353,7 @@ int vmfs_fsck_get_all_block_mappings(const vmfs_fs_t *fs,
       vmfs_inode_foreach_block(&inode,vmfs_fsck_store_block,fi->blk_map);
    }
 
+   iobuffer_free(buf);
    return(0);
 }
 
@@ -523,7 +583,9 @@ static void show_usage(char *prog_name)
    char *name = basename(prog_name);
 
    fprintf(stderr,"%s " VERSION "\n",name);
-   fprintf(stderr,"Syntax: %s <device_name...>\n\n",name);
+   fprintf(stderr,"Syntax: %s [-a <aio_depth>] <device_name...>\n\n",name);
+   fprintf(stderr,"  -a <aio_depth>: requests kept in flight by batched "
+           "reads (1-%u)\n\n",VMFS_FSCK_AIO_DEPTH_MAX);
 }
 
 int main(int argc,char *argv[])
@@ -532,15 +594,36 @@ int main(int argc,char *argv[])
    vmfs_fs_t *fs;
    vmfs_flags_t flags;
    vmfs_dir_t *root_dir;
+   long depth;
+   int opt;
 
-   if (argc < 2) {
+   flags.packed = 0;
+   flags.mmap = 1;
+
+   while((opt = getopt(argc,argv,"a:")) != -1) {
+      switch(opt) {
+         case 'a':
+            depth = strtol(optarg,NULL,0);
+
+            if ((depth < 1) || (depth > VMFS_FSCK_AIO_DEPTH_MAX)) {
+               show_usage(argv[0]);
+               return(0);
+            }
+
+            flags.aio_depth = depth;
+            break;
+         default:
+            show_usage(argv[0]);
+            return(0);
+      }
+   }
+
+   if (optind >= argc) {
       show_usage(argv[0]);
       return(0);
    }
 
-   flags.packed = 0;
-
-   if (!(fs = vmfs_fs_open(&argv[1], flags))) {
+   if (!(fs = vmfs_fs_open(&argv[optind], flags))) {
       fprintf(stderr,"Unable to open filesystem\n");
       exit(EXIT_FAILURE);
    }
@@ -0,0 +1,179 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * Bit scanning kernels.
+ */
+
+#include "utils.h"
+#include "bitops.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_AVX2)
+#include <immintrin.h>
+#define BITOPS_AVX2 1
+#endif
+
+/* Mask of the valid bits of a 64-bit word */
+static inline uint64_t bitops_word_mask(u_int word,u_int nbits)
+{
+   u_int left = nbits - (word * 64);
+
+   return((left >= 64) ? ~0ULL : ((1ULL << left) - 1));
+}
+
+/* Load a 64-bit word, without reading past the end of the bitmap */
+static inline uint64_t bitops_load(const u_char *bmp,u_int word,u_int nbits)
+{
+   uint64_t w = 0;
+   u_int i,nbytes;
+
+   if ((word + 1) * 64 <= nbits)
+      return(read_le64(bmp,word * 8));
+
+   nbytes = (nbits - (word * 64) + 7) / 8;
+
+   for(i=0;i<nbytes;i++)
+      w |= (uint64_t)bmp[(word * 8) + i] << (i * 8);
+
+   return(w);
+}
+
+#ifdef BITOPS_AVX2
+/* 
+ * Skip 256-bit chunks having all bits equal to "invert", starting at the
+ * given word. Returns the first word which may hold a match.
+ */
+__attribute__((target("avx2")))
+static u_int bitops_skip_avx2(const u_char *bmp,u_int word,u_int nbits,
+                              uint64_t invert)
+{
+   __m256i v,ref = _mm256_set1_epi64x(invert);
+
+   for(;(word + 4) * 64 <= nbits;word += 4) {
+      v = _mm256_loadu_si256((const __m256i *)(bmp + (word * 8)));
+      v = _mm256_xor_si256(v,ref);
+
+      if (!_mm256_testz_si256(v,v))
+         break;
+   }
+
+   return(word);
+}
+
+/* Count bits set in 256-bit chunks, using a nibble lookup table */
+__attribute__((target("avx2")))
+static u_int bitops_count_avx2(const u_char *bmp,u_int nbytes)
+{
+   const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+   const __m256i low = _mm256_set1_epi8(0x0f);
+   __m256i v,cnt,acc = _mm256_setzero_si256();
+   u_int i;
+
+   for(i=0;i+32<=nbytes;i+=32) {
+      v = _mm256_loadu_si256((const __m256i *)(bmp + i));
+      cnt = _mm256_add_epi8(
+               _mm256_shuffle_epi8(lut,_mm256_and_si256(v,low)),
+               _mm256_shuffle_epi8(lut,_mm256_and_si256(
+                                          _mm256_srli_epi16(v,4),low)));
+      acc = _mm256_add_epi64(acc,_mm256_sad_epu8(cnt,
+                                                 _mm256_setzero_si256()));
+   }
+
+   return(_mm256_extract_epi64(acc,0) + _mm256_extract_epi64(acc,1) +
+          _mm256_extract_epi64(acc,2) + _mm256_extract_epi64(acc,3));
+}
+
+/* Check once whether AVX2 kernels can be used */
+static int bitops_use_avx2(void)
+{
+   static int use_avx2 = -1;
+
+   if (use_avx2 < 0) {
+      __builtin_cpu_init();
+      use_avx2 = __builtin_cpu_supports("avx2");
+   }
+
+   return(use_avx2);
+}
+#endif
+
+/* Find the first bit differing from "invert" at or after "start" */
+static int bitops_find_next(const u_char *bmp,u_int start,u_int nbits,
+                            uint64_t invert)
+{
+   u_int word,empty;
+   uint64_t w;
+
+   if (start >= nbits)
+      return(-1);
+
+   word = start / 64;
+   w = (bitops_load(bmp,word,nbits) ^ invert) & bitops_word_mask(word,nbits);
+   w &= ~0ULL << (start % 64);
+
+   for(empty=0;!w;empty++) {
+      if (++word * 64 >= nbits)
+         return(-1);
+
+#ifdef BITOPS_AVX2
+      /* Only worth it on long runs of uninteresting bits */
+      if ((empty >= 2) && bitops_use_avx2()) {
+         word = bitops_skip_avx2(bmp,word,nbits,invert);
+
+         if (word * 64 >= nbits)
+            return(-1);
+      }
+#endif
+
+      w = (bitops_load(bmp,word,nbits) ^ invert) &
+          bitops_word_mask(word,nbits);
+   }
+
+   return((word * 64) + __builtin_ctzll(w));
+}
+
+/* Find the first bit set at or after "start", -1 if there is none */
+int bitops_find_next_set(const u_char *bmp,u_int start,u_int nbits)
+{
+   return(bitops_find_next(bmp,start,nbits,0));
+}
+
+/* Find the first bit cleared at or after "start", -1 if there is none */
+int bitops_find_next_clear(const u_char *bmp,u_int start,u_int nbits)
+{
+   return(bitops_find_next(bmp,start,nbits,~0ULL));
+}
+
+/* Count the number of bits set */
+u_int bitops_count_set(const u_char *bmp,u_int nbits)
+{
+   u_int word = 0,count = 0;
+
+#ifdef BITOPS_AVX2
+   if (bitops_use_avx2()) {
+      count = bitops_count_avx2(bmp,(nbits / 256) * 32);
+      word = (nbits / 256) * 4;
+   }
+#endif
+
+   for(;word * 64 < nbits;word++)
+      count += __builtin_popcountll(bitops_load(bmp,word,nbits) &
+                                    bitops_word_mask(word,nbits));
+
+   return(count);
+}
@@ -0,0 +1,36 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BITOPS_H
+#define BITOPS_H
+
+/* 
+ * Bit scanning kernels for bitmaps stored as little endian arrays of
+ * bytes, bit i being bit (i & 7) of byte (i >> 3). They work on 64-bit
+ * words, and on 256-bit vectors when the CPU supports AVX2.
+ */
+
+/* Find the first bit set at or after "start", -1 if there is none */
+int bitops_find_next_set(const u_char *bmp,u_int start,u_int nbits);
+
+/* Find the first bit cleared at or after "start", -1 if there is none */
+int bitops_find_next_clear(const u_char *bmp,u_int start,u_int nbits);
+
+/* Count the number of bits set */
+u_int bitops_count_set(const u_char *bmp,u_int nbits);
+
+#endif
@@ -1,2 +1,4 @@
+LDFLAGS := $(PTHREAD_CREATE_LDFLAGS)
 utils.o_CFLAGS := $(if $(HAS_POSIX_MEMALIGN),,-DNO_POSIX_MEMALIGN=1)
+vmfs_aio.o_CFLAGS := $(if $(HAS_IO_URING),-DHAS_IO_URING=1)
 REQUIRES := uuid
@@ -156,17 +156,43 @@ void iobuffer_free(u_char *buf)
    free(buf);
 }
 
-/* Read from file descriptor at a given offset */
-ssize_t m_pread(int fd,void *buf,size_t count,off_t offset)
+/* Get the total length of an I/O vector */
+size_t m_iov_length(const struct iovec *iov,int iovcnt)
+{
+   size_t len = 0;
+   int i;
+
+   for(i=0;i<iovcnt;i++)
+      len += iov[i].iov_len;
+
+   return(len);
+}
+
+/* 
+ * Transfer data between a file descriptor and several buffers, at a given
+ * offset. EIO errors are retried a few times, and short transfers are
+ * completed until the end of file.
+ */
+static ssize_t m_prwv(int fd,const struct iovec *iov,int iovcnt,off_t offset,
+                      int write)
 {
    int max_retries = 10;
-   u_char *ptr = (u_char *)buf;
-   size_t hlen = 0;
+   size_t hlen = 0,done = 0;
+   u_char *ptr;
    ssize_t len;
+   int i = 0;
+
+   while(i < iovcnt) {
+      if (done == 0) {
+         len = write ? pwritev(fd,&iov[i],iovcnt-i,offset+hlen) :
+                       preadv(fd,&iov[i],iovcnt-i,offset+hlen);
+      } else {
+         /* Complete a partially transferred buffer */
+         ptr = (u_char *)iov[i].iov_base + done;
+         len = write ? pwrite(fd,ptr,iov[i].iov_len-done,offset+hlen) :
+                       pread(fd,ptr,iov[i].iov_len-done,offset+hlen);
+      }
 
-   while(hlen < count) {
-      len = pread(fd,ptr,count-hlen,offset+hlen);
-      
       if (len < 0) {
          if (errno == EIO) {
             if (max_retries-- == 0)
@@ -182,44 +208,39 @@ ssize_t m_pread(int fd,void *buf,size_t count,off_t offset)
             break;
 
          hlen += len;
-         ptr  += len;
+
+         for(done+=len;(i < iovcnt) && (done >= iov[i].iov_len);i++)
+            done -= iov[i].iov_len;
       }
    }
 
    return(hlen);
 }
 
+/* Read from file descriptor at a given offset */
+ssize_t m_pread(int fd,void *buf,size_t count,off_t offset)
+{
+   struct iovec iov = { buf, count };
+   return(m_prwv(fd,&iov,1,offset,0));
+}
+
 /* Write to a file descriptor at a given offset */
 ssize_t m_pwrite(int fd,const void *buf,size_t count,off_t offset)
-{   
-   int max_retries = 10;
-   u_char *ptr = (u_char *)buf;
-   size_t hlen = 0;
-   ssize_t len;
-
-   while(hlen < count) {
-      len = pwrite(fd,ptr,count-hlen,offset+hlen);
-      
-      if (len < 0) {
-         if (errno == EIO) {
-            if (max_retries-- == 0)
-               return(-1);
-
-            continue;
-         }
-
-         if (errno != EINTR)
-            return(-1);
-      } else {
-         if (len == 0)
-            break;
+{
+   struct iovec iov = { (void *)buf, count };
+   return(m_prwv(fd,&iov,1,offset,1));
+}
 
-         hlen += len;
-         ptr  += len;
-      }
-   }
+/* Read from file descriptor at a given offset into several buffers */
+ssize_t m_preadv(int fd,const struct iovec *iov,int iovcnt,off_t offset)
+{
+   return(m_prwv(fd,iov,iovcnt,offset,0));
+}
 
-   return(hlen);
+/* Write several buffers to a file descriptor at a given offset */
+ssize_t m_pwritev(int fd,const struct iovec *iov,int iovcnt,off_t offset)
+{
+   return(m_prwv(fd,iov,iovcnt,offset,1));
 }
 
 /* Returns directory name */
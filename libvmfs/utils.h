@@ -22,6 +22,7 @@
 #include <string.h>
 #include <uuid.h>
 #include <inttypes.h>
+#include <sys/uio.h>
 
 /* Max and min macro */
 #define m_max(a,b) (((a) > (b)) ? (a) : (b))
@@ -172,6 +173,15 @@ ssize_t m_pread(int fd,void *buf,size_t count,off_t offset);
 /* Write to a file descriptor at a given offset */
 ssize_t m_pwrite(int fd,const void *buf,size_t count,off_t offset);
 
+/* Get the total length of an I/O vector */
+size_t m_iov_length(const struct iovec *iov,int iovcnt);
+
+/* Read from file descriptor at a given offset into several buffers */
+ssize_t m_preadv(int fd,const struct iovec *iov,int iovcnt,off_t offset);
+
+/* Write several buffers to a file descriptor at a given offset */
+ssize_t m_pwritev(int fd,const struct iovec *iov,int iovcnt,off_t offset);
+
 /* Returns directory name */
 char *m_dirname(const char *path);
 
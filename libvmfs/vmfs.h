@@ -24,16 +24,25 @@ typedef struct vmfs_fsinfo vmfs_fsinfo_t;
 typedef struct vmfs_lvminfo vmfs_lvminfo_t;
 typedef struct vmfs_heartbeat vmfs_heartbeat_t;
 typedef struct vmfs_metadata_hdr vmfs_metadata_hdr_t;
+typedef struct vmfs_txn vmfs_txn_t;
 typedef struct vmfs_block_info vmfs_block_info_t;
 typedef struct vmfs_bitmap_header vmfs_bitmap_header_t;
 typedef struct vmfs_bitmap_entry  vmfs_bitmap_entry_t;
 typedef struct vmfs_bitmap vmfs_bitmap_t;
+typedef struct vmfs_pbcache vmfs_pbcache_t;
 typedef struct vmfs_inode vmfs_inode_t;
+typedef struct vmfs_extent vmfs_extent_t;
+typedef struct vmfs_extmap vmfs_extmap_t;
 typedef struct vmfs_dirent vmfs_dirent_t;
 typedef struct vmfs_dir vmfs_dir_t;
+typedef struct vmfs_dircache vmfs_dircache_t;
+typedef struct vmfs_dircache_entry vmfs_dircache_entry_t;
 typedef struct vmfs_blk_array vmfs_blk_array_t;
 typedef struct vmfs_blk_list vmfs_blk_list_t;
 typedef struct vmfs_file vmfs_file_t;
+typedef struct vmfs_io_req vmfs_io_req_t;
+typedef struct vmfs_aio vmfs_aio_t;
+typedef struct vmfs_mcache vmfs_mcache_t;
 typedef struct vmfs_device vmfs_device_t;
 typedef struct vmfs_volume vmfs_volume_t;
 typedef struct vmfs_lvm vmfs_lvm_t;
@@ -45,19 +54,32 @@ union vmfs_flags {
       unsigned int debug_level:4;
       unsigned int read_write:1;
       unsigned int allow_missing_extents:1;
+      unsigned int no_readahead:1;
+      unsigned int readahead:8;  /* Max readahead window in file blocks,
+                                  * 0 for the default */
+      unsigned int mmap:1;       /* Map image files in memory when opened
+                                  * read-only */
+      unsigned int aio_depth:10; /* Requests kept in flight by batched reads,
+                                  * 0 for the default */
    };
 };
 
 typedef union vmfs_flags vmfs_flags_t __attribute__((transparent_union));
 
+#include <pthread.h>
 #include "utils.h"
 #include "vmfs_heartbeat.h"
 #include "vmfs_metadata.h"
 #include "vmfs_block.h"
 #include "vmfs_bitmap.h"
+#include "vmfs_pbcache.h"
 #include "vmfs_inode.h"
+#include "vmfs_extmap.h"
 #include "vmfs_dirent.h"
+#include "vmfs_dircache.h"
 #include "vmfs_file.h"
+#include "vmfs_aio.h"
+#include "vmfs_mcache.h"
 #include "vmfs_device.h"
 #include "vmfs_volume.h"
 #include "vmfs_lvm.h"
@@ -0,0 +1,317 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * Asynchronous I/O backend, based on io_uring when available. The ring is
+ * driven with the raw system calls, so that no additional library is
+ * required.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include "vmfs.h"
+
+#ifdef HAS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if !defined(__NR_io_uring_setup) || !defined(__NR_io_uring_enter)
+#undef HAS_IO_URING
+#endif
+#endif
+
+/* Read a batch of requests synchronously, one after the other */
+int vmfs_aio_read_batch_sync(int fd,off_t base,vmfs_io_req_t *reqs,int count)
+{
+   int i,res = 0;
+
+   for(i=0;i<count;i++) {
+      reqs[i].res = m_pread(fd,reqs[i].buf,reqs[i].len,base + reqs[i].pos);
+
+      if (reqs[i].res != reqs[i].len)
+         res = -1;
+   }
+
+   return(res);
+}
+
+#ifdef HAS_IO_URING
+
+struct vmfs_aio {
+   int ring_fd;
+   u_int depth;
+
+   /* Submission queue */
+   void *sq_ring;
+   size_t sq_ring_size;
+   unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+   struct io_uring_sqe *sqes;
+   size_t sqes_size;
+
+   /* Completion queue (may share the submission queue mapping) */
+   void *cq_ring;
+   size_t cq_ring_size;
+   unsigned *cq_head,*cq_tail,*cq_mask;
+   struct io_uring_cqe *cqes;
+};
+
+/* Create an asynchronous I/O context (NULL if not available) */
+vmfs_aio_t *vmfs_aio_create(u_int depth)
+{
+   struct io_uring_params p;
+   vmfs_aio_t *aio;
+
+   if (!(aio = calloc(1,sizeof(*aio))))
+      return NULL;
+
+   memset(&p,0,sizeof(p));
+
+   if ((aio->ring_fd = syscall(__NR_io_uring_setup,depth,&p)) < 0) {
+      free(aio);
+      return NULL;
+   }
+
+   aio->depth = p.sq_entries;
+   aio->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   aio->cq_ring_size = p.cq_off.cqes +
+                       p.cq_entries * sizeof(struct io_uring_cqe);
+
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+      aio->sq_ring_size = aio->cq_ring_size =
+         m_max(aio->sq_ring_size,aio->cq_ring_size);
+
+   aio->sq_ring = mmap(NULL,aio->sq_ring_size,PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE,aio->ring_fd,
+                       IORING_OFF_SQ_RING);
+
+   if (aio->sq_ring == MAP_FAILED)
+      goto err_sq_ring;
+
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      aio->cq_ring = aio->sq_ring;
+   } else {
+      aio->cq_ring = mmap(NULL,aio->cq_ring_size,PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE,aio->ring_fd,
+                          IORING_OFF_CQ_RING);
+
+      if (aio->cq_ring == MAP_FAILED)
+         goto err_cq_ring;
+   }
+
+   aio->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   aio->sqes = mmap(NULL,aio->sqes_size,PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE,aio->ring_fd,IORING_OFF_SQES);
+
+   if (aio->sqes == MAP_FAILED)
+      goto err_sqes;
+
+   aio->sq_head  = aio->sq_ring + p.sq_off.head;
+   aio->sq_tail  = aio->sq_ring + p.sq_off.tail;
+   aio->sq_mask  = aio->sq_ring + p.sq_off.ring_mask;
+   aio->sq_array = aio->sq_ring + p.sq_off.array;
+
+   aio->cq_head  = aio->cq_ring + p.cq_off.head;
+   aio->cq_tail  = aio->cq_ring + p.cq_off.tail;
+   aio->cq_mask  = aio->cq_ring + p.cq_off.ring_mask;
+   aio->cqes     = aio->cq_ring + p.cq_off.cqes;
+   return aio;
+
+ err_sqes:
+   if (aio->cq_ring != aio->sq_ring)
+      munmap(aio->cq_ring,aio->cq_ring_size);
+ err_cq_ring:
+   munmap(aio->sq_ring,aio->sq_ring_size);
+ err_sq_ring:
+   close(aio->ring_fd);
+   free(aio);
+   return NULL;
+}
+
+/* Destroy an asynchronous I/O context */
+void vmfs_aio_destroy(vmfs_aio_t *aio)
+{
+   if (!aio)
+      return;
+
+   munmap(aio->sqes,aio->sqes_size);
+   if (aio->cq_ring != aio->sq_ring)
+      munmap(aio->cq_ring,aio->cq_ring_size);
+   munmap(aio->sq_ring,aio->sq_ring_size);
+   close(aio->ring_fd);
+   free(aio);
+}
+
+/* Queue a read request in the submission ring */
+static void vmfs_aio_queue_read(vmfs_aio_t *aio,int fd,off_t base,
+                                vmfs_io_req_t *req,int index)
+{
+   struct io_uring_sqe *sqe;
+   unsigned tail,idx;
+
+   tail = *aio->sq_tail;
+   idx  = tail & *aio->sq_mask;
+   sqe  = &aio->sqes[idx];
+
+   memset(sqe,0,sizeof(*sqe));
+   sqe->opcode    = IORING_OP_READ;
+   sqe->fd        = fd;
+   sqe->off       = base + req->pos;
+   sqe->addr      = (uintptr_t)req->buf;
+   sqe->len       = req->len;
+   sqe->user_data = index;
+
+   aio->sq_array[idx] = idx;
+   __atomic_store_n(aio->sq_tail,tail+1,__ATOMIC_RELEASE);
+}
+
+/* Reap completed requests, returns the number of completions */
+static int vmfs_aio_reap(vmfs_aio_t *aio,int fd,off_t base,
+                         vmfs_io_req_t *reqs)
+{
+   struct io_uring_cqe *cqe;
+   vmfs_io_req_t *req;
+   unsigned head;
+   ssize_t res;
+   int count = 0;
+
+   head = *aio->cq_head;
+
+   while(head != __atomic_load_n(aio->cq_tail,__ATOMIC_ACQUIRE)) {
+      cqe = &aio->cqes[head & *aio->cq_mask];
+      req = &reqs[cqe->user_data];
+      req->res = cqe->res;
+      head++;
+      count++;
+
+      /* 
+       * Complete short reads, and requests the kernel refused to handle
+       * asynchronously (e.g. old kernels without IORING_OP_READ).
+       */
+      if ((req->res == -EINVAL) || (req->res == -EAGAIN))
+         req->res = 0;
+
+      if ((req->res >= 0) && (req->res < req->len)) {
+         res = m_pread(fd,req->buf+req->res,req->len-req->res,
+                       base+req->pos+req->res);
+         req->res = (res < 0) ? -EIO : req->res + res;
+      }
+   }
+
+   __atomic_store_n(aio->cq_head,head,__ATOMIC_RELEASE);
+   return(count);
+}
+
+/* 
+ * Wait for the completion of all the requests in flight after a failed
+ * submission, and drop the ones queued but not submitted, so that nothing
+ * is left to write into the buffers of the batch once it returns. Should
+ * waiting fail as well, the completion ring is polled.
+ */
+static void vmfs_aio_drain(vmfs_aio_t *aio,int fd,off_t base,
+                           vmfs_io_req_t *reqs,int pending,int inflight)
+{
+   unsigned head;
+   int res;
+
+   /* Requests consumed by the kernel are in flight, take back the others */
+   head = __atomic_load_n(aio->sq_head,__ATOMIC_ACQUIRE);
+   inflight += pending - (*aio->sq_tail - head);
+   __atomic_store_n(aio->sq_tail,head,__ATOMIC_RELEASE);
+
+   while(inflight > 0) {
+      res = syscall(__NR_io_uring_enter,aio->ring_fd,0,1,
+                    IORING_ENTER_GETEVENTS,NULL,0);
+
+      if ((res < 0) && (errno != EINTR))
+         sched_yield();
+
+      inflight -= vmfs_aio_reap(aio,fd,base,reqs);
+   }
+}
+
+/* 
+ * Read a batch of requests on a file descriptor, with base added to each
+ * request position. Returns 0 if all requests completed successfully.
+ */
+int vmfs_aio_read_batch(vmfs_aio_t *aio,int fd,off_t base,
+                        vmfs_io_req_t *reqs,int count)
+{
+   int submitted = 0,pending = 0,inflight = 0,completed = 0;
+   int i,res;
+
+   if (!aio)
+      return(vmfs_aio_read_batch_sync(fd,base,reqs,count));
+
+   for(i=0;i<count;i++)
+      reqs[i].res = -EIO;
+
+   while(completed < count) {
+      /* Keep the queue full */
+      for(;(submitted < count) && (inflight + pending < aio->depth);
+          submitted++,pending++)
+         vmfs_aio_queue_read(aio,fd,base,&reqs[submitted],submitted);
+
+      res = syscall(__NR_io_uring_enter,aio->ring_fd,pending,1,
+                    IORING_ENTER_GETEVENTS,NULL,0);
+
+      if (res < 0) {
+         if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+            vmfs_aio_drain(aio,fd,base,reqs,pending,inflight);
+            return(-1);
+         }
+         res = 0;
+      }
+
+      pending  -= res;
+      inflight += res;
+
+      res = vmfs_aio_reap(aio,fd,base,reqs);
+      inflight  -= res;
+      completed += res;
+   }
+
+   for(i=0;i<count;i++)
+      if (reqs[i].res != reqs[i].len)
+         return(-1);
+
+   return(0);
+}
+
+#else
+
+/* Create an asynchronous I/O context (NULL if not available) */
+vmfs_aio_t *vmfs_aio_create(u_int depth)
+{
+   return NULL;
+}
+
+/* Destroy an asynchronous I/O context */
+void vmfs_aio_destroy(vmfs_aio_t *aio)
+{
+}
+
+/* Read a batch of requests, synchronously */
+int vmfs_aio_read_batch(vmfs_aio_t *aio,int fd,off_t base,
+                        vmfs_io_req_t *reqs,int count)
+{
+   return(vmfs_aio_read_batch_sync(fd,base,reqs,count));
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_AIO_H
+#define VMFS_AIO_H
+
+/* 
+ * Default number of requests kept in flight by the asynchronous backend,
+ * when not set with the aio_depth flag.
+ */
+#define VMFS_AIO_QUEUE_DEPTH  32
+
+/* I/O request, as submitted in batches to devices */
+struct vmfs_io_req {
+   off_t pos;
+   u_char *buf;
+   size_t len;
+
+   /* Number of bytes transferred, or negative error code */
+   ssize_t res;
+};
+
+/* Create an asynchronous I/O context (NULL if not available) */
+vmfs_aio_t *vmfs_aio_create(u_int depth);
+
+/* Destroy an asynchronous I/O context */
+void vmfs_aio_destroy(vmfs_aio_t *aio);
+
+/* 
+ * Read a batch of requests on a file descriptor, with base added to each
+ * request position. Returns 0 if all requests completed successfully.
+ */
+int vmfs_aio_read_batch(vmfs_aio_t *aio,int fd,off_t base,
+                        vmfs_io_req_t *reqs,int count);
+
+/* Read a batch of requests synchronously, one after the other */
+int vmfs_aio_read_batch_sync(int fd,off_t base,vmfs_io_req_t *reqs,int count);
+
+#endif
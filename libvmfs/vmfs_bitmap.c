@@ -26,6 +26,7 @@
 #include <sys/types.h>
 
 #include "utils.h"
+#include "bitops.h"
 #include "vmfs.h"
 
 /* Read a bitmap header */
@@ -82,6 +83,48 @@ int vmfs_bme_write(const vmfs_bitmap_entry_t *bme,u_char *buf)
    return(0);
 }
 
+/* Get the bitmap a bitmap entry belongs to */
+static vmfs_bitmap_t *vmfs_bitmap_from_entry(const vmfs_fs_t *fs,
+                                             const vmfs_bitmap_entry_t *bme)
+{
+   switch(bme->mdh.magic) {
+      case VMFS_BITMAP_MAGIC_FBB:
+         return(fs->fbb);
+      case VMFS_BITMAP_MAGIC_SBC:
+         return(fs->sbc);
+      case VMFS_BITMAP_MAGIC_PBC:
+         return(fs->pbc);
+      case VMFS_BITMAP_MAGIC_FDC:
+         return(fs->fdc);
+      default:
+         return NULL;
+   }
+}
+
+/* Get the number of entries covered by the free items summary */
+static inline uint32_t vmfs_bitmap_summary_entries(const vmfs_bitmap_t *b)
+{
+   return(b->bmh.area_count * b->bmh.bmp_entries_per_area);
+}
+
+/* Record the number of free items of an entry in the summary */
+static void vmfs_bitmap_summary_set(vmfs_bitmap_t *b,uint32_t idx,
+                                    uint32_t free)
+{
+   if (!b)
+      return;
+
+   pthread_mutex_lock(&b->lock);
+
+   if (b->entry_free && (idx < vmfs_bitmap_summary_entries(b))) {
+      b->area_free[idx / b->bmh.bmp_entries_per_area] += free - 
+                                                         b->entry_free[idx];
+      b->entry_free[idx] = free;
+   }
+
+   pthread_mutex_unlock(&b->lock);
+}
+
 /* Update a bitmap entry on disk */
 int vmfs_bme_update(const vmfs_fs_t *fs,const vmfs_bitmap_entry_t *bme)
 {
@@ -93,6 +136,7 @@ int vmfs_bme_update(const vmfs_fs_t *fs,const vmfs_bitmap_entry_t *bme)
    if (vmfs_device_write(fs->dev,bme->mdh.pos,buf,buf_len) != buf_len)
       return(-1);
 
+   vmfs_bitmap_summary_set(vmfs_bitmap_from_entry(fs,bme),bme->id,bme->free);
    return(0);
 }
 
@@ -117,6 +161,7 @@ int vmfs_bitmap_get_entry(vmfs_bitmap_t *b,uint32_t entry,uint32_t item,
    DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
    uint32_t items_per_area;
    u_int entry_idx,area;
+   const u_char *map;
    off_t addr;
 
    addr = (entry * b->bmh.items_per_bitmap_entry) + item;
@@ -129,6 +174,12 @@ int vmfs_bitmap_get_entry(vmfs_bitmap_t *b,uint32_t entry,uint32_t item,
    addr = vmfs_bitmap_get_area_addr(&b->bmh,area);
    addr += entry_idx * VMFS_BITMAP_ENTRY_SIZE;
 
+   /* Decode in place when possible */
+   if ((map = vmfs_file_map(b->f,addr,buf_len)) != NULL) {
+      vmfs_bme_read(bmp_entry,map,1);
+      return(0);
+   }
+
    if (vmfs_file_pread(b->f,buf,buf_len,addr) != buf_len)
       return(-1);
 
@@ -164,6 +215,14 @@ bool vmfs_bitmap_get_item(vmfs_bitmap_t *b, uint32_t entry, uint32_t item,
    return(vmfs_file_pread(b->f,buf,b->bmh.data_size,pos) == b->bmh.data_size);
 }
 
+/* Get direct access to a bitmap item, if the device allows it */
+const u_char *vmfs_bitmap_map_item(vmfs_bitmap_t *b,uint32_t entry,
+                                   uint32_t item)
+{
+   off_t pos = vmfs_bitmap_get_item_pos(b,entry,item);
+   return(vmfs_file_map(b->f,pos,b->bmh.data_size));
+}
+
 /* Write a bitmap given its entry and item numbers */
 bool vmfs_bitmap_set_item(vmfs_bitmap_t *b,uint32_t entry,uint32_t item,
                           u_char *buf)
@@ -187,20 +246,9 @@ vmfs_bitmap_get_item_offset(const vmfs_bitmap_header_t *bmh,u_int addr,
 /* Update the first free item field */
 static void vmfs_bitmap_update_ffree(vmfs_bitmap_entry_t *entry)
 {
-   u_int array_idx,bit_idx;
-   int i;
-
-   entry->ffree = 0;
-
-   for(i=0;i<entry->total;i++) {
-      array_idx = i >> 3;
-      bit_idx   = i & 0x07;
+   int i = bitops_find_next_set(entry->bitmap,0,entry->total);
 
-      if (entry->bitmap[array_idx] & (1 << bit_idx)) {
-         entry->ffree = i;
-         break;
-      }
-   }
+   entry->ffree = (i < 0) ? 0 : i;
 }
 
 /* Mark an item as free or allocated */
@@ -258,40 +306,150 @@ int vmfs_bitmap_get_item_status(const vmfs_bitmap_header_t *bmh,
 /* Find a free item in a bitmap entry and mark it allocated */
 int vmfs_bitmap_alloc_item(vmfs_bitmap_entry_t *bmp_entry,uint32_t *item)
 {
-   u_int array_idx,bit_idx;
-   int i;
+   int i = -1;
+
+   /* Use the first free field as a hint */
+   if (bmp_entry->ffree < bmp_entry->total)
+      i = bitops_find_next_set(bmp_entry->bitmap,bmp_entry->ffree,
+                               bmp_entry->total);
 
-   /* TODO: use first free field as a hint */
+   if ((i < 0) &&
+       ((i = bitops_find_next_set(bmp_entry->bitmap,0,bmp_entry->total)) < 0))
+      return(-1);
 
-   for(i=0;i<bmp_entry->total;i++) {
-      array_idx = i >> 3;
-      bit_idx   = i & 0x07;
+   *item = i;
+   bmp_entry->bitmap[i >> 3] &= ~(1 << (i & 0x07));
+   bmp_entry->free--;
+   vmfs_bitmap_update_ffree(bmp_entry);
+   return(0);
+}
 
-      if (bmp_entry->bitmap[array_idx] & (1 << bit_idx)) {
-         *item = i;
-         bmp_entry->bitmap[array_idx] &= ~(1 << bit_idx);
-         bmp_entry->free--;
-         vmfs_bitmap_update_ffree(bmp_entry);
-         return(0);
+/* 
+ * Find the first run of free items starting in [from,to) holding "count"
+ * items, or else the longest one. Returns the length of the run found.
+ */
+static u_int vmfs_bitmap_find_run(const vmfs_bitmap_entry_t *bmp_entry,
+                                  u_int from,u_int to,u_int count,
+                                  int *run_start)
+{
+   int start,end;
+   u_int len,best_len = 0;
+
+   for(start=from;(u_int)start < to;start=end) {
+      if ((start = bitops_find_next_set(bmp_entry->bitmap,start,
+                                        bmp_entry->total)) < 0)
+         break;
+
+      if ((u_int)start >= to)
+         break;
+
+      if ((end = bitops_find_next_clear(bmp_entry->bitmap,start,
+                                        bmp_entry->total)) < 0)
+         end = bmp_entry->total;
+
+      len = end - start;
+
+      if (len > best_len) {
+         *run_start = start;
+         best_len = len;
+
+         if (best_len >= count)
+            break;
       }
    }
 
-   return(-1);
+   return(best_len);
 }
 
-/* Find a bitmap entry with at least "num_items" free in the specified area */
-int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
-                                     u_int area,u_int num_items,
-                                     vmfs_bitmap_entry_t *entry)
+/* 
+ * Mark up to "count" free items of a bitmap entry allocated, taking them
+ * from the first free run long enough to hold them all, or from the
+ * longest one. Runs at or after item "start" are looked at first.
+ * Returns the number of items allocated.
+ */
+int vmfs_bitmap_alloc_items(vmfs_bitmap_entry_t *bmp_entry,u_int start,
+                            u_int count,uint32_t *items)
+{
+   int run_start = 0,best_start = 0;
+   u_int len,best_len;
+   u_int i,n = 0;
+
+   if (start >= bmp_entry->total)
+      start = 0;
+
+   best_len = vmfs_bitmap_find_run(bmp_entry,start,bmp_entry->total,count,
+                                   &best_start);
+
+   if ((best_len < count) && (start > 0)) {
+      len = vmfs_bitmap_find_run(bmp_entry,0,start,count,&run_start);
+
+      if (len > best_len) {
+         best_start = run_start;
+         best_len = len;
+      }
+   }
+
+   /* Take the selected run first */
+   for(i=0;(i<best_len) && (n<count);i++) {
+      uint32_t item = best_start + i;
+      bmp_entry->bitmap[item >> 3] &= ~(1 << (item & 0x07));
+      items[n++] = item;
+   }
+
+   bmp_entry->free -= n;
+
+   /* Complete with whatever is left in the entry */
+   while((n < count) && (vmfs_bitmap_alloc_item(bmp_entry,&items[n]) == 0))
+      n++;
+
+   vmfs_bitmap_update_ffree(bmp_entry);
+   return(n);
+}
+
+/* 
+ * Lock the bitmap entry held in the given buffer if it has at least
+ * "num_items" free. The summary is refreshed with what is read.
+ */
+static int vmfs_bitmap_lock_free_entry(vmfs_bitmap_t *b,uint32_t idx,
+                                       u_char *ptr,u_int num_items,
+                                       vmfs_bitmap_entry_t *entry)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)vmfs_file_get_fs(b->f);
+
+   vmfs_bme_read(entry,ptr,1);
+   vmfs_bitmap_summary_set(b,idx,entry->free);
+
+   if ((vmfs_metadata_is_locked(&entry->mdh) && 
+        !vmfs_txn_holds(fs,entry->mdh.pos)) || (entry->free < num_items))
+      return(-1);
+
+   /* We now have to re-read the bitmap entry with the reservation taken */
+   if (vmfs_metadata_lock(fs,entry->mdh.pos,ptr,VMFS_BITMAP_ENTRY_SIZE,
+                          &entry->mdh))
+      return(-1);
+
+   vmfs_bme_read(entry,ptr,1);
+   vmfs_bitmap_summary_set(b,idx,entry->free);
+
+   if (entry->free < num_items) {
+      vmfs_metadata_unlock(fs,&entry->mdh);
+      return(-1);
+   }
+
+   return(0);
+}
+
+/* Find a bitmap entry in an area, with the bitmap lock held */
+static int vmfs_bitmap_area_find_free_items_locked(vmfs_bitmap_t *b,
+                                                   u_int area,u_int num_items,
+                                                   vmfs_bitmap_entry_t *entry)
 {
-   vmfs_fs_t *fs;
    u_char *buf,*ptr;
    size_t buf_len;
    off_t pos;
    int res = -1;
    int i;
 
-   fs = (vmfs_fs_t *)vmfs_file_get_fs(b->f);
    pos = vmfs_bitmap_get_area_addr(&b->bmh,area);
    buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
 
@@ -303,23 +461,10 @@ int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
 
    for(i=0;i<b->bmh.bmp_entries_per_area;i++) {
       ptr = buf + (i * VMFS_BITMAP_ENTRY_SIZE);
-      vmfs_bme_read(entry,ptr,1);
-
-      if (vmfs_metadata_is_locked(&entry->mdh) || (entry->free < num_items))
-         continue;
-
-      /* We now have to re-read the bitmap entry with the reservation taken */
-      if (!vmfs_metadata_lock(fs,entry->mdh.pos,
-                              ptr,VMFS_BITMAP_ENTRY_SIZE,
-                              &entry->mdh))
-      {      
-         vmfs_bme_read(entry,ptr,1);
-
-         if (entry->free < num_items) {
-            vmfs_metadata_unlock(fs,&entry->mdh);
-            continue;
-         }
 
+      if (!vmfs_bitmap_lock_free_entry(b,area*b->bmh.bmp_entries_per_area+i,
+                                       ptr,num_items,entry))
+      {
          res = 0;
          break;
       }
@@ -330,19 +475,171 @@ int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
    return(res);
 }
 
-/* Find a bitmap entry with at least "num_items" free (scan all areas) */
-int vmfs_bitmap_find_free_items(vmfs_bitmap_t *b,u_int num_items,
-                                vmfs_bitmap_entry_t *entry)
+/* Find a bitmap entry with at least "num_items" free in the specified area */
+int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
+                                     u_int area,u_int num_items,
+                                     vmfs_bitmap_entry_t *entry)
 {
-   u_int i;
+   int res;
+
+   pthread_mutex_lock(&b->lock);
+   res = vmfs_bitmap_area_find_free_items_locked(b,area,num_items,entry);
+   pthread_mutex_unlock(&b->lock);
+   return(res);
+}
+
+/* Build the in-core summary of free items, reading each area once */
+static int vmfs_bitmap_summary_build(vmfs_bitmap_t *b)
+{
+   vmfs_bitmap_entry_t entry;
+   uint32_t count,idx;
+   u_char *buf;
+   size_t buf_len;
+   u_int i,j;
+
+   if (b->entry_free)
+      return(0);
+
+   count = vmfs_bitmap_summary_entries(b);
+   buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
+
+   b->entry_free = calloc(count,sizeof(uint32_t));
+   b->area_free = calloc(b->bmh.area_count,sizeof(uint32_t));
+   buf = iobuffer_alloc(buf_len);
+
+   if (!b->entry_free || !b->area_free || !buf)
+      goto err;
+
+   for(i=0,idx=0;i<b->bmh.area_count;i++) {
+      if (vmfs_file_pread(b->f,buf,buf_len,
+                          vmfs_bitmap_get_area_addr(&b->bmh,i)) != buf_len)
+         goto err;
+
+      for(j=0;j<b->bmh.bmp_entries_per_area;j++,idx++) {
+         vmfs_bme_read(&entry,buf + (j * VMFS_BITMAP_ENTRY_SIZE),0);
+
+         if (entry.free > entry.total)
+            continue;
+
+         b->entry_free[idx] = entry.free;
+         b->area_free[i] += entry.free;
+      }
+   }
+
+   iobuffer_free(buf);
+   return(0);
+
+ err:
+   iobuffer_free(buf);
+   free(b->entry_free);
+   free(b->area_free);
+   b->entry_free = b->area_free = NULL;
+   return(-1);
+}
+
+/* Try to lock the entry "idx" if it may have "num_items" free */
+static int vmfs_bitmap_try_entry(vmfs_bitmap_t *b,uint32_t idx,
+                                 u_int num_items,vmfs_bitmap_entry_t *entry)
+{
+   DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
+   u_int area = idx / b->bmh.bmp_entries_per_area;
+   off_t pos;
+
+   if (b->entry_free && (b->entry_free[idx] < num_items))
+      return(-1);
+
+   pos  = vmfs_bitmap_get_area_addr(&b->bmh,area);
+   pos += (idx % b->bmh.bmp_entries_per_area) * VMFS_BITMAP_ENTRY_SIZE;
+
+   if (vmfs_file_pread(b->f,buf,buf_len,pos) != buf_len)
+      return(-1);
+
+   return(vmfs_bitmap_lock_free_entry(b,idx,buf,num_items,entry));
+}
+
+/* 
+ * Find a bitmap entry with at least "num_items" free, starting with the
+ * area of entry "first" from that entry, then going through the next
+ * areas. Candidates are taken from the in-core summary, and all areas are
+ * scanned when none of them is usable, since other hosts may have freed
+ * items in the meantime.
+ */
+static int vmfs_bitmap_scan_free_items(vmfs_bitmap_t *b,uint32_t first,
+                                       u_int num_items,
+                                       vmfs_bitmap_entry_t *entry)
+{
+   u_int epa = b->bmh.bmp_entries_per_area;
+   u_int i,j,area;
+
+   if (first >= vmfs_bitmap_summary_entries(b))
+      first = 0;
+
+   area = first / epa;
+
+   if (!vmfs_bitmap_summary_build(b)) {
+      for(i=0;i<b->bmh.area_count;i++) {
+         u_int a = (area + i) % b->bmh.area_count;
+         u_int from = (i == 0) ? first % epa : 0;
+
+         if (b->area_free[a] < num_items)
+            continue;
+
+         for(j=0;j<epa;j++)
+            if (!vmfs_bitmap_try_entry(b,(a * epa) + ((from + j) % epa),
+                                       num_items,entry))
+               return(0);
+      }
+   }
 
    for(i=0;i<b->bmh.area_count;i++)
-      if (!vmfs_bitmap_area_find_free_items(b,i,num_items,entry))
+      if (!vmfs_bitmap_area_find_free_items_locked(b,
+                                                   (area + i) % 
+                                                   b->bmh.area_count,
+                                                   num_items,entry))
          return(0);
 
    return(-1);
 }
 
+/* 
+ * Find a bitmap entry with at least "num_items" free (scan all areas),
+ * resuming from the entry where the previous search succeeded.
+ */
+int vmfs_bitmap_find_free_items(vmfs_bitmap_t *b,u_int num_items,
+                                vmfs_bitmap_entry_t *entry)
+{
+   int res;
+
+   pthread_mutex_lock(&b->lock);
+
+   if ((res = vmfs_bitmap_scan_free_items(b,b->cursor,num_items,entry)) == 0)
+      b->cursor = entry->id;
+
+   pthread_mutex_unlock(&b->lock);
+   return(res);
+}
+
+/* 
+ * Find a bitmap entry close to entry "hint": the hinted entry is taken as
+ * soon as it has a free item, otherwise the search for "num_items" free
+ * goes on with the rest of its area and then with the next areas.
+ */
+int vmfs_bitmap_find_free_items_near(vmfs_bitmap_t *b,uint32_t hint,
+                                     u_int num_items,
+                                     vmfs_bitmap_entry_t *entry)
+{
+   int res = 0;
+
+   pthread_mutex_lock(&b->lock);
+
+   if ((hint >= vmfs_bitmap_summary_entries(b)) ||
+       vmfs_bitmap_try_entry(b,hint,1,entry))
+      res = vmfs_bitmap_scan_free_items(b,hint,num_items,entry);
+
+   pthread_mutex_unlock(&b->lock);
+   return(res);
+}
+
 /* Count the total number of allocated items in a bitmap area */
 uint32_t vmfs_bitmap_area_allocated_items(vmfs_bitmap_t *b,u_int area)
 {
@@ -383,35 +680,35 @@ void vmfs_bitmap_area_foreach(vmfs_bitmap_t *b,u_int area,
                               vmfs_bitmap_foreach_cbk_t cbk,
                               void *opt_arg)
 {
-   DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
    vmfs_bitmap_entry_t entry;
-   off_t pos;
+   u_char *buf;
+   size_t buf_len;
    uint32_t addr;
-   u_int array_idx,bit_idx;
-   u_int i,j;
+   u_int i;
+   int j;
 
-   pos = vmfs_bitmap_get_area_addr(&b->bmh,area);
+   buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
 
-   for(i=0;i<b->bmh.bmp_entries_per_area;i++) {
-      if (vmfs_file_pread(b->f,buf,buf_len,pos) != buf_len)
-         break;
+   if (!(buf = iobuffer_alloc(buf_len)))
+      return;
 
-      vmfs_bme_read(&entry,buf,1);
+   if (vmfs_file_pread(b->f,buf,buf_len,
+                       vmfs_bitmap_get_area_addr(&b->bmh,area)) != buf_len)
+      goto done;
 
-      for(j=0;j<entry.total;j++) {
-         array_idx = j >> 3;
-         bit_idx   = j & 0x07;
-         
-         addr =  area * vmfs_bitmap_get_items_per_area(&b->bmh);
-         addr += i * b->bmh.items_per_bitmap_entry;
-         addr += j;
+   for(i=0;i<b->bmh.bmp_entries_per_area;i++) {
+      vmfs_bme_read(&entry,buf + (i * VMFS_BITMAP_ENTRY_SIZE),1);
 
-         if (!(entry.bitmap[array_idx] & (1 << bit_idx)))
-            cbk(b,addr,opt_arg);
-      }
+      addr =  area * vmfs_bitmap_get_items_per_area(&b->bmh);
+      addr += i * b->bmh.items_per_bitmap_entry;
 
-      pos += buf_len;
+      for(j=bitops_find_next_clear(entry.bitmap,0,entry.total);j >= 0;
+          j=bitops_find_next_clear(entry.bitmap,j+1,entry.total))
+         cbk(b,addr+j,opt_arg);
    }
+
+ done:
+   iobuffer_free(buf);
 }
 
 /* Call a user function for each allocated item in a bitmap */
@@ -432,8 +729,7 @@ int vmfs_bitmap_check(vmfs_bitmap_t *b)
    uint32_t total_items;
    uint32_t magic;
    uint32_t entry_id;
-   int i,j,k,errors;
-   int bmap_size;
+   int i,j,errors;
    int bmap_count;
    off_t pos;
 
@@ -479,12 +775,9 @@ int vmfs_bitmap_check(vmfs_bitmap_t *b)
          }
 
          /* check the bitmap array */
-         bmap_size = (entry.total + 7) / 8;
-         bmap_count = 0;
-
-         for(k=0;k<bmap_size;k++) {
-            bmap_count += bit_count(buf[VMFS_BME_OFS_BITMAP+k]);
-         }
+         bmap_count = bitops_count_set(&buf[VMFS_BME_OFS_BITMAP],
+                                       m_min(entry.total,
+                                             VMFS_BITMAP_BMP_MAX_SIZE * 8));
 
          if (bmap_count != entry.free) {
             printf("Entry 0x%x has an incorrect bitmap array "
@@ -513,6 +806,7 @@ int vmfs_bitmap_check(vmfs_bitmap_t *b)
 static inline vmfs_bitmap_t *vmfs_bitmap_open_from_file(vmfs_file_t *f)
 {
    DECL_ALIGNED_BUFFER(buf,512);
+   pthread_mutexattr_t attr;
    vmfs_bitmap_t *b;
 
    if (!f)
@@ -530,6 +824,14 @@ static inline vmfs_bitmap_t *vmfs_bitmap_open_from_file(vmfs_file_t *f)
 
    vmfs_bmh_read(&b->bmh, buf);
    b->f = f;
+
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&b->lock,&attr);
+   pthread_mutexattr_destroy(&attr);
+
+   b->cursor = vmfs_host_get_affinity(b->bmh.area_count) * 
+                  b->bmh.bmp_entries_per_area;
    return b;
 }
 
@@ -549,6 +851,9 @@ void vmfs_bitmap_close(vmfs_bitmap_t *b)
 {
    if (b != NULL) {
       vmfs_file_close(b->f);
+      free(b->entry_free);
+      free(b->area_free);
+      pthread_mutex_destroy(&b->lock);
       free(b);
    }
 }
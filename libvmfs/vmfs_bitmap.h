@@ -70,6 +70,22 @@ struct vmfs_bitmap_entry {
 struct vmfs_bitmap {
    vmfs_file_t *f;
    vmfs_bitmap_header_t bmh;
+
+   /* 
+    * In-core summary of free items per entry and per area, built on the
+    * first search for free items.
+    */
+   uint32_t *entry_free;
+   uint32_t *area_free;
+
+   /* 
+    * Entry where the next search for free items starts (next-fit). It
+    * initially points to an area derived from the host UUID.
+    */
+   uint32_t cursor;
+
+   /* Protects the summary and the cursor (recursive) */
+   pthread_mutex_t lock;
 };
 
 /* Callback prototype for vmfs_bitmap_foreach() */
@@ -96,6 +112,10 @@ off_t vmfs_bitmap_get_item_pos(vmfs_bitmap_t *b,uint32_t entry,uint32_t item);
 bool vmfs_bitmap_get_item(vmfs_bitmap_t *b, uint32_t entry, uint32_t item,
                           u_char *buf);
 
+/* Get direct access to a bitmap item, if the device allows it */
+const u_char *vmfs_bitmap_map_item(vmfs_bitmap_t *b,uint32_t entry,
+                                   uint32_t item);
+
 /* Write a bitmap given its entry and item numbers */
 bool vmfs_bitmap_set_item(vmfs_bitmap_t *b,uint32_t entry,uint32_t item,
                           u_char *buf);
@@ -114,6 +134,10 @@ int vmfs_bitmap_get_item_status(const vmfs_bitmap_header_t *bmh,
 /* Find a free item in a bitmap entry and mark it allocated */
 int vmfs_bitmap_alloc_item(vmfs_bitmap_entry_t *bmp_entry,uint32_t *item);
 
+/* Mark up to "count" free items of a bitmap entry allocated */
+int vmfs_bitmap_alloc_items(vmfs_bitmap_entry_t *bmp_entry,u_int start,
+                            u_int count,uint32_t *items);
+
 /* Find a bitmap entry with at least "num_items" free in the specified area */
 int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
                                      u_int area,u_int num_items,
@@ -123,6 +147,11 @@ int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
 int vmfs_bitmap_find_free_items(vmfs_bitmap_t *b,u_int num_items,
                                 vmfs_bitmap_entry_t *entry);
 
+/* Find a bitmap entry with free items, close to the entry "hint" */
+int vmfs_bitmap_find_free_items_near(vmfs_bitmap_t *b,uint32_t hint,
+                                     u_int num_items,
+                                     vmfs_bitmap_entry_t *entry);
+
 /* Count the total number of allocated items in a bitmap area */
 uint32_t vmfs_bitmap_area_allocated_items(vmfs_bitmap_t *b,u_int area);
 
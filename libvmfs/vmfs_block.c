@@ -94,9 +94,9 @@ int vmfs_block_get_status(const vmfs_fs_t *fs,uint32_t blk_id)
    return(vmfs_bitmap_get_item_status(&bmp->bmh,&entry,info.entry,info.item));
 }
 
-/* Allocate or free the specified block */
-static int vmfs_block_set_status(const vmfs_fs_t *fs,uint32_t blk_id,
-                                 int status)
+/* Allocate or free the specified block, with the transaction lock held */
+static int vmfs_block_set_status_locked(const vmfs_fs_t *fs,uint32_t blk_id,
+                                        int status)
 {
    DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
    vmfs_bitmap_entry_t entry;
@@ -128,9 +128,30 @@ static int vmfs_block_set_status(const vmfs_fs_t *fs,uint32_t blk_id,
    /* Update entry and release lock */
    vmfs_bme_update(fs,&entry);
    vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
+
+   /* A freed pointer block must not be served from the cache anymore */
+   if (!status && (info.type == VMFS_BLK_TYPE_PB))
+      vmfs_pbcache_invalidate(fs,blk_id);
    return(0);
 }
 
+/* 
+ * Allocate or free the specified block. Block allocation and release are
+ * made under the transaction lock, as they are the building blocks of
+ * transactions: this keeps the lock order (transaction, then bitmap).
+ */
+static int vmfs_block_set_status(const vmfs_fs_t *fs,uint32_t blk_id,
+                                 int status)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   int res;
+
+   pthread_mutex_lock(&wfs->txn_lock);
+   res = vmfs_block_set_status_locked(fs,blk_id,status);
+   pthread_mutex_unlock(&wfs->txn_lock);
+   return(res);
+}
+
 /* Allocate the specified block */
 int vmfs_block_alloc_specified(const vmfs_fs_t *fs,uint32_t blk_id)
 { 
@@ -143,20 +164,217 @@ int vmfs_block_free(const vmfs_fs_t *fs,uint32_t blk_id)
    return(vmfs_block_set_status(fs,blk_id,0));
 }
 
+/* Compare two block IDs by type, bitmap entry and item */
+static int vmfs_block_cmp(const void *a,const void *b)
+{
+   vmfs_block_info_t ia,ib;
+
+   vmfs_block_get_info(*(const uint32_t *)a,&ia);
+   vmfs_block_get_info(*(const uint32_t *)b,&ib);
+
+   if (ia.type != ib.type)
+      return((ia.type < ib.type) ? -1 : 1);
+
+   if (ia.entry != ib.entry)
+      return((ia.entry < ib.entry) ? -1 : 1);
+
+   if (ia.item != ib.item)
+      return((ia.item < ib.item) ? -1 : 1);
+
+   return(0);
+}
+
+/* Get the index of the bitmap entry holding a block */
+static inline uint32_t vmfs_block_entry_index(const vmfs_bitmap_t *bmp,
+                                              const vmfs_block_info_t *info)
+{
+   if (info->type == VMFS_BLK_TYPE_FB)
+      return(info->item / bmp->bmh.items_per_bitmap_entry);
+
+   return(info->entry);
+}
+
+/* 
+ * Free a list of blocks. The list is sorted, and the blocks held by the
+ * same bitmap entry are freed under a single metadata lock and a single
+ * entry update. Returns the number of blocks freed, or -1 if some of them
+ * could not be.
+ */
+static int vmfs_block_free_list_locked(const vmfs_fs_t *fs,
+                                       uint32_t *blk_ids,u_int count)
+{
+   DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
+   vmfs_bitmap_entry_t entry;
+   vmfs_block_info_t info,next;
+   vmfs_bitmap_t *bmp;
+   uint32_t idx;
+   u_int i,j;
+   int freed = 0,errors = 0;
+
+   qsort(blk_ids,count,sizeof(uint32_t),vmfs_block_cmp);
+
+   for(i=0;i<count;i=j) {
+      j = i + 1;
+
+      if ((vmfs_block_get_info(blk_ids[i],&info) == -1) ||
+          !(bmp = vmfs_fs_get_bitmap(fs,info.type)))
+      {
+         errors++;
+         continue;
+      }
+
+      /* Gather the blocks held by the same bitmap entry */
+      idx = vmfs_block_entry_index(bmp,&info);
+
+      while((j < count) && !vmfs_block_get_info(blk_ids[j],&next) &&
+            (next.type == info.type) &&
+            (vmfs_block_entry_index(bmp,&next) == idx))
+         j++;
+
+      if (vmfs_bitmap_get_entry(bmp,info.entry,info.item,&entry) == -1) {
+         errors += j - i;
+         continue;
+      }
+
+      /* Lock the bitmap entry and work on its up to date content */
+      if (vmfs_metadata_lock((vmfs_fs_t *)fs,entry.mdh.pos,
+                             buf,buf_len,&entry.mdh))
+      {
+         errors += j - i;
+         continue;
+      }
+
+      vmfs_bme_read(&entry,buf,1);
+
+      for(;i<j;i++) {
+         vmfs_block_get_info(blk_ids[i],&info);
+
+         if (vmfs_bitmap_set_item_status(&bmp->bmh,&entry,
+                                         info.entry,info.item,0) == -1)
+         {
+            errors++;
+            continue;
+         }
+
+         /* A freed pointer block must not be served from the cache */
+         if (info.type == VMFS_BLK_TYPE_PB)
+            vmfs_pbcache_invalidate(fs,blk_ids[i]);
+
+         freed++;
+      }
+
+      vmfs_bme_update(fs,&entry);
+      vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
+   }
+
+   return(errors ? -1 : freed);
+}
+
+/* Free a list of blocks */
+int vmfs_block_free_list(const vmfs_fs_t *fs,uint32_t *blk_ids,u_int count)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   int res;
+
+   pthread_mutex_lock(&wfs->txn_lock);
+   res = vmfs_block_free_list_locked(fs,blk_ids,count);
+   pthread_mutex_unlock(&wfs->txn_lock);
+   return(res);
+}
+
 /* Allocate a single block */
 int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint32_t *blk_id)
+{
+   int res;
+
+   if ((res = vmfs_block_alloc_range(fs,blk_type,0,1,blk_id)) < 0)
+      return(res);
+
+   return(0);
+}
+
+/* Build the block ID of an item of a bitmap entry */
+static uint32_t vmfs_block_build_id(const vmfs_bitmap_t *bmp,
+                                    uint32_t blk_type,uint32_t entry,
+                                    uint32_t item)
+{
+   uint32_t addr;
+
+   switch(blk_type) {
+      case VMFS_BLK_TYPE_FB:
+         addr = (entry * bmp->bmh.items_per_bitmap_entry) + item;
+         return(VMFS_BLK_FB_BUILD(addr, 0));
+      case VMFS_BLK_TYPE_SB:
+         return(VMFS_BLK_SB_BUILD(entry, item, 0));
+      case VMFS_BLK_TYPE_PB:
+         return(VMFS_BLK_PB_BUILD(entry, item, 0));
+      case VMFS_BLK_TYPE_FD:
+         return(VMFS_BLK_FD_BUILD(entry, item, 0));
+   }
+
+   return(0);
+}
+
+/* 
+ * Allocate up to "count" blocks from a single bitmap entry, under a single
+ * metadata lock. When "hint" is a block of the same type, the blocks
+ * following it are looked at first, then its entry and its area. Otherwise
+ * an entry able to hold all of them is preferred. Contiguous items are
+ * favoured within the entry. Returns the number of blocks allocated, at
+ * least one.
+ */
+static int vmfs_block_alloc_range_locked(const vmfs_fs_t *fs,
+                                         uint32_t blk_type,uint32_t hint,
+                                         u_int count,uint32_t *blk_ids)
 {
    vmfs_bitmap_t *bmp;
    vmfs_bitmap_entry_t entry;
-   uint32_t item,addr;
+   vmfs_block_info_t info;
+   uint32_t hint_entry,hint_item;
+   int i,n,res;
 
    if (!(bmp = vmfs_fs_get_bitmap(fs, blk_type)))
       return(-EINVAL);
 
-   if (vmfs_bitmap_find_free_items(bmp,1,&entry) == -1)
-      return(-ENOSPC);
+   if (count == 0)
+      return(-EINVAL);
+
+   if (count > bmp->bmh.items_per_bitmap_entry)
+      count = bmp->bmh.items_per_bitmap_entry;
+
+   if (hint && (VMFS_BLK_TYPE(hint) == blk_type) &&
+       !vmfs_block_get_info(hint,&info))
+   {
+      /* File blocks only carry the absolute item number */
+      if (blk_type == VMFS_BLK_TYPE_FB) {
+         hint_entry = (info.item + 1) / bmp->bmh.items_per_bitmap_entry;
+         hint_item  = (info.item + 1) % bmp->bmh.items_per_bitmap_entry;
+      } else {
+         hint_entry = info.entry;
+         hint_item  = info.item + 1;
+      }
+
+      res = vmfs_bitmap_find_free_items_near(bmp,hint_entry,count,&entry);
+
+      if ((res == -1) && (count > 1))
+         res = vmfs_bitmap_find_free_items_near(bmp,hint_entry,1,&entry);
+
+      if (res == -1)
+         return(-ENOSPC);
+
+      if (entry.id != hint_entry)
+         hint_item = 0;
+   } else {
+      if (((count == 1) || 
+           (vmfs_bitmap_find_free_items(bmp,count,&entry) == -1)) &&
+          (vmfs_bitmap_find_free_items(bmp,1,&entry) == -1))
+         return(-ENOSPC);
+
+      hint_item = 0;
+   }
 
-   if (vmfs_bitmap_alloc_item(&entry,&item) == -1) {
+   /* Items are stored in blk_ids, then converted in place */
+   if ((n = vmfs_bitmap_alloc_items(&entry,hint_item,count,blk_ids)) == 0) {
       vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
       return(-ENOSPC);
    }
@@ -164,23 +382,23 @@ int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint32_t *blk_id)
    vmfs_bme_update(fs,&entry);
    vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
 
-   switch(blk_type) {
-      case VMFS_BLK_TYPE_FB:
-         addr = (entry.id * bmp->bmh.items_per_bitmap_entry) + item;
-         *blk_id = VMFS_BLK_FB_BUILD(addr, 0);
-         break;
-      case VMFS_BLK_TYPE_SB:
-         *blk_id = VMFS_BLK_SB_BUILD(entry.id, item, 0);
-         break;
-      case VMFS_BLK_TYPE_PB:
-         *blk_id = VMFS_BLK_PB_BUILD(entry.id, item, 0);
-         break;
-      case VMFS_BLK_TYPE_FD:
-         *blk_id = VMFS_BLK_FD_BUILD(entry.id, item, 0);
-         break;
-   }
+   for(i=0;i<n;i++)
+      blk_ids[i] = vmfs_block_build_id(bmp,blk_type,entry.id,blk_ids[i]);
 
-   return(0);
+   return(n);
+}
+
+/* Allocate up to "count" blocks from a single bitmap entry */
+int vmfs_block_alloc_range(const vmfs_fs_t *fs,uint32_t blk_type,
+                           uint32_t hint,u_int count,uint32_t *blk_ids)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   int res;
+
+   pthread_mutex_lock(&wfs->txn_lock);
+   res = vmfs_block_alloc_range_locked(fs,blk_type,hint,count,blk_ids);
+   pthread_mutex_unlock(&wfs->txn_lock);
+   return(res);
 }
 
 /* Zeroize a file block */
@@ -214,8 +432,10 @@ int vmfs_block_free_pb(const vmfs_fs_t *fs,uint32_t pb_blk,
 {     
    DECL_ALIGNED_BUFFER(buf,fs->pbc->bmh.data_size);
    uint32_t pbc_entry,pbc_item;
-   uint32_t blk_id;
+   uint32_t *blk_ids;
+   u_int n = 0;
    int i,count = 0;
+   bool free_pb;
 
    if (VMFS_BLK_TYPE(pb_blk) != VMFS_BLK_TYPE_PB)
       return(-EINVAL);
@@ -223,26 +443,40 @@ int vmfs_block_free_pb(const vmfs_fs_t *fs,uint32_t pb_blk,
    pbc_entry = VMFS_BLK_PB_ENTRY(pb_blk);
    pbc_item  = VMFS_BLK_PB_ITEM(pb_blk);
 
-   if (!vmfs_bitmap_get_item(fs->pbc,pbc_entry,pbc_item,buf))
+   if (vmfs_pbcache_read(fs,pb_blk,0,buf,buf_len) == -1)
       return(-EIO);
 
+   /* Room for all the blocks referenced by the PB, and the PB itself */
+   if (!(blk_ids = malloc((buf_len / sizeof(uint32_t) + 1) * 
+                          sizeof(uint32_t))))
+      return(-ENOMEM);
+
    for(i=start;i<end;i++) {
-      blk_id = read_le32(buf,i*sizeof(uint32_t));
+      blk_ids[n] = read_le32(buf,i*sizeof(uint32_t));
 
-      if (blk_id != 0) {
-         vmfs_block_free(fs,blk_id);
+      if (blk_ids[n] != 0) {
          write_le32(buf,i*sizeof(uint32_t),0);
          count++;
+         n++;
       }
    }
 
-   if ((start == 0) && (end == (buf_len / sizeof(uint32_t))))
-      vmfs_block_free(fs,pb_blk);
+   free_pb = (start == 0) && (end == (buf_len / sizeof(uint32_t)));
+
+   if (free_pb)
+      blk_ids[n++] = pb_blk;
    else {
-      if (!vmfs_bitmap_set_item(fs->pbc,pbc_entry,pbc_item,buf))
+      if (!vmfs_bitmap_set_item(fs->pbc,pbc_entry,pbc_item,buf)) {
+         vmfs_pbcache_invalidate(fs,pb_blk);
+         free(blk_ids);
          return(-EIO);
+      }
+
+      vmfs_pbcache_update(fs,pb_blk,buf);
    }
 
+   vmfs_block_free_list(fs,blk_ids,n);
+   free(blk_ids);
    return(count);
 }
 
@@ -252,6 +486,7 @@ ssize_t vmfs_block_read_sb(const vmfs_fs_t *fs,uint32_t blk_id,off_t pos,
 {
    DECL_ALIGNED_BUFFER_WOL(tmpbuf,fs->sbc->bmh.data_size);
    uint32_t offset,sbc_entry,sbc_item;
+   const u_char *map;
    size_t clen;
 
    offset = pos % fs->sbc->bmh.data_size;
@@ -260,6 +495,11 @@ ssize_t vmfs_block_read_sb(const vmfs_fs_t *fs,uint32_t blk_id,off_t pos,
    sbc_entry = VMFS_BLK_SB_ENTRY(blk_id);
    sbc_item  = VMFS_BLK_SB_ITEM(blk_id);
 
+   if ((map = vmfs_bitmap_map_item(fs->sbc,sbc_entry,sbc_item)) != NULL) {
+      memcpy(buf,map+offset,clen);
+      return(clen);
+   }
+
    if (!vmfs_bitmap_get_item(fs->sbc,sbc_entry,sbc_item,tmpbuf))
       return(-EIO);
 
@@ -346,6 +586,61 @@ ssize_t vmfs_block_read_fb(const vmfs_fs_t *fs,uint32_t blk_id,off_t pos,
    return(clen);
 }
 
+/* 
+ * Read a piece of a run of physically contiguous file blocks, starting
+ * at the given offset from the beginning of the first block.
+ */
+ssize_t vmfs_block_read_fb_run(const vmfs_fs_t *fs,uint32_t blk_id,
+                               uint64_t offset,u_char *buf,size_t len)
+{
+   uint64_t n_offset;
+   size_t n_len,clen,n_clen,rlen;
+   uint32_t fb_item;
+   u_char *tmpbuf;
+
+   /* Use "normalized" offset / length to access data (for direct I/O) */
+   n_offset = offset & ~(M_DIO_BLK_SIZE - 1);
+   n_len    = ALIGN_NUM(len + (offset - n_offset),M_DIO_BLK_SIZE);
+
+   fb_item = VMFS_BLK_FB_ITEM(blk_id);
+
+   /* If everything is aligned for direct I/O, store directly in user buffer */
+   if ((n_offset == offset) && (n_len == len) &&
+       ALIGN_CHECK((uintptr_t)buf,M_DIO_BLK_SIZE))
+   {
+      if (vmfs_fs_read(fs,fb_item,n_offset,buf,n_len) != n_len)
+         return(-EIO);
+
+      return(n_len);
+   }
+
+   /* 
+    * Stage the data in a temporary buffer, a bounded chunk at a time, and
+    * copy it to the user buffer.
+    */
+   if (!(tmpbuf = iobuffer_alloc(m_min(n_len,VMFS_BLOCK_STAGING_SIZE))))
+      return(-ENOMEM);
+
+   for(rlen=0;rlen < len;rlen += clen) {
+      n_clen = m_min(n_len,VMFS_BLOCK_STAGING_SIZE);
+      clen   = m_min(len - rlen,n_clen - (offset - n_offset));
+
+      if (vmfs_fs_read(fs,fb_item,n_offset,tmpbuf,n_clen) != n_clen) {
+         iobuffer_free(tmpbuf);
+         return(-EIO);
+      }
+
+      memcpy(buf+rlen,tmpbuf+(offset-n_offset),clen);
+
+      offset   += clen;
+      n_offset += n_clen;
+      n_len    -= n_clen;
+   }
+
+   iobuffer_free(tmpbuf);
+   return(len);
+}
+
 /* Write a piece of a file block */
 ssize_t vmfs_block_write_fb(const vmfs_fs_t *fs,uint32_t blk_id,off_t pos,
                             u_char *buf,size_t len)
@@ -164,9 +164,16 @@ int vmfs_block_alloc_specified(const vmfs_fs_t *fs,uint32_t blk_id);
 /* Free the specified block */
 int vmfs_block_free(const vmfs_fs_t *fs,uint32_t blk_id);
 
+/* Free a list of blocks, grouped by bitmap entry (the list is sorted) */
+int vmfs_block_free_list(const vmfs_fs_t *fs,uint32_t *blk_ids,u_int count);
+
 /* Allocate a single block */
 int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint32_t *blk_id);
 
+/* Allocate up to "count" blocks, preferring a contiguous run after "hint" */
+int vmfs_block_alloc_range(const vmfs_fs_t *fs,uint32_t blk_type,
+                           uint32_t hint,u_int count,uint32_t *blk_ids);
+
 /* Zeroize a file block */
 int vmfs_block_zeroize_fb(const vmfs_fs_t *fs,uint32_t blk_id);
 
@@ -186,6 +193,16 @@ ssize_t vmfs_block_write_sb(const vmfs_fs_t *fs,uint32_t blk_id,off_t pos,
 ssize_t vmfs_block_read_fb(const vmfs_fs_t *fs,uint32_t blk_id,off_t pos,
                            u_char *buf,size_t len);
 
+/* Size of the chunks unaligned reads of file block runs are staged in */
+#define VMFS_BLOCK_STAGING_SIZE  0x100000
+
+/* 
+ * Read a piece of a run of physically contiguous file blocks, starting
+ * at the given offset from the beginning of the first block.
+ */
+ssize_t vmfs_block_read_fb_run(const vmfs_fs_t *fs,uint32_t blk_id,
+                               uint64_t offset,u_char *buf,size_t len);
+
 /* Write a piece of a file block */
 ssize_t vmfs_block_write_fb(const vmfs_fs_t *fs,uint32_t blk_id,off_t pos,
                             u_char *buf,size_t len);
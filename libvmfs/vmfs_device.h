@@ -24,26 +24,146 @@ struct vmfs_device {
                    u_char *buf, size_t len);
    ssize_t (*write)(const vmfs_device_t *dev, off_t pos,
                     const u_char *buf, size_t len);
+   ssize_t (*readv)(const vmfs_device_t *dev, off_t pos,
+                    const struct iovec *iov, int iovcnt);
+   ssize_t (*writev)(const vmfs_device_t *dev, off_t pos,
+                     const struct iovec *iov, int iovcnt);
+   int (*read_batch)(const vmfs_device_t *dev, vmfs_io_req_t *reqs,
+                     int count);
+   const u_char *(*map)(const vmfs_device_t *dev, off_t pos, size_t len);
+   int (*locate)(const vmfs_device_t *dev, off_t pos, size_t len,
+                 off_t *fd_pos);
    int (*reserve)(const vmfs_device_t *dev, off_t pos);
    int (*release)(const vmfs_device_t *dev, off_t pos);
    void (*close)(vmfs_device_t *dev);
    uuid_t *uuid;
+   vmfs_mcache_t *cache;
 };
 
 static inline ssize_t vmfs_device_read(const vmfs_device_t *dev, off_t pos,
                                        u_char *buf, size_t len)
 {
+   if (dev->cache)
+      return vmfs_mcache_read(dev, pos, buf, len);
    return dev->read(dev, pos, buf, len);
 }
 
 static inline ssize_t vmfs_device_write(const vmfs_device_t *dev, off_t pos,
                                         const u_char *buf, size_t len)
 {
-   if (dev->write)
-      return dev->write(dev, pos, buf, len);
+   ssize_t res;
+
+   if (!dev->write)
+      return -1;
+
+   res = dev->write(dev, pos, buf, len);
+
+   /* Keep cached metadata in sync with the device */
+   if (dev->cache) {
+      if (res == len)
+         vmfs_mcache_update(dev->cache, pos, buf, len);
+      else
+         vmfs_mcache_invalidate(dev->cache, pos, len);
+   }
+   return res;
+}
+
+/* Read into several buffers, one at a time if the device can't do better */
+static inline ssize_t vmfs_device_readv(const vmfs_device_t *dev, off_t pos,
+                                        const struct iovec *iov, int iovcnt)
+{
+   ssize_t res, len = 0;
+   int i;
+
+   if (dev->readv)
+      return dev->readv(dev, pos, iov, iovcnt);
+
+   for (i = 0; i < iovcnt; i++) {
+      res = vmfs_device_read(dev, pos + len, iov[i].iov_base, iov[i].iov_len);
+      if (res < 0)
+         return res;
+      len += res;
+      if (res != iov[i].iov_len)
+         break;
+   }
+   return len;
+}
+
+/* Write several buffers, one at a time if the device can't do better */
+static inline ssize_t vmfs_device_writev(const vmfs_device_t *dev, off_t pos,
+                                         const struct iovec *iov, int iovcnt)
+{
+   ssize_t res, len = 0;
+   int i;
+
+   if (dev->writev) {
+      res = dev->writev(dev, pos, iov, iovcnt);
+      if (dev->cache)
+         vmfs_mcache_invalidate(dev->cache, pos, m_iov_length(iov, iovcnt));
+      return res;
+   }
+
+   for (i = 0; i < iovcnt; i++) {
+      res = vmfs_device_write(dev, pos + len, iov[i].iov_base, iov[i].iov_len);
+      if (res < 0)
+         return res;
+      len += res;
+      if (res != iov[i].iov_len)
+         break;
+   }
+   return len;
+}
+
+/* 
+ * Read a batch of requests, keeping as many of them in flight as the device
+ * allows. Returns 0 if all requests completed successfully.
+ */
+static inline int vmfs_device_read_batch(const vmfs_device_t *dev,
+                                         vmfs_io_req_t *reqs, int count)
+{
+   int i, res = 0;
+
+   if (dev->read_batch)
+      return dev->read_batch(dev, reqs, count);
+
+   for (i = 0; i < count; i++) {
+      reqs[i].res = vmfs_device_read(dev, reqs[i].pos, reqs[i].buf,
+                                     reqs[i].len);
+      if (reqs[i].res != reqs[i].len)
+         res = -1;
+   }
+   return res;
+}
+
+/* 
+ * Get direct access to device data, when the device is memory mapped.
+ * Returns NULL when the data has to be read instead.
+ */
+static inline const u_char *vmfs_device_map(const vmfs_device_t *dev,
+                                            off_t pos, size_t len)
+{
+   if (dev->map)
+      return dev->map(dev, pos, len);
+   return NULL;
+}
+
+/* 
+ * Get the file descriptor holding device data, and the data position in
+ * it, so that it can be read without going through the device. Returns -1
+ * when the range is not held by a single file that can be read directly.
+ */
+static inline int vmfs_device_locate(const vmfs_device_t *dev, off_t pos,
+                                     size_t len, off_t *fd_pos)
+{
+   if (dev->locate)
+      return dev->locate(dev, pos, len, fd_pos);
    return -1;
 }
 
+/* 
+ * Reserve the device around the given position. Returns 1 when a
+ * reservation was taken, 0 when the device doesn't support them.
+ */
 static inline int vmfs_device_reserve(const vmfs_device_t *dev, off_t pos)
 {
    if (dev->reserve)
@@ -0,0 +1,397 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * VMFS directory cache.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "vmfs.h"
+
+/* Create a directory cache */
+vmfs_dircache_t *vmfs_dircache_create(u_int max_entries)
+{
+   vmfs_dircache_t *dc;
+
+   if (!(dc = calloc(1,sizeof(*dc))))
+      return NULL;
+
+   dc->max_entries = max_entries;
+   pthread_mutex_init(&dc->lock,NULL);
+   return dc;
+}
+
+/* Free an entry */
+static void vmfs_dircache_free(vmfs_dircache_entry_t *entry)
+{
+   free(entry->index);
+   free(entry->buf);
+   free(entry);
+}
+
+/* Destroy a directory cache */
+void vmfs_dircache_destroy(vmfs_dircache_t *dc)
+{
+   vmfs_dircache_entry_t *entry,*next;
+
+   if (!dc)
+      return;
+
+   for(entry=dc->lru_head;entry;entry=next) {
+      next = entry->lru_next;
+      vmfs_dircache_free(entry);
+   }
+
+   pthread_mutex_destroy(&dc->lock);
+   free(dc);
+}
+
+/* Hash function for a directory block ID */
+static inline u_int vmfs_dircache_hash(uint32_t blk_id)
+{
+   return((blk_id ^ (blk_id >> 6) ^ (blk_id >> 22)) %
+          VMFS_DIRCACHE_HASH_BUCKETS);
+}
+
+/* Hash function for an entry name (FNV-1a) */
+static u_int vmfs_dircache_name_hash(const char *name)
+{
+   u_int i,h = 2166136261U;
+
+   for(i=0;(i<VMFS_DIRENT_OFS_NAME_SIZE) && name[i];i++)
+      h = (h ^ (u_char)name[i]) * 16777619U;
+
+   return(h);
+}
+
+/* Get the name of the entry at the given position */
+static inline const char *
+vmfs_dircache_entry_name(const vmfs_dircache_entry_t *entry,u_int pos)
+{
+   return((const char *)vmfs_dircache_entry_data(entry) +
+          pos * VMFS_DIRENT_SIZE + VMFS_DIRENT_OFS_NAME);
+}
+
+/*
+ * Index the entries of a directory by name. When a name appears several
+ * times, the first entry wins, as with a sequential scan.
+ */
+static int vmfs_dircache_build_index(vmfs_dircache_entry_t *entry)
+{
+   u_int i,h,count,mask;
+   const char *name;
+
+   count = entry->size / VMFS_DIRENT_SIZE;
+
+   for(mask=15;mask<count*2;mask=(mask << 1) | 1)
+      ;
+
+   if (!(entry->index = calloc(mask+1,sizeof(u_int))))
+      return(-1);
+
+   entry->index_mask = mask;
+
+   for(i=0;i<count;i++) {
+      name = vmfs_dircache_entry_name(entry,i);
+      h = vmfs_dircache_name_hash(name) & mask;
+
+      while (entry->index[h] &&
+             strncmp(vmfs_dircache_entry_name(entry,entry->index[h]-1),
+                     name,VMFS_DIRENT_OFS_NAME_SIZE))
+         h = (h + 1) & mask;
+
+      if (!entry->index[h])
+         entry->index[h] = i + 1;
+   }
+
+   return(0);
+}
+
+/* Find the position of an entry by name, -1 if not found */
+int vmfs_dircache_find(const vmfs_dircache_entry_t *entry,const char *name)
+{
+   u_int h,pos;
+
+   if (strlen(name) > VMFS_DIRENT_OFS_NAME_SIZE)
+      return(-1);
+
+   h = vmfs_dircache_name_hash(name) & entry->index_mask;
+
+   while ((pos = entry->index[h]) != 0) {
+      if (!strncmp(vmfs_dircache_entry_name(entry,pos-1),name,
+                   VMFS_DIRENT_OFS_NAME_SIZE))
+         return(pos - 1);
+
+      h = (h + 1) & entry->index_mask;
+   }
+
+   return(-1);
+}
+
+/* Check that an entry was read from the current version of a directory */
+static bool vmfs_dircache_current(const vmfs_dircache_entry_t *entry,
+                                  const vmfs_inode_t *inode)
+{
+   return((entry->dir_size == inode->size) &&
+          (entry->obj_seq == inode->mdh.obj_seq) &&
+          (entry->mtime == inode->mtime) &&
+          (entry->blk_gen == inode->blk_gen));
+}
+
+/* Read the content of a directory and index it */
+static vmfs_dircache_entry_t *vmfs_dircache_load(vmfs_file_t *dir)
+{
+   vmfs_dircache_entry_t *entry;
+
+   if (!(entry = calloc(1,sizeof(*entry))))
+      return NULL;
+
+   entry->blk_id = dir->inode->id;
+   entry->ref_count = 1;
+   entry->dir_size = dir->inode->size;
+   entry->obj_seq = dir->inode->mdh.obj_seq;
+   entry->mtime = dir->inode->mtime;
+   entry->blk_gen = dir->inode->blk_gen;
+   entry->size = vmfs_file_get_size(dir);
+   entry->size -= entry->size % VMFS_DIRENT_SIZE;
+
+   /* Use the directory content in place when possible */
+   if (!(entry->map = vmfs_file_map(dir,0,entry->size))) {
+      if (!(entry->buf = malloc(entry->size + 1)) ||
+          (vmfs_file_pread(dir,entry->buf,entry->size,0) != entry->size))
+      {
+         vmfs_dircache_free(entry);
+         return NULL;
+      }
+   }
+
+   if (vmfs_dircache_build_index(entry) == -1) {
+      vmfs_dircache_free(entry);
+      return NULL;
+   }
+
+   return entry;
+}
+
+/* Remove an entry from the LRU list */
+static void vmfs_dircache_lru_unlink(vmfs_dircache_t *dc,
+                                     vmfs_dircache_entry_t *entry)
+{
+   if (entry->lru_prev)
+      entry->lru_prev->lru_next = entry->lru_next;
+   else
+      dc->lru_head = entry->lru_next;
+
+   if (entry->lru_next)
+      entry->lru_next->lru_prev = entry->lru_prev;
+   else
+      dc->lru_tail = entry->lru_prev;
+}
+
+/* Put an entry at the head of the LRU list */
+static void vmfs_dircache_lru_push(vmfs_dircache_t *dc,
+                                   vmfs_dircache_entry_t *entry)
+{
+   entry->lru_prev = NULL;
+   entry->lru_next = dc->lru_head;
+
+   if (dc->lru_head)
+      dc->lru_head->lru_prev = entry;
+   else
+      dc->lru_tail = entry;
+
+   dc->lru_head = entry;
+}
+
+/* Find a cached directory */
+static vmfs_dircache_entry_t *vmfs_dircache_lookup(vmfs_dircache_t *dc,
+                                                   uint32_t blk_id)
+{
+   vmfs_dircache_entry_t *entry;
+
+   for(entry=dc->buckets[vmfs_dircache_hash(blk_id)];entry;entry=entry->next)
+      if (entry->blk_id == blk_id)
+         return entry;
+
+   return NULL;
+}
+
+/* Take an entry out of the cache and drop the cache reference */
+static void vmfs_dircache_remove(vmfs_dircache_t *dc,
+                                 vmfs_dircache_entry_t *entry)
+{
+   vmfs_dircache_lru_unlink(dc,entry);
+
+   if (entry->next != NULL)
+      entry->next->pprev = entry->pprev;
+
+   *(entry->pprev) = entry->next;
+   entry->pprev = NULL;
+   dc->entries--;
+
+   if (--entry->ref_count == 0)
+      vmfs_dircache_free(entry);
+}
+
+/* Drop a modified directory from the cache, with the lock held */
+static void vmfs_dircache_drop(vmfs_dircache_t *dc,vmfs_dircache_entry_t *entry)
+{
+   entry->stale = true;
+   vmfs_dircache_remove(dc,entry);
+   dc->gen++;
+}
+
+/* Insert an entry, recycling the least recently used one if needed */
+static void vmfs_dircache_insert(vmfs_dircache_t *dc,
+                                 vmfs_dircache_entry_t *entry)
+{
+   u_int hb;
+
+   if ((dc->entries >= dc->max_entries) && dc->lru_tail)
+      vmfs_dircache_remove(dc,dc->lru_tail);
+
+   hb = vmfs_dircache_hash(entry->blk_id);
+   entry->next  = dc->buckets[hb];
+   entry->pprev = &dc->buckets[hb];
+
+   if (entry->next != NULL)
+      entry->next->pprev = &entry->next;
+
+   dc->buckets[hb] = entry;
+   vmfs_dircache_lru_push(dc,entry);
+   dc->entries++;
+   entry->ref_count++;
+}
+
+/* Take a reference on a cached directory, with the lock held */
+static vmfs_dircache_entry_t *vmfs_dircache_hit(vmfs_dircache_t *dc,
+                                                uint32_t blk_id)
+{
+   vmfs_dircache_entry_t *entry;
+
+   if (!(entry = vmfs_dircache_lookup(dc,blk_id)))
+      return NULL;
+
+   if (entry != dc->lru_head) {
+      vmfs_dircache_lru_unlink(dc,entry);
+      vmfs_dircache_lru_push(dc,entry);
+   }
+
+   entry->ref_count++;
+   return entry;
+}
+
+/*
+ * Get the cached content of a directory, reading it if needed. The cache
+ * lock is not held during the read: if a directory was modified in the
+ * meantime, the content is returned as stale and not cached. Content read
+ * from another version of the directory inode is read again.
+ */
+vmfs_dircache_entry_t *vmfs_dircache_get(vmfs_file_t *dir)
+{
+   vmfs_dircache_t *dc = vmfs_file_get_fs(dir)->dircache;
+   vmfs_dircache_entry_t *entry,*cur;
+   uint32_t blk_id = dir->inode->id;
+   u_int gen;
+
+   pthread_mutex_lock(&dc->lock);
+
+   if ((entry = vmfs_dircache_hit(dc,blk_id)) != NULL) {
+      if (vmfs_dircache_current(entry,dir->inode)) {
+         dc->hits++;
+         pthread_mutex_unlock(&dc->lock);
+         return entry;
+      }
+
+      /* Changed by another host */
+      vmfs_dircache_drop(dc,entry);
+
+      if (--entry->ref_count == 0)
+         vmfs_dircache_free(entry);
+   }
+
+   dc->misses++;
+   gen = dc->gen;
+   pthread_mutex_unlock(&dc->lock);
+
+   if (!(entry = vmfs_dircache_load(dir)))
+      return NULL;
+
+   pthread_mutex_lock(&dc->lock);
+
+   if (gen != dc->gen) {
+      entry->stale = true;
+   } else if ((cur = vmfs_dircache_hit(dc,blk_id)) != NULL) {
+      vmfs_dircache_free(entry);
+      entry = cur;
+   } else {
+      vmfs_dircache_insert(dc,entry);
+   }
+
+   pthread_mutex_unlock(&dc->lock);
+   return entry;
+}
+
+/* Release a cached directory content */
+void vmfs_dircache_put(const vmfs_fs_t *fs,vmfs_dircache_entry_t *entry)
+{
+   vmfs_dircache_t *dc = fs->dircache;
+
+   pthread_mutex_lock(&dc->lock);
+
+   if (--entry->ref_count == 0)
+      vmfs_dircache_free(entry);
+
+   pthread_mutex_unlock(&dc->lock);
+}
+
+/* Drop a directory from the cache after it has been modified */
+void vmfs_dircache_invalidate(const vmfs_fs_t *fs,uint32_t blk_id)
+{
+   vmfs_dircache_t *dc = fs->dircache;
+   vmfs_dircache_entry_t *entry;
+
+   pthread_mutex_lock(&dc->lock);
+
+   if ((entry = vmfs_dircache_lookup(dc,blk_id)) != NULL)
+      vmfs_dircache_drop(dc,entry);
+   else
+      dc->gen++;
+
+   pthread_mutex_unlock(&dc->lock);
+}
+
+/* Check whether a cached directory content is outdated */
+bool vmfs_dircache_stale(vmfs_file_t *dir,vmfs_dircache_entry_t *entry)
+{
+   vmfs_dircache_t *dc = vmfs_file_get_fs(dir)->dircache;
+   bool res;
+
+   pthread_mutex_lock(&dc->lock);
+   res = entry->stale || !vmfs_dircache_current(entry,dir->inode);
+   pthread_mutex_unlock(&dc->lock);
+   return(res);
+}
+
+/* Show cache statistics */
+void vmfs_dircache_show_stats(const vmfs_dircache_t *dc)
+{
+   printf("Directory cache: %u/%u entries, "
+          "%"PRIu64" hits, %"PRIu64" misses\n",
+          dc->entries,dc->max_entries,dc->hits,dc->misses);
+}
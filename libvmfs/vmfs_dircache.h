@@ -0,0 +1,111 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_DIRCACHE_H
+#define VMFS_DIRCACHE_H
+
+/*
+ * Directory cache. The content of recently opened directories is kept
+ * in-core along with an index from entry names to entry positions, and
+ * shared by all the handles of a directory. Entries are reference counted,
+ * so that an invalidated entry stays valid for the handles still using it.
+ * Other hosts may change directories too: an entry is only used as long
+ * as the directory inode matches the one its content was read from.
+ */
+
+/* Maximum number of directories kept in-core */
+#define VMFS_DIRCACHE_MAX_ENTRIES  64
+
+#define VMFS_DIRCACHE_HASH_BUCKETS  64
+
+struct vmfs_dircache_entry {
+   uint32_t blk_id;
+   u_int ref_count;
+
+   /* Set once the directory has been modified */
+   bool stale;
+
+   /* Version of the directory inode the content was read from */
+   uint64_t dir_size,obj_seq;
+   time_t mtime;
+   u_int blk_gen;
+
+   /* Directory content, either mapped from the device or copied */
+   off_t size;
+   const u_char *map;
+   u_char *buf;
+
+   /* Open addressing index of entry positions (+1) by name */
+   u_int *index;
+   u_int index_mask;
+
+   /* Hash chain, NULL pprev once out of the cache */
+   vmfs_dircache_entry_t **pprev,*next;
+
+   /* LRU list (most recently used first) */
+   vmfs_dircache_entry_t *lru_prev,*lru_next;
+};
+
+/* === Directory cache === */
+struct vmfs_dircache {
+   u_int max_entries;
+   u_int entries;
+
+   vmfs_dircache_entry_t *buckets[VMFS_DIRCACHE_HASH_BUCKETS];
+   vmfs_dircache_entry_t *lru_head,*lru_tail;
+
+   /* Incremented on each invalidation */
+   u_int gen;
+
+   /* Statistics */
+   uint64_t hits,misses;
+
+   pthread_mutex_t lock;
+};
+
+/* Get the content of a cached entry */
+static inline const u_char *
+vmfs_dircache_entry_data(const vmfs_dircache_entry_t *entry)
+{
+   return(entry->map ? entry->map : entry->buf);
+}
+
+/* Create a directory cache */
+vmfs_dircache_t *vmfs_dircache_create(u_int max_entries);
+
+/* Destroy a directory cache */
+void vmfs_dircache_destroy(vmfs_dircache_t *dc);
+
+/* Get the cached content of a directory, reading it if needed */
+vmfs_dircache_entry_t *vmfs_dircache_get(vmfs_file_t *dir);
+
+/* Release a cached directory content */
+void vmfs_dircache_put(const vmfs_fs_t *fs,vmfs_dircache_entry_t *entry);
+
+/* Drop a directory from the cache after it has been modified */
+void vmfs_dircache_invalidate(const vmfs_fs_t *fs,uint32_t blk_id);
+
+/* Check whether a cached directory content is outdated */
+bool vmfs_dircache_stale(vmfs_file_t *dir,vmfs_dircache_entry_t *entry);
+
+/* Find the position of an entry by name, -1 if not found */
+int vmfs_dircache_find(const vmfs_dircache_entry_t *entry,const char *name);
+
+/* Show cache statistics */
+void vmfs_dircache_show_stats(const vmfs_dircache_t *dc);
+
+#endif
@@ -46,11 +46,44 @@ static int vmfs_dirent_write(const vmfs_dirent_t *entry,u_char *buf)
    return(0);
 }
 
+/* Get the cached content of a directory */
+static int vmfs_dir_cache_entries(vmfs_dir_t *d)
+{
+   if (d->cache != NULL)
+      vmfs_dircache_put(vmfs_dir_get_fs(d),d->cache);
+
+   d->cache = vmfs_dircache_get(d->dir);
+   return(d->cache ? 0 : -1);
+}
+
+/* Refresh the content of a directory after it has been modified */
+static void vmfs_dir_refresh(vmfs_dir_t *d)
+{
+   vmfs_dircache_invalidate(vmfs_dir_get_fs(d),d->dir->inode->id);
+   vmfs_dir_cache_entries(d);
+}
+
 /* Search for an entry into a directory ; affects position of the next
 entry vmfs_dir_read will return */
 const vmfs_dirent_t *vmfs_dir_lookup(vmfs_dir_t *d,const char *name)
 {
    const vmfs_dirent_t *rec;
+   int pos;
+
+   /* Use the name index when the directory content is cached */
+   if (d && d->cache && vmfs_dircache_stale(d->dir,d->cache))
+      vmfs_dir_cache_entries(d);
+
+   if (d && d->cache) {
+      if ((pos = vmfs_dircache_find(d->cache,name)) == -1)
+         return(NULL);
+
+      vmfs_dirent_read(&d->dirent,&vmfs_dircache_entry_data(d->cache)
+                                    [pos*VMFS_DIRENT_SIZE]);
+      vmfs_dir_seek(d,pos+1);
+      return(&d->dirent);
+   }
+
    vmfs_dir_seek(d,0);
 
    while((rec = vmfs_dir_read(d))) {
@@ -177,27 +210,6 @@ uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
    return(ret);
 }
 
-/* Cache content of a directory */
-static int vmfs_dir_cache_entries(vmfs_dir_t *d)
-{
-   off_t dir_size;
-
-   if (d->buf != NULL)
-      free(d->buf);
-
-   dir_size = vmfs_file_get_size(d->dir);
-
-   if (!(d->buf = calloc(1,dir_size)))
-      return(-1);
-
-   if (vmfs_file_pread(d->dir,d->buf,dir_size,0) != dir_size) {
-      free(d->buf);
-      return(-1);
-   }
-
-   return(0);
-}
-
 /* Open a directory file */
 static vmfs_dir_t *vmfs_dir_open_from_file(vmfs_file_t *file)
 {
@@ -239,14 +251,18 @@ vmfs_dir_t *vmfs_dir_open_at(vmfs_dir_t *d,const char *path)
 by subsequent calls */
 const vmfs_dirent_t *vmfs_dir_read(vmfs_dir_t *d)
 {
-   u_char *buf;
+   const u_char *buf;
    if (d == NULL)
       return(NULL);
 
-   if (d->buf) {
-      if (d->pos*VMFS_DIRENT_SIZE >= vmfs_file_get_size(d->dir))
+   /* Start a new scan from the latest content */
+   if (!d->pos && d->cache && vmfs_dircache_stale(d->dir,d->cache))
+      vmfs_dir_cache_entries(d);
+
+   if (d->cache) {
+      if (d->pos*VMFS_DIRENT_SIZE >= d->cache->size)
          return(NULL);
-      buf = &d->buf[d->pos*VMFS_DIRENT_SIZE];
+      buf = &vmfs_dircache_entry_data(d->cache)[d->pos*VMFS_DIRENT_SIZE];
    } else {
       u_char _buf[VMFS_DIRENT_SIZE];
       if ((vmfs_file_pread(d->dir,_buf,sizeof(_buf),
@@ -267,8 +283,8 @@ int vmfs_dir_close(vmfs_dir_t *d)
    if (d == NULL)
       return(-1);
 
-   if (d->buf)
-      free(d->buf);
+   if (d->cache)
+      vmfs_dircache_put(vmfs_dir_get_fs(d),d->cache);
 
    vmfs_file_close(d->dir);
    free(d);
@@ -305,8 +321,9 @@ int vmfs_dir_link_inode(vmfs_dir_t *d,const char *name,vmfs_inode_t *inode)
       return((res < 0) ? res : -ENOSPC);
 
    inode->nlink++;
+   inode->unlinked = false;
 
-   vmfs_dir_cache_entries(d);
+   vmfs_dir_refresh(d);
    return(0);
 }
 
@@ -320,17 +337,22 @@ int vmfs_dir_unlink_inode(vmfs_dir_t *d,off_t pos,vmfs_dirent_t *entry)
    if (!vmfs_fs_readwrite(fs))
       return(-EROFS);
 
-   /* Update the inode, delete it if nlink reaches 0 */
+   /* 
+    * Update the inode. When nlink reaches 0, it is deleted along with the
+    * last reference, which may be held elsewhere (open files, vmfs-fuse).
+    */
    if (!(inode = vmfs_inode_acquire(fs,entry->block_id)))
       return(-ENOENT);
 
-   if (!--inode->nlink) {
-      vmfs_inode_truncate(inode,0);
-      vmfs_block_free(fs,inode->id);
-   } else {
-      inode->update_flags |= VMFS_INODE_SYNC_META;
+   if (vmfs_txn_begin(fs) == -1) {
+      vmfs_inode_release(inode);
+      return(-EIO);
    }
 
+   if (!--inode->nlink)
+      inode->unlinked = true;
+
+   inode->update_flags |= VMFS_INODE_SYNC_META;
    vmfs_inode_release(inode);
 
    /* Remove the entry itself */
@@ -344,8 +366,9 @@ int vmfs_dir_unlink_inode(vmfs_dir_t *d,off_t pos,vmfs_dirent_t *entry)
    }
 
    vmfs_file_truncate(d->dir,last_entry);
+   vmfs_txn_commit(fs);
 
-   vmfs_dir_cache_entries(d);
+   vmfs_dir_refresh(d);
    return(0);
 }
 
@@ -364,9 +387,12 @@ int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
    if (vmfs_dir_lookup(d,name))
       return(-EEXIST);
 
+   if (vmfs_txn_begin(fs) == -1)
+      return(-EIO);
+
    /* Allocate inode for the new directory */
    if ((res = vmfs_inode_alloc(fs,VMFS_FILE_TYPE_DIR,mode,&new_inode)) < 0)
-      return(res);
+      goto err_alloc;
 
    if (!(new_dir = vmfs_dir_open_from_inode(new_inode))) {
       res = -ENOENT;
@@ -376,12 +402,15 @@ int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
    vmfs_dir_link_inode(new_dir,".",new_inode);
    vmfs_dir_link_inode(new_dir,"..",d->dir->inode);
    vmfs_dir_link_inode(d,name,new_inode);
+   vmfs_txn_commit(fs);
 
    *inode = new_inode;
    return(0);
 
  err_open_dir:
    vmfs_inode_release(new_inode);
+ err_alloc:
+   vmfs_txn_commit(fs);
    return(res);
 }
 
@@ -48,7 +48,9 @@ struct vmfs_dir {
    vmfs_file_t *dir;
    uint32_t pos;
    vmfs_dirent_t dirent;
-   u_char *buf;
+
+   /* Directory content and name index, shared with other handles */
+   vmfs_dircache_entry_t *cache;
 };
 
 static inline const vmfs_fs_t *vmfs_dir_get_fs(vmfs_dir_t *d)
@@ -0,0 +1,200 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "vmfs.h"
+
+/* Initial number of extents allocated for a map */
+#define VMFS_EXTMAP_INITIAL_ALLOC  16
+
+/* Add a run of blocks at the end of an extent map */
+static int vmfs_extmap_add(vmfs_extmap_t *map,uint32_t blk_index,
+                           uint32_t blk_count,uint32_t blk_id)
+{
+   vmfs_extent_t *ext,*new_extents;
+   u_int new_alloc;
+
+   /* Unallocated and TBZ blocks are all alike, whatever their item is */
+   if ((VMFS_BLK_TYPE(blk_id) == VMFS_BLK_TYPE_FB) && VMFS_BLK_FB_TBZ(blk_id))
+      blk_id = VMFS_BLK_FB_BUILD(0,VMFS_BLK_FB_TBZ_FLAG);
+
+   if (map->count > 0) {
+      ext = &map->extents[map->count-1];
+
+      if ((ext->blk_index + ext->blk_count == blk_index) &&
+          (vmfs_extent_get_blk_id(ext,blk_index) == blk_id))
+      {
+         ext->blk_count += blk_count;
+         return(0);
+      }
+   }
+
+   if (map->count == map->alloc) {
+      new_alloc = map->alloc ? map->alloc * 2 : VMFS_EXTMAP_INITIAL_ALLOC;
+      new_extents = realloc(map->extents,new_alloc * sizeof(vmfs_extent_t));
+
+      if (!new_extents)
+         return(-ENOMEM);
+
+      map->extents = new_extents;
+      map->alloc = new_alloc;
+   }
+
+   ext = &map->extents[map->count++];
+   ext->blk_index = blk_index;
+   ext->blk_count = blk_count;
+   ext->blk_id    = blk_id;
+   return(0);
+}
+
+/* Add the blocks referenced by a pointer block */
+static int vmfs_extmap_add_pb(vmfs_extmap_t *map,const vmfs_fs_t *fs,
+                              uint32_t pb_blk,uint32_t blk_index,
+                              uint32_t blk_count)
+{
+   DECL_ALIGNED_BUFFER_WOL(buf,fs->pbc->bmh.data_size);
+   uint32_t i;
+   int res;
+
+   if (!pb_blk)
+      return(vmfs_extmap_add(map,blk_index,blk_count,0));
+
+   if (vmfs_pbcache_read(fs,pb_blk,0,buf,fs->pbc->bmh.data_size) == -1)
+      return(-EIO);
+
+   for(i=0;i<blk_count;i++) {
+      res = vmfs_extmap_add(map,blk_index+i,1,
+                            read_le32(buf,i*sizeof(uint32_t)));
+      if (res < 0)
+         return(res);
+   }
+
+   return(0);
+}
+
+/* Build the extent map of an inode, with its block lock held */
+static vmfs_extmap_t *vmfs_extmap_build_locked(const vmfs_inode_t *inode)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   vmfs_extmap_t *map;
+   uint32_t blk_total,blk_per_pb,count;
+   uint32_t zla;
+   u_int i;
+   int res = 0;
+
+   if (!inode->blk_size)
+      return NULL;
+
+   zla = inode->zla;
+   if (zla >= VMFS5_ZLA_BASE)
+      zla -= VMFS5_ZLA_BASE;
+
+   if ((zla != VMFS_BLK_TYPE_FB) && (zla != VMFS_BLK_TYPE_PB))
+      return NULL;
+
+   blk_total = (inode->size + inode->blk_size - 1) / inode->blk_size;
+
+   if (!(map = calloc(1,sizeof(*map))))
+      return NULL;
+
+   map->size = inode->size;
+   map->blk_gen = inode->blk_gen;
+
+   if (zla == VMFS_BLK_TYPE_FB) {
+      if (blk_total > VMFS_INODE_BLK_COUNT)
+         goto err;
+
+      for(i=0;(i<blk_total) && (res == 0);i++)
+         res = vmfs_extmap_add(map,i,1,inode->blocks[i]);
+   } else {
+      blk_per_pb = fs->pbc->bmh.data_size / sizeof(uint32_t);
+
+      if (blk_total > (uint64_t)blk_per_pb * VMFS_INODE_BLK_COUNT)
+         goto err;
+
+      for(i=0;(i*blk_per_pb < blk_total) && (res == 0);i++) {
+         count = m_min(blk_total - i*blk_per_pb,blk_per_pb);
+         res = vmfs_extmap_add_pb(map,fs,inode->blocks[i],
+                                  i*blk_per_pb,count);
+      }
+   }
+
+   if (res < 0)
+      goto err;
+
+   if (fs->debug_level > 1)
+      printf("VMFS: inode 0x%8.8x: %u blocks in %u extents\n",
+             inode->id,blk_total,map->count);
+
+   return map;
+
+ err:
+   vmfs_extmap_free(map);
+   return NULL;
+}
+
+/* 
+ * Build the extent map of an inode (only for FB and PB addressing). The
+ * block list is read under the block lock, so that the map and the block
+ * list generation it is tagged with match.
+ */
+vmfs_extmap_t *vmfs_extmap_build(const vmfs_inode_t *inode)
+{
+   vmfs_inode_t *winode = (vmfs_inode_t *)inode;
+   vmfs_extmap_t *map;
+
+   pthread_rwlock_rdlock(&winode->blk_lock);
+   map = vmfs_extmap_build_locked(inode);
+   pthread_rwlock_unlock(&winode->blk_lock);
+   return map;
+}
+
+/* Free an extent map */
+void vmfs_extmap_free(vmfs_extmap_t *map)
+{
+   if (map) {
+      free(map->extents);
+      free(map);
+   }
+}
+
+/* Find the extent containing the specified file block */
+const vmfs_extent_t *vmfs_extmap_lookup(const vmfs_extmap_t *map,
+                                        uint32_t blk_index)
+{
+   const vmfs_extent_t *ext;
+   u_int low,high,mid;
+
+   low  = 0;
+   high = map->count;
+
+   while(low < high) {
+      mid = low + (high - low) / 2;
+      ext = &map->extents[mid];
+
+      if (blk_index < ext->blk_index)
+         high = mid;
+      else if (blk_index >= ext->blk_index + ext->blk_count)
+         low = mid + 1;
+      else
+         return ext;
+   }
+
+   return NULL;
+}
@@ -0,0 +1,77 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_EXTMAP_H
+#define VMFS_EXTMAP_H
+
+/*
+ * Extent map: run-length description of the block list of a file.
+ * Consecutive file blocks are merged into a single extent when they are
+ * all unallocated, all to-be-zeroed, or file blocks with contiguous items.
+ */
+struct vmfs_extent {
+   uint32_t blk_index;   /* First file block covered by the extent */
+   uint32_t blk_count;   /* Number of file blocks */
+   uint32_t blk_id;      /* Block ID of the first block (0 for a hole) */
+};
+
+struct vmfs_extmap {
+   vmfs_extent_t *extents;
+   u_int count,alloc;
+
+   /* Inode state the map has been built from */
+   uint64_t size;
+   u_int blk_gen;
+};
+
+/* Extent covers a range of file blocks on disk */
+static inline int vmfs_extent_is_fb(const vmfs_extent_t *ext)
+{
+   return((VMFS_BLK_TYPE(ext->blk_id) == VMFS_BLK_TYPE_FB) &&
+          !VMFS_BLK_FB_TBZ(ext->blk_id));
+}
+
+/* Get the block ID of a file block covered by an extent */
+static inline uint32_t vmfs_extent_get_blk_id(const vmfs_extent_t *ext,
+                                              uint32_t blk_index)
+{
+   if (!vmfs_extent_is_fb(ext))
+      return(ext->blk_id);
+
+   return(VMFS_BLK_FB_BUILD(VMFS_BLK_FB_ITEM(ext->blk_id) +
+                            (blk_index - ext->blk_index),
+                            VMFS_BLK_FB_FLAGS(ext->blk_id)));
+}
+
+/* Check if an extent map still describes the given inode */
+static inline int vmfs_extmap_valid(const vmfs_extmap_t *map,
+                                    const vmfs_inode_t *inode)
+{
+   return((map->blk_gen == inode->blk_gen) && (map->size == inode->size));
+}
+
+/* Build the extent map of an inode (only for FB and PB addressing) */
+vmfs_extmap_t *vmfs_extmap_build(const vmfs_inode_t *inode);
+
+/* Free an extent map */
+void vmfs_extmap_free(vmfs_extmap_t *map);
+
+/* Find the extent containing the specified file block */
+const vmfs_extent_t *vmfs_extmap_lookup(const vmfs_extmap_t *map,
+                                        uint32_t blk_index);
+
+#endif
@@ -34,6 +34,8 @@ vmfs_file_t *vmfs_file_open_from_inode(const vmfs_inode_t *inode)
       return NULL;
 
    f->inode = (vmfs_inode_t *)inode;
+   pthread_mutex_init(&f->extmap_lock,NULL);
+   pthread_mutex_init(&f->ra_lock,NULL);
    return f;
 }
 
@@ -70,17 +72,25 @@ int vmfs_file_create(vmfs_dir_t *d,const char *name,mode_t mode,
    if (!vmfs_fs_readwrite(fs))
       return(-EROFS);
 
+   /* Allocate and link the inode under a single reservation */
+   if (vmfs_txn_begin(fs) == -1)
+      return(-EIO);
+
    if ((res = vmfs_inode_alloc(fs,VMFS_FILE_TYPE_FILE,mode,&new_inode)) < 0)
-      return(res);
+      goto done;
 
+   /* The unlinked inode is deleted on release */
    if ((res = vmfs_dir_link_inode(d,name,new_inode)) < 0) {
-      vmfs_block_free(fs,new_inode->id);
       vmfs_inode_release(new_inode);
-      return(res);
+      goto done;
    }
 
    *inode = new_inode;
-   return(0);
+   res = 0;
+
+ done:
+   vmfs_txn_commit(fs);
+   return(res);
 }
 
 /* Create a file */
@@ -119,79 +129,174 @@ int vmfs_file_close(vmfs_file_t *f)
    if (f == NULL)
       return(-1);
 
+   vmfs_extmap_free(f->extmap);
+   iobuffer_free(f->ra_buf);
    vmfs_inode_release(f->inode);
+   pthread_mutex_destroy(&f->extmap_lock);
+   pthread_mutex_destroy(&f->ra_lock);
    free(f);
    return(0);
 }
 
-/* Read data from a file at the specified position */
-ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+/* 
+ * Get a copy of the extent containing the specified position, if the file
+ * has one. The map may be rebuilt by another thread once the lock is
+ * released, hence the copy.
+ */
+static int vmfs_file_get_extent(vmfs_file_t *f,off_t pos,vmfs_extent_t *ext)
+{
+   const vmfs_extent_t *cur = NULL;
+
+   pthread_mutex_lock(&f->extmap_lock);
+
+   if (f->extmap && !vmfs_extmap_valid(f->extmap,f->inode)) {
+      vmfs_extmap_free(f->extmap);
+      f->extmap = NULL;
+   }
+
+   if (f->extmap || (f->extmap = vmfs_extmap_build(f->inode)))
+      cur = vmfs_extmap_lookup(f->extmap,pos / f->inode->blk_size);
+
+   if (cur != NULL)
+      *ext = *cur;
+
+   pthread_mutex_unlock(&f->extmap_lock);
+   return((cur != NULL) ? 0 : -1);
+}
+
+/* Read data from a single block */
+static ssize_t vmfs_file_pread_block(vmfs_file_t *f,uint32_t blk_id,
+                                     u_char *buf,size_t len,off_t pos)
 {
    const vmfs_fs_t *fs = vmfs_file_get_fs(f);
-   uint32_t blk_id,blk_type;
    uint64_t blk_size,blk_len;
    uint64_t file_size,offset;
-   ssize_t res=0,rlen = 0;
+   uint32_t blk_type;
    size_t exp_len;
-   int err;
-
-   /* We don't handle RDM files */
-   if (f->inode->type == VMFS_FILE_TYPE_RDM)
-      return(-EIO);
+   ssize_t res;
 
    blk_size = vmfs_fs_get_blocksize(fs);
    file_size = vmfs_file_get_size(f);
 
-   while(len > 0) {
-      if (pos >= file_size)
-         break;
-
-      if ((err = vmfs_inode_get_block(f->inode,pos,&blk_id)) < 0)
-         return(err);
-
 #if 0
-      if (f->vol->debug_level > 1)
-         printf("vmfs_file_read: reading block 0x%8.8x\n",blk_id);
+   if (f->vol->debug_level > 1)
+      printf("vmfs_file_read: reading block 0x%8.8x\n",blk_id);
 #endif
 
-      blk_type = VMFS_BLK_FB_TBZ(blk_id) ?
-                    VMFS_BLK_TYPE_NONE : VMFS_BLK_TYPE(blk_id);
+   blk_type = VMFS_BLK_FB_TBZ(blk_id) ?
+                 VMFS_BLK_TYPE_NONE : VMFS_BLK_TYPE(blk_id);
+
+   switch(blk_type) {
+      /* Unallocated block */
+      case VMFS_BLK_TYPE_NONE:
+         offset = pos % blk_size;
+         blk_len = blk_size - offset;
+         exp_len = m_min(blk_len,len);
+         res = m_min(exp_len,file_size - pos);
+         memset(buf,0,res);
+         break;
 
-      switch(blk_type) {
-         /* Unallocated block */
-         case VMFS_BLK_TYPE_NONE:
-            offset = pos % blk_size;
-            blk_len = blk_size - offset;
-            exp_len = m_min(blk_len,len);
-            res = m_min(exp_len,file_size - pos);
-            memset(buf,0,res);
-            break;
+      /* File-Block */
+      case VMFS_BLK_TYPE_FB:
+         exp_len = m_min(len,file_size - pos);
+         res = vmfs_block_read_fb(fs,blk_id,pos,buf,exp_len);
+         break;
 
-         /* File-Block */
-         case VMFS_BLK_TYPE_FB:
-            exp_len = m_min(len,file_size - pos);
-            res = vmfs_block_read_fb(fs,blk_id,pos,buf,exp_len);
-            break;
+      /* Sub-Block */
+      case VMFS_BLK_TYPE_SB: {
+         exp_len = m_min(len,file_size - pos);
+         res = vmfs_block_read_sb(fs,blk_id,pos,buf,exp_len);
+         break;
+      }
 
-         /* Sub-Block */
-         case VMFS_BLK_TYPE_SB: {
+      /* Inline in the inode */
+      case VMFS_BLK_TYPE_FD:
+         if (blk_id == f->inode->id) {
             exp_len = m_min(len,file_size - pos);
-            res = vmfs_block_read_sb(fs,blk_id,pos,buf,exp_len);
+            memcpy(buf, f->inode->content + pos, exp_len);
+            res = exp_len;
             break;
          }
 
-         /* Inline in the inode */
-         case VMFS_BLK_TYPE_FD:
-            if (blk_id == f->inode->id) {
-               exp_len = m_min(len,file_size - pos);
-               memcpy(buf, f->inode->content + pos, exp_len);
-               res = exp_len;
-               break;
-            }
+      default:
+         fprintf(stderr,"VMFS: unknown block type 0x%2.2x\n",blk_type);
+         return(-EIO);
+   }
 
-         default:
-            fprintf(stderr,"VMFS: unknown block type 0x%2.2x\n",blk_type);
-            return(-EIO);
+   return(res);
+}
+
+/* Read data from the blocks covered by an extent */
+static ssize_t vmfs_file_pread_extent(vmfs_file_t *f,const vmfs_extent_t *ext,
+                                      u_char *buf,size_t len,off_t pos)
+{
+   uint64_t blk_size,ext_end;
+   ssize_t res,rlen = 0;
+
+   blk_size = f->inode->blk_size;
+   ext_end = (uint64_t)(ext->blk_index + ext->blk_count) * blk_size;
+
+   len = m_min(len,vmfs_file_get_size(f) - pos);
+   len = m_min(len,ext_end - pos);
+
+   /* Holes and TBZ blocks are read as zeroes in a single step */
+   if (!vmfs_extent_is_fb(ext)) {
+      memset(buf,0,len);
+      return(len);
+   }
+
+   /* 
+    * File blocks of an extent are physically contiguous, so read them
+    * with as few device requests as possible.
+    */
+   while(len > 0) {
+      res = vmfs_block_read_fb_run(vmfs_file_get_fs(f),ext->blk_id,
+                                   pos - (uint64_t)ext->blk_index * blk_size,
+                                   buf,len);
+
+      if (res <= 0)
+         return((res < 0) ? res : rlen);
+
+      pos += res;
+      rlen += res;
+      buf += res;
+      len -= res;
+   }
+
+   return(rlen);
+}
+
+/* Read data from the file blocks at the specified position */
+static ssize_t vmfs_file_pread_blocks(vmfs_file_t *f,u_char *buf,size_t len,
+                                      off_t pos)
+{
+   vmfs_extent_t ext;
+   uint64_t file_size;
+   ssize_t res=0,rlen = 0;
+   uint32_t blk_id;
+   int err;
+
+   /* We don't handle RDM files */
+   if (f->inode->type == VMFS_FILE_TYPE_RDM)
+      return(-EIO);
+
+   file_size = vmfs_file_get_size(f);
+
+   while(len > 0) {
+      if (pos >= file_size)
+         break;
+
+      /* 
+       * Use the extent map when available, and fallback to block by block
+       * resolution otherwise (sub-blocks, inline data).
+       */
+      if (!vmfs_file_get_extent(f,pos,&ext)) {
+         res = vmfs_file_pread_extent(f,&ext,buf,len,pos);
+      } else {
+         if ((err = vmfs_inode_get_block(f->inode,pos,&blk_id)) < 0)
+            return(err);
+
+         res = vmfs_file_pread_block(f,blk_id,buf,len,pos);
       }
 
       /* Error while reading block, abort immediately */
@@ -210,21 +315,244 @@ ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
    return(rlen);
 }
 
-/* Write data to a file at the specified position */
-ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+/* Get the data generation of a file, which writers update concurrently */
+static inline u_int vmfs_file_data_gen(const vmfs_file_t *f)
+{
+   return(__atomic_load_n(&f->inode->data_gen,__ATOMIC_ACQUIRE));
+}
+
+/* 
+ * Signal a data write to the readahead buffers of a file. This is done
+ * both before and after the write, so that a buffer filled while the
+ * write was in progress can't stay valid once it is done.
+ */
+static inline void vmfs_file_data_changed(vmfs_file_t *f)
+{
+   __atomic_add_fetch(&f->inode->data_gen,1,__ATOMIC_ACQ_REL);
+}
+
+/* Check if the readahead buffer content is still up to date */
+static inline int vmfs_file_ra_valid(const vmfs_file_t *f)
+{
+   return(f->ra_len && (f->ra_blk_gen == f->inode->blk_gen) &&
+          (f->ra_data_gen == vmfs_file_data_gen(f)));
+}
+
+/* Get the size of the current readahead window, in bytes */
+static inline uint64_t vmfs_file_ra_window_size(const vmfs_file_t *f)
+{
+   return(m_min((uint64_t)f->ra_window * f->inode->blk_size,
+                VMFS_FILE_READAHEAD_MAX_SIZE));
+}
+
+/* 
+ * Fill the readahead buffer with the current window, starting at the given
+ * position. File block runs are split in chunks read as a single batch, so
+ * that the device can keep them in flight simultaneously.
+ */
+static int vmfs_file_ra_fill(vmfs_file_t *f,off_t pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_extent_t ext;
+   vmfs_io_req_t *reqs;
+   uint64_t blk_size,ext_end,offset;
+   off_t start,end,cur;
+   size_t clen;
+   int n,res = -1;
+
+   blk_size = f->inode->blk_size;
+   start = pos & ~(M_DIO_BLK_SIZE - 1);
+
+   /* Only files with an extent map are read ahead */
+   if (vmfs_file_get_extent(f,start,&ext) == -1)
+      return(-1);
+
+   if (!f->ra_buf &&
+       !(f->ra_buf = iobuffer_alloc(m_min(fs->readahead_max * blk_size,
+                                          VMFS_FILE_READAHEAD_MAX_SIZE))))
+      return(-1);
+
+   f->ra_len = 0;
+   f->ra_blk_gen = f->inode->blk_gen;
+   f->ra_data_gen = vmfs_file_data_gen(f);
+
+   end = m_min(start + vmfs_file_ra_window_size(f),vmfs_file_get_size(f));
+
+   if (!(reqs = malloc(((end - start) / VMFS_FILE_READAHEAD_CHUNK + 
+                        f->ra_window + 1) * sizeof(*reqs))))
+      return(-1);
+
+   for(cur=start,n=0;cur < end;cur += clen) {
+      if (vmfs_file_get_extent(f,cur,&ext) == -1)
+         goto done;
+
+      ext_end = (uint64_t)(ext.blk_index + ext.blk_count) * blk_size;
+      clen = m_min(end - cur,ext_end - cur);
+
+      if (!vmfs_extent_is_fb(&ext)) {
+         memset(f->ra_buf + (cur - start),0,clen);
+         continue;
+      }
+
+      clen = m_min(clen,VMFS_FILE_READAHEAD_CHUNK);
+      offset = cur - (uint64_t)ext.blk_index * blk_size;
+
+      reqs[n].pos = (uint64_t)VMFS_BLK_FB_ITEM(ext.blk_id) * blk_size + offset;
+      reqs[n].buf = f->ra_buf + (cur - start);
+      reqs[n].len = ALIGN_NUM(clen,M_DIO_BLK_SIZE);
+      n++;
+   }
+
+   if (vmfs_device_read_batch(fs->dev,reqs,n) < 0)
+      goto done;
+
+   f->ra_pos = start;
+   f->ra_len = end - start;
+   res = 0;
+
+ done:
+   free(reqs);
+   return(res);
+}
+
+/* Read data through the readahead buffer, with its lock held */
+static ssize_t vmfs_file_pread_ra(vmfs_file_t *f,u_char *buf,size_t len,
+                                  off_t pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   uint64_t file_size,window_size;
+   ssize_t res,rlen = 0;
+   size_t clen;
+   int sequential;
+
+   file_size = vmfs_file_get_size(f);
+
+   if (pos >= file_size)
+      return(0);
+
+   len = m_min(len,file_size - pos);
+
+   if (!vmfs_file_ra_valid(f))
+      f->ra_len = 0;
+
+   sequential = (pos == f->ra_next);
+   f->ra_next = pos + len;
+
+   while(len > 0) {
+      /* Serve what we can from the readahead buffer */
+      if (f->ra_len && (pos >= f->ra_pos) && (pos < f->ra_pos + f->ra_len)) {
+         clen = m_min(len,f->ra_pos + f->ra_len - pos);
+         memcpy(buf,f->ra_buf + (pos - f->ra_pos),clen);
+         sequential = 1;
+      } else {
+         /* Grow the window on sequential accesses, shrink it otherwise */
+         if (sequential)
+            f->ra_window = f->ra_window ? 
+               m_min(f->ra_window * 2,fs->readahead_max) : 1;
+         else
+            f->ra_window /= 2;
+
+         window_size = vmfs_file_ra_window_size(f);
+
+         /* Requests larger than the window don't need readahead */
+         if (!sequential || (len >= window_size) ||
+             (vmfs_file_ra_fill(f,pos) < 0))
+         {
+            if ((res = vmfs_file_pread_blocks(f,buf,len,pos)) < 0)
+               return(res);
+
+            return(rlen + res);
+         }
+
+         continue;
+      }
+
+      pos += clen;
+      rlen += clen;
+      buf += clen;
+      len -= clen;
+   }
+
+   return(rlen);
+}
+
+/* Read data from a file at the specified position */
+ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   ssize_t res;
+
+   /* 
+    * Only regular files are read ahead: meta-files and directories are
+    * also updated behind our back by metadata writes.
+    */
+   if (!fs->readahead_max || (f->inode->type != VMFS_FILE_TYPE_FILE))
+      return(vmfs_file_pread_blocks(f,buf,len,pos));
+
+   /* 
+    * The readahead state serves a single thread at a time, others read
+    * the blocks directly meanwhile.
+    */
+   if (pthread_mutex_trylock(&f->ra_lock) != 0)
+      return(vmfs_file_pread_blocks(f,buf,len,pos));
+
+   res = vmfs_file_pread_ra(f,buf,len,pos);
+   pthread_mutex_unlock(&f->ra_lock);
+   return(res);
+}
+
+/* 
+ * Get direct access to file data when the underlying device is memory
+ * mapped and the range is held by a single file block extent or sub-block.
+ * Returns NULL when the data has to be read instead.
+ */
+const u_char *vmfs_file_map(vmfs_file_t *f,off_t pos,size_t len)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_extent_t ext;
+   uint64_t blk_size,offset;
+   uint32_t blk_id,sb_size;
+
+   if (!fs->dev->map || (pos < 0) || (pos + len > vmfs_file_get_size(f)))
+      return NULL;
+
+   if (!vmfs_file_get_extent(f,pos,&ext)) {
+      blk_size = f->inode->blk_size;
+      offset = pos - (uint64_t)ext.blk_index * blk_size;
+
+      if (!vmfs_extent_is_fb(&ext) ||
+          (offset + len > (uint64_t)ext.blk_count * blk_size))
+         return NULL;
+
+      return(vmfs_fs_map(fs,VMFS_BLK_FB_ITEM(ext.blk_id),offset,len));
+   }
+
+   if ((vmfs_inode_get_block(f->inode,pos,&blk_id) < 0) ||
+       (VMFS_BLK_TYPE(blk_id) != VMFS_BLK_TYPE_SB))
+      return NULL;
+
+   sb_size = fs->sbc->bmh.data_size;
+   offset = pos % sb_size;
+
+   if (offset + len > sb_size)
+      return NULL;
+
+   return(vmfs_file_map(fs->sbc->f,
+                        vmfs_bitmap_get_item_pos(fs->sbc,
+                                                 VMFS_BLK_SB_ENTRY(blk_id),
+                                                 VMFS_BLK_SB_ITEM(blk_id)) +
+                        offset,len));
+}
+
+/* Write data to the blocks of a file at the specified position */
+static ssize_t vmfs_file_pwrite_blocks(vmfs_file_t *f,u_char *buf,size_t len,
+                                       off_t pos)
 {   
    const vmfs_fs_t *fs = vmfs_file_get_fs(f);
    uint32_t blk_id,blk_type;
    ssize_t res=0,wlen = 0;
    int err;
 
-   if (!vmfs_fs_readwrite(fs))
-      return(-EROFS);
-
-   /* We don't handle RDM files */
-   if (f->inode->type == VMFS_FILE_TYPE_RDM)
-      return(-EIO);
-
    while(len > 0) {
       if ((err = vmfs_inode_get_wrblock(f->inode,pos,&blk_id)) < 0)
          return(err);
@@ -265,21 +593,256 @@ ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
       len -= res;
    }
 
-   /* Update file size */
+   /* Update file size, like any other inode change */
+   pthread_mutex_lock(&((vmfs_fs_t *)fs)->txn_lock);
+
    if (pos > vmfs_file_get_size(f)) {
       f->inode->size = pos;
       f->inode->update_flags |= VMFS_INODE_SYNC_META;
    }
 
+   pthread_mutex_unlock(&((vmfs_fs_t *)fs)->txn_lock);
+   return(wlen);
+}
+
+/* Write data to a file at the specified position */
+ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   ssize_t res;
+
+   if (!vmfs_fs_readwrite(fs))
+      return(-EROFS);
+
+   /* We don't handle RDM files */
+   if (f->inode->type == VMFS_FILE_TYPE_RDM)
+      return(-EIO);
+
+   vmfs_file_data_changed(f);
+   res = vmfs_file_pwrite_blocks(f,buf,len,pos);
+   vmfs_file_data_changed(f);
+   return(res);
+}
+
+/* Check that all buffers of an I/O vector are aligned for direct I/O */
+static int vmfs_file_iov_aligned(const struct iovec *iov,int iovcnt,
+                                 size_t *len)
+{
+   int i;
+
+   for(i=0,*len=0;i<iovcnt;i++) {
+      if (!ALIGN_CHECK((uintptr_t)iov[i].iov_base,M_DIO_BLK_SIZE) ||
+          !ALIGN_CHECK(iov[i].iov_len,M_DIO_BLK_SIZE))
+         return(0);
+
+      *len += iov[i].iov_len;
+   }
+
+   return(1);
+}
+
+/* 
+ * Locate file data in the underlying files, so that it can be read without
+ * going through the library (e.g. spliced). Only file block extents are
+ * located; the length is reduced to the end of the extent.
+ */
+int vmfs_file_locate(vmfs_file_t *f,off_t pos,size_t *len,off_t *fd_pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_extent_t ext;
+   uint64_t blk_size,offset,file_size;
+
+   file_size = vmfs_file_get_size(f);
+
+   if ((pos < 0) || (pos >= file_size))
+      return(-1);
+
+   if (vmfs_file_get_extent(f,pos,&ext) || !vmfs_extent_is_fb(&ext))
+      return(-1);
+
+   blk_size = f->inode->blk_size;
+   offset = pos - (uint64_t)ext.blk_index * blk_size;
+
+   *len = m_min(*len,(uint64_t)ext.blk_count * blk_size - offset);
+   *len = m_min(*len,file_size - pos);
+
+   return(vmfs_fs_locate(fs,VMFS_BLK_FB_ITEM(ext.blk_id),offset,*len,
+                         fd_pos));
+}
+
+/* 
+ * Read a batch of requests given at file positions. Requests aligned for
+ * direct I/O and held by a single file block extent are handed together
+ * to the device, the others are read one at a time.
+ */
+int vmfs_file_read_batch(vmfs_file_t *f,vmfs_io_req_t *reqs,int count)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   uint64_t blk_size = f->inode->blk_size;
+   uint64_t offset,ext_len;
+   vmfs_io_req_t *dreqs;
+   vmfs_extent_t ext;
+   int i,n,*idx;
+   int res = 0;
+
+   if (!(dreqs = malloc(count * (sizeof(*dreqs) + sizeof(*idx)))))
+      return(-1);
+
+   idx = (int *)(dreqs + count);
+
+   for(i=0,n=0;i<count;i++) {
+      if (ALIGN_CHECK(reqs[i].pos,M_DIO_BLK_SIZE) &&
+          ALIGN_CHECK(reqs[i].len,M_DIO_BLK_SIZE) &&
+          ALIGN_CHECK((uintptr_t)reqs[i].buf,M_DIO_BLK_SIZE) &&
+          (reqs[i].pos + reqs[i].len <= vmfs_file_get_size(f)) &&
+          !vmfs_file_get_extent(f,reqs[i].pos,&ext) &&
+          vmfs_extent_is_fb(&ext))
+      {
+         offset  = reqs[i].pos - (uint64_t)ext.blk_index * blk_size;
+         ext_len = (uint64_t)ext.blk_count * blk_size;
+
+         if (offset + reqs[i].len <= ext_len) {
+            dreqs[n] = reqs[i];
+            dreqs[n].pos = (uint64_t)VMFS_BLK_FB_ITEM(ext.blk_id) * blk_size +
+                           offset;
+            idx[n++] = i;
+            continue;
+         }
+      }
+
+      reqs[i].res = vmfs_file_pread(f,reqs[i].buf,reqs[i].len,reqs[i].pos);
+
+      if (reqs[i].res != reqs[i].len)
+         res = -1;
+   }
+
+   if ((n > 0) && (vmfs_device_read_batch(fs->dev,dreqs,n) < 0))
+      res = -1;
+
+   for(i=0;i<n;i++)
+      reqs[idx[i]].res = dreqs[i].res;
+
+   free(dreqs);
+   return(res);
+}
+
+/* 
+ * Get the file block extent holding a range of the file when the I/O
+ * vector can be handed to the device without any staging copy.
+ */
+static int vmfs_file_get_direct_extent(vmfs_file_t *f,const struct iovec *iov,
+                                       int iovcnt,off_t pos,size_t *len,
+                                       vmfs_extent_t *ext)
+{
+   uint64_t ext_end;
+
+   if (!ALIGN_CHECK(pos,M_DIO_BLK_SIZE) ||
+       !vmfs_file_iov_aligned(iov,iovcnt,len) ||
+       (pos + *len > vmfs_file_get_size(f)))
+      return(-1);
+
+   if (vmfs_file_get_extent(f,pos,ext) || !vmfs_extent_is_fb(ext))
+      return(-1);
+
+   ext_end = (uint64_t)(ext->blk_index + ext->blk_count) * f->inode->blk_size;
+
+   if (pos + *len > ext_end)
+      return(-1);
+
+   return(0);
+}
+
+/* Read data from a file at the specified position into several buffers */
+ssize_t vmfs_file_preadv(vmfs_file_t *f,const struct iovec *iov,int iovcnt,
+                         off_t pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_extent_t ext;
+   ssize_t res,rlen = 0;
+   size_t len;
+   int i;
+
+   /* We don't handle RDM files */
+   if (f->inode->type == VMFS_FILE_TYPE_RDM)
+      return(-EIO);
+
+   if (!vmfs_file_get_direct_extent(f,iov,iovcnt,pos,&len,&ext)) {
+      res = vmfs_fs_readv(fs,VMFS_BLK_FB_ITEM(ext.blk_id),
+                          pos - (uint64_t)ext.blk_index * f->inode->blk_size,
+                          iov,iovcnt);
+
+      return((res == len) ? res : -EIO);
+   }
+
+   /* Fill the buffers one after the other */
+   for(i=0;i<iovcnt;i++) {
+      res = vmfs_file_pread(f,iov[i].iov_base,iov[i].iov_len,pos);
+
+      if (res < 0)
+         return(res);
+
+      pos += res;
+      rlen += res;
+
+      if (res != iov[i].iov_len)
+         break;
+   }
+
+   return(rlen);
+}
+
+/* Write data from several buffers to a file at the specified position */
+ssize_t vmfs_file_pwritev(vmfs_file_t *f,const struct iovec *iov,int iovcnt,
+                          off_t pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_extent_t ext;
+   ssize_t res,wlen = 0;
+   size_t len;
+   int i;
+
+   if (!vmfs_fs_readwrite(fs))
+      return(-EROFS);
+
+   /* We don't handle RDM files */
+   if (f->inode->type == VMFS_FILE_TYPE_RDM)
+      return(-EIO);
+
+   /* Blocks already allocated within the file can be written in place */
+   if (!vmfs_file_get_direct_extent(f,iov,iovcnt,pos,&len,&ext)) {
+      vmfs_file_data_changed(f);
+      res = vmfs_fs_writev(fs,VMFS_BLK_FB_ITEM(ext.blk_id),
+                           pos - (uint64_t)ext.blk_index * f->inode->blk_size,
+                           iov,iovcnt);
+      vmfs_file_data_changed(f);
+
+      return((res == len) ? res : -EIO);
+   }
+
+   /* Write the buffers one after the other */
+   for(i=0;i<iovcnt;i++) {
+      res = vmfs_file_pwrite(f,iov[i].iov_base,iov[i].iov_len,pos);
+
+      if (res < 0)
+         return(res);
+
+      pos += res;
+      wlen += res;
+
+      if (res != iov[i].iov_len)
+         break;
+   }
+
    return(wlen);
 }
 
 /* Dump a file */
 int vmfs_file_dump(vmfs_file_t *f,off_t pos,uint64_t len,FILE *fd_out)
 {
+   struct iovec iov;
    u_char *buf;
    ssize_t res;
-   size_t clen,buf_len;
+   size_t buf_len;
 
    if (!len)
       len = vmfs_file_get_size(f);
@@ -289,25 +852,30 @@ int vmfs_file_dump(vmfs_file_t *f,off_t pos,uint64_t len,FILE *fd_out)
    if (!(buf = iobuffer_alloc(buf_len)))
       return(-1);
 
-   for(;pos < len; pos+=clen) {
-      clen = m_min(len,buf_len);
-      res = vmfs_file_pread(f,buf,clen,pos);
+   /* Aligned chunks within an extent are read from the device directly */
+   iov.iov_base = buf;
+
+   for(;pos < len; pos+=res) {
+      iov.iov_len = m_min(len - pos,buf_len);
+      res = vmfs_file_preadv(f,&iov,1,pos);
 
       if (res < 0) {
          fprintf(stderr,"vmfs_file_dump: problem reading input file.\n");
+         iobuffer_free(buf);
          return(-1);
       }
 
       if (fwrite(buf,1,res,fd_out) != res) {
          fprintf(stderr,"vmfs_file_dump: error writing output file.\n");
+         iobuffer_free(buf);
          return(-1);
       }
 
-      if (res < clen)
+      if (res < iov.iov_len)
          break;
    }
 
-   free(buf);
+   iobuffer_free(buf);
    return(0);
 }
 
@@ -358,7 +926,19 @@ int vmfs_file_lstat_at(vmfs_dir_t *dir,const char *path,struct stat *buf)
 /* Truncate a file (using a file descriptor) */
 int vmfs_file_truncate(vmfs_file_t *f,off_t length)
 {
-   return(vmfs_inode_truncate(f->inode,length));
+   vmfs_fs_t *fs = (vmfs_fs_t *)vmfs_file_get_fs(f);
+   int res;
+
+   if (!vmfs_fs_readwrite(fs))
+      return(-EROFS);
+
+   /* Free the blocks under a single reservation */
+   if (vmfs_txn_begin(fs) == -1)
+      return(-EIO);
+
+   res = vmfs_inode_truncate(f->inode,length);
+   vmfs_txn_commit(fs);
+   return(res);
 }
 
 /* Truncate a file (using a path) */
@@ -30,10 +30,34 @@
 /* File flags */
 #define VMFS_FILE_FLAG_RW  0x01
 
+/* Default maximum readahead window, in file blocks */
+#define VMFS_FILE_READAHEAD_DEFAULT  4
+
+/* Maximum size of the readahead buffer of a file, whatever its block size */
+#define VMFS_FILE_READAHEAD_MAX_SIZE  0x400000
+
+/* Size of the device requests used to fill the readahead buffer */
+#define VMFS_FILE_READAHEAD_CHUNK  0x40000
+
 /* === VMFS file abstraction === */
 struct vmfs_file {
    vmfs_inode_t *inode;
    u_int flags;
+
+   /* Block list resolved on first read */
+   vmfs_extmap_t *extmap;
+   pthread_mutex_t extmap_lock;
+
+   /* Readahead buffer, filled on sequential reads */
+   pthread_mutex_t ra_lock;
+   u_char *ra_buf;
+   off_t ra_pos;
+   size_t ra_len;
+   u_int ra_blk_gen,ra_data_gen;
+
+   /* Position expected for the next sequential read, current window */
+   off_t ra_next;
+   u_int ra_window;
 };
 
 static inline const vmfs_fs_t *vmfs_file_get_fs(vmfs_file_t *f)
@@ -83,9 +107,32 @@ int vmfs_file_close(vmfs_file_t *f);
 /* Read data from a file at the specified position */
 ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos);
 
+/* Get direct access to file data, if the device allows it */
+const u_char *vmfs_file_map(vmfs_file_t *f,off_t pos,size_t len);
+
+/* 
+ * Locate file data in the underlying files. The length is reduced to what
+ * a single file descriptor holds.
+ */
+int vmfs_file_locate(vmfs_file_t *f,off_t pos,size_t *len,off_t *fd_pos);
+
+/* 
+ * Read a batch of requests given at file positions, keeping them in flight
+ * together when possible. Returns 0 if all requests completed successfully.
+ */
+int vmfs_file_read_batch(vmfs_file_t *f,vmfs_io_req_t *reqs,int count);
+
 /* Write data to a file at the specified position */
 ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos);
 
+/* Read data from a file at the specified position into several buffers */
+ssize_t vmfs_file_preadv(vmfs_file_t *f,const struct iovec *iov,int iovcnt,
+                         off_t pos);
+
+/* Write data from several buffers to a file at the specified position */
+ssize_t vmfs_file_pwritev(vmfs_file_t *f,const struct iovec *iov,int iovcnt,
+                          off_t pos);
+
 /* Dump a file */
 int vmfs_file_dump(vmfs_file_t *f,off_t pos,uint64_t len,FILE *fd_out);
 
@@ -54,6 +54,54 @@ ssize_t vmfs_fs_write(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
    return(vmfs_device_write(fs->dev,pos,buf,len));
 }
 
+/* Get direct access to filesystem data, if the device allows it */
+const u_char *vmfs_fs_map(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                          size_t len)
+{
+   off_t pos;
+
+   pos  = (uint64_t)blk * vmfs_fs_get_blocksize(fs);
+   pos += offset;
+
+   return(vmfs_device_map(fs->dev,pos,len));
+}
+
+/* Locate filesystem data in the underlying files, if the device allows it */
+int vmfs_fs_locate(const vmfs_fs_t *fs,uint32_t blk,off_t offset,size_t len,
+                   off_t *fd_pos)
+{
+   off_t pos;
+
+   pos  = (uint64_t)blk * vmfs_fs_get_blocksize(fs);
+   pos += offset;
+
+   return(vmfs_device_locate(fs->dev,pos,len,fd_pos));
+}
+
+/* Read a block from the filesystem into several buffers */
+ssize_t vmfs_fs_readv(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                      const struct iovec *iov,int iovcnt)
+{
+   off_t pos;
+
+   pos  = (uint64_t)blk * vmfs_fs_get_blocksize(fs);
+   pos += offset;
+
+   return(vmfs_device_readv(fs->dev,pos,iov,iovcnt));
+}
+
+/* Write several buffers to a block of the filesystem */
+ssize_t vmfs_fs_writev(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                       const struct iovec *iov,int iovcnt)
+{
+   off_t pos;
+
+   pos  = (uint64_t)blk * vmfs_fs_get_blocksize(fs);
+   pos += offset;
+
+   return(vmfs_device_writev(fs->dev,pos,iov,iovcnt));
+}
+
 /* Read filesystem information */
 static int vmfs_fsinfo_read(vmfs_fs_t *fs)
 {
@@ -180,6 +228,7 @@ static int vmfs_read_fdc_base(vmfs_fs_t *fs)
    inode.zla = VMFS_BLK_TYPE_FB;
    inode.blocks[0] = VMFS_BLK_FB_BUILD(fdc_base, 0);
    inode.ref_count = 1;
+   pthread_rwlock_init(&inode.blk_lock,NULL);
 
    fs->fdc = vmfs_bitmap_open_from_inode(&inode);
 
@@ -190,6 +239,60 @@ static int vmfs_read_fdc_base(vmfs_fs_t *fs)
    return(0);
 }
 
+/* Declare the blocks of a meta-file to the metadata cache */
+static int vmfs_mcache_add_meta_file(vmfs_fs_t *fs,vmfs_bitmap_t *b)
+{
+   uint32_t blk_size = vmfs_fs_get_blocksize(fs);
+   vmfs_extmap_t *map;
+   vmfs_extent_t *ext;
+   u_int i;
+
+   if (!(map = vmfs_extmap_build(b->f->inode)))
+      return(-1);
+
+   for(i=0;i<map->count;i++) {
+      ext = &map->extents[i];
+
+      if (!vmfs_extent_is_fb(ext))
+         continue;
+
+      if (vmfs_mcache_add_region(fs->mcache,
+                                 (off_t)VMFS_BLK_FB_ITEM(ext->blk_id)*blk_size,
+                                 (size_t)ext->blk_count*blk_size) == -1)
+      {
+         vmfs_extmap_free(map);
+         return(-1);
+      }
+   }
+
+   vmfs_extmap_free(map);
+   return(0);
+}
+
+/* Set up the metadata cache on the device */
+static void vmfs_mcache_setup(vmfs_fs_t *fs)
+{
+   /* Mapped devices don't need one */
+   if (fs->dev->map)
+      return;
+
+   if (!(fs->mcache = vmfs_mcache_create(VMFS_MCACHE_DEFAULT_BUDGET)))
+      return;
+
+   if ((vmfs_mcache_add_meta_file(fs,fs->fbb) == -1) ||
+       (vmfs_mcache_add_meta_file(fs,fs->fdc) == -1) ||
+       (vmfs_mcache_add_meta_file(fs,fs->pbc) == -1) ||
+       (vmfs_mcache_add_meta_file(fs,fs->sbc) == -1))
+   {
+      fprintf(stderr,"VMFS: metadata cache disabled\n");
+      vmfs_mcache_destroy(fs->mcache);
+      fs->mcache = NULL;
+      return;
+   }
+
+   fs->dev->cache = fs->mcache;
+}
+
 static vmfs_device_t *vmfs_device_open(char **paths, vmfs_flags_t flags)
 {
    vmfs_lvm_t *lvm;
@@ -217,8 +320,10 @@ static vmfs_device_t *vmfs_device_open(char **paths, vmfs_flags_t flags)
 /* Open a filesystem */
 vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
 {
+   pthread_mutexattr_t attr;
    vmfs_device_t *dev;
    vmfs_fs_t *fs;
+   u_int i;
 
    vmfs_host_init();
 
@@ -229,8 +334,26 @@ vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
 
    fs->inode_hash_buckets = VMFS_INODE_HASH_BUCKETS;
    fs->inodes = calloc(fs->inode_hash_buckets,sizeof(vmfs_inode_t *));
+   fs->inode_locks = calloc(fs->inode_hash_buckets,sizeof(pthread_mutex_t));
+
+   if (!fs->inodes || !fs->inode_locks) {
+      free(fs->inodes);
+      free(fs->inode_locks);
+      free(fs);
+      return NULL;
+   }
 
-   if (!fs->inodes) {
+   if (!(fs->pbcache = vmfs_pbcache_create(VMFS_PBCACHE_MAX_ENTRIES))) {
+      free(fs->inodes);
+      free(fs->inode_locks);
+      free(fs);
+      return NULL;
+   }
+
+   if (!(fs->dircache = vmfs_dircache_create(VMFS_DIRCACHE_MAX_ENTRIES))) {
+      vmfs_pbcache_destroy(fs->pbcache);
+      free(fs->inodes);
+      free(fs->inode_locks);
       free(fs);
       return NULL;
    }
@@ -238,6 +361,25 @@ vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
    fs->dev = dev;
    fs->debug_level = flags.debug_level;
 
+   for(i=0;i<fs->inode_hash_buckets;i++)
+      pthread_mutex_init(&fs->inode_locks[i],NULL);
+
+   pthread_mutex_init(&fs->inode_lru_lock,NULL);
+   fs->inode_lru_max = VMFS_INODE_CACHE_MAX;
+
+   pthread_mutex_init(&fs->hb_mutex,NULL);
+   pthread_cond_init(&fs->hb_cond,NULL);
+
+   /* Transactions nest, and lock metadata within themselves */
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&fs->txn_lock,&attr);
+   pthread_mutexattr_destroy(&attr);
+
+   if (!flags.no_readahead && !dev->map)
+      fs->readahead_max = flags.readahead ? flags.readahead :
+                                            VMFS_FILE_READAHEAD_DEFAULT;
+
    /* Read FS info */
    if (vmfs_fsinfo_read(fs) == -1) {
       fprintf(stderr,"VMFS: Unable to read FS information\n");
@@ -258,6 +400,8 @@ vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
       return NULL;
    }
 
+   vmfs_mcache_setup(fs);
+
    if (fs->debug_level > 0)
       printf("VMFS: filesystem opened successfully\n");
    return fs;
@@ -265,7 +409,8 @@ vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
 
 /* 
  * Check that all inodes have been released, and synchronize them if this 
- * is not the case. 
+ * is not the case. This has to be done while the bitmaps are still open,
+ * to give back the blocks allocated ahead of writers.
  */
 static void vmfs_fs_sync_inodes(vmfs_fs_t *fs)
 {
@@ -278,15 +423,31 @@ static void vmfs_fs_sync_inodes(vmfs_fs_t *fs)
          printf("Inode 0x%8.8x: ref_count=%u, update_flags=0x%x\n",
                 inode->id,inode->ref_count,inode->update_flags);
 #endif
-         if (inode->update_flags)
-            vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
+         vmfs_inode_sync(inode);
       }
    }
 }
 
+/* Free the unreferenced inodes kept in-core */
+static void vmfs_fs_free_inodes(vmfs_fs_t *fs)
+{
+   vmfs_inode_t *inode,*next;
+
+   for(inode=fs->inode_lru_head;inode;inode=next) {
+      next = inode->lru_next;
+      pthread_rwlock_destroy(&inode->blk_lock);
+      free(inode);
+   }
+
+   fs->inode_lru_head = fs->inode_lru_tail = NULL;
+   fs->inode_lru_count = 0;
+}
+
 /* Close a FS */
 void vmfs_fs_close(vmfs_fs_t *fs)
 {
+   u_int i;
+
    if (!fs)
       return;
 
@@ -296,6 +457,9 @@ void vmfs_fs_close(vmfs_fs_t *fs)
               fs->hb_refcount);
    }
 
+   vmfs_fs_sync_inodes(fs);
+
+   vmfs_heartbeat_stop_thread(fs);
    vmfs_heartbeat_unlock(fs,&fs->hb);
 
    vmfs_bitmap_close(fs->fbb);
@@ -303,10 +467,32 @@ void vmfs_fs_close(vmfs_fs_t *fs)
    vmfs_bitmap_close(fs->pbc);
    vmfs_bitmap_close(fs->sbc);
 
-   vmfs_fs_sync_inodes(fs);
+   vmfs_fs_free_inodes(fs);
+
+   if (fs->debug_level > 0) {
+      vmfs_pbcache_show_stats(fs->pbcache);
+      vmfs_dircache_show_stats(fs->dircache);
 
+      if (fs->mcache)
+         vmfs_mcache_show_stats(fs->mcache);
+   }
+
+   vmfs_pbcache_destroy(fs->pbcache);
+   vmfs_dircache_destroy(fs->dircache);
+
+   fs->dev->cache = NULL;
+   vmfs_mcache_destroy(fs->mcache);
    vmfs_device_close(fs->dev);
    free(fs->inodes);
    free(fs->fs_info.label);
+
+   for(i=0;i<fs->inode_hash_buckets;i++)
+      pthread_mutex_destroy(&fs->inode_locks[i]);
+
+   free(fs->inode_locks);
+   pthread_mutex_destroy(&fs->inode_lru_lock);
+   pthread_mutex_destroy(&fs->txn_lock);
+   pthread_cond_destroy(&fs->hb_cond);
+   pthread_mutex_destroy(&fs->hb_mutex);
    free(fs);
 }
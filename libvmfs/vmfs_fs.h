@@ -82,6 +82,9 @@ struct vmfs_fsinfo {
 /* === VMFS filesystem === */
 #define VMFS_INODE_HASH_BUCKETS  256
 
+/* Maximum number of unreferenced inodes kept in-core */
+#define VMFS_INODE_CACHE_MAX  1024
+
 struct vmfs_fs {
    int debug_level;
 
@@ -94,6 +97,18 @@ struct vmfs_fs {
    /* Meta-files containing file system structures */
    vmfs_bitmap_t *fbb,*sbc,*pbc,*fdc;
 
+   /* In-core pointer blocks */
+   vmfs_pbcache_t *pbcache;
+
+   /* Recently used directories */
+   vmfs_dircache_t *dircache;
+
+   /* Cache of meta-file device blocks */
+   vmfs_mcache_t *mcache;
+
+   /* Maximum readahead window for files, in file blocks */
+   u_int readahead_max;
+
    /* Heartbeat used to lock meta-data */
    vmfs_heartbeat_t hb;
    u_int hb_id;
@@ -101,12 +116,28 @@ struct vmfs_fs {
    u_int hb_refcount;
    uint64_t hb_expire;
 
+   /* Background heartbeat maintenance */
+   pthread_mutex_t hb_mutex;
+   pthread_cond_t hb_cond;
+   pthread_t hb_thread;
+   bool hb_thread_active,hb_thread_stop;
+
+   /* Metadata transaction in progress, shared by all threads */
+   pthread_mutex_t txn_lock;
+   vmfs_txn_t txn;
+
    /* Counter for "gen" field in inodes */
    uint32_t inode_gen;
 
-   /* In-core inodes hash table */
+   /* In-core inodes hash table, with a lock per bucket */
    u_int inode_hash_buckets;
    vmfs_inode_t **inodes;
+   pthread_mutex_t *inode_locks;
+
+   /* Unreferenced clean inodes left in the hash table, most recent first */
+   pthread_mutex_t inode_lru_lock;
+   vmfs_inode_t *inode_lru_head,*inode_lru_tail;
+   u_int inode_lru_count,inode_lru_max;
 };
 
 /* Get the bitmap corresponding to the given type */
@@ -140,6 +171,22 @@ ssize_t vmfs_fs_read(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
 ssize_t vmfs_fs_write(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
                       const u_char *buf,size_t len);
 
+/* Get direct access to filesystem data, if the device allows it */
+const u_char *vmfs_fs_map(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                          size_t len);
+
+/* Locate filesystem data in the underlying files, if the device allows it */
+int vmfs_fs_locate(const vmfs_fs_t *fs,uint32_t blk,off_t offset,size_t len,
+                   off_t *fd_pos);
+
+/* Read a block from the filesystem into several buffers */
+ssize_t vmfs_fs_readv(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                      const struct iovec *iov,int iovcnt);
+
+/* Write several buffers to a block of the filesystem */
+ssize_t vmfs_fs_writev(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                       const struct iovec *iov,int iovcnt);
+
 /* Open a FS */
 vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags);
 
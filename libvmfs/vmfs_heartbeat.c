@@ -24,6 +24,8 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "utils.h"
 #include "vmfs.h"
@@ -67,24 +69,36 @@ void vmfs_heartbeat_show(const vmfs_heartbeat_t *hb)
    printf("\n");
 }
 
+/* Read the whole heartbeat region in a single I/O */
+static u_char *vmfs_heartbeat_read_region(const vmfs_fs_t *fs)
+{
+   size_t buf_len = VMFS_HB_NUM * VMFS_HB_SIZE;
+   u_char *buf;
+
+   if (!(buf = iobuffer_alloc(buf_len)))
+      return NULL;
+
+   if (vmfs_device_read(fs->dev,VMFS_HB_BASE,buf,buf_len) != buf_len) {
+      fprintf(stderr,"VMFS: unable to read heartbeat info.\n");
+      iobuffer_free(buf);
+      return NULL;
+   }
+
+   return buf;
+}
+
 /* Show the active locks */
 int vmfs_heartbeat_show_active(const vmfs_fs_t *fs)
 {
-   DECL_ALIGNED_BUFFER(buf,VMFS_HB_SIZE);
    vmfs_heartbeat_t hb;
-   ssize_t res;
-   off_t pos = 0;
-   int count = 0;
-
-   while(pos < VMFS_HB_SIZE * VMFS_HB_NUM) {
-      res = vmfs_device_read(fs->dev,VMFS_HB_BASE+pos,buf,buf_len);
+   u_char *buf;
+   int i,count = 0;
 
-      if (res != buf_len) {
-         fprintf(stderr,"VMFS: unable to read heartbeat info.\n");
-         return(-1);
-      }
+   if (!(buf = vmfs_heartbeat_read_region(fs)))
+      return(-1);
 
-      vmfs_heartbeat_read(&hb,buf);
+   for(i=0;i<VMFS_HB_NUM;i++) {
+      vmfs_heartbeat_read(&hb,buf+(i * VMFS_HB_SIZE));
       
       if (vmfs_heartbeat_active(&hb)) {
          vmfs_heartbeat_show(&hb);
@@ -93,17 +107,22 @@ int vmfs_heartbeat_show_active(const vmfs_fs_t *fs)
          fprintf(stderr,"VMFS: invalid heartbeat info.\n");
          break;
       }
-
-      pos += res;
    }
    
+   iobuffer_free(buf);
    return(count);
 }
 
-/* Lock an heartbeat given its ID */
+/* 
+ * Lock an heartbeat given its ID. An heartbeat we already hold is taken
+ * again, as long as it still has our sequence number and UUID on disk.
+ */
 int vmfs_heartbeat_lock(vmfs_fs_t *fs,u_int id,vmfs_heartbeat_t *hb)
 {  
    DECL_ALIGNED_BUFFER(buf,VMFS_HB_SIZE);
+   uuid_t uuid;
+   uint64_t seq;
+   bool held;
    off_t pos;
    int res = -1;
 
@@ -111,6 +130,8 @@ int vmfs_heartbeat_lock(vmfs_fs_t *fs,u_int id,vmfs_heartbeat_t *hb)
       return(-1);
 
    pos = VMFS_HB_BASE + (id * VMFS_HB_SIZE);
+   held = vmfs_heartbeat_active(hb) && (hb->pos == pos);
+   seq = hb->seq;
    
    if (vmfs_device_reserve(fs->dev,pos) == -1) {
       fprintf(stderr,"VMFS: unable to reserve volume.\n");
@@ -123,14 +144,20 @@ int vmfs_heartbeat_lock(vmfs_fs_t *fs,u_int id,vmfs_heartbeat_t *hb)
    }
 
    vmfs_heartbeat_read(hb,buf);
-   
-   if (vmfs_heartbeat_active(hb))
-      goto done;
+   vmfs_host_get_uuid(uuid);
+
+   if (vmfs_heartbeat_active(hb)) {
+      if (!held || (hb->seq != seq) || uuid_compare(hb->uuid,uuid)) {
+         hb->magic = VMFS_HB_MAGIC_OFF;
+         goto done;
+      }
+   } else {
+      hb->magic = VMFS_HB_MAGIC_ON;
+      hb->seq++;
+      uuid_copy(hb->uuid,uuid);
+   }
 
-   hb->magic = VMFS_HB_MAGIC_ON;
    hb->uptime = vmfs_host_get_uptime();
-   hb->seq++;
-   vmfs_host_get_uuid(hb->uuid);
    vmfs_heartbeat_write(hb,buf);
 
    if (vmfs_device_write(fs->dev,pos,buf,buf_len) != buf_len) {
@@ -175,50 +202,64 @@ int vmfs_heartbeat_update(vmfs_fs_t *fs,vmfs_heartbeat_t *hb)
    return((vmfs_device_write(fs->dev,hb->pos,buf,buf_len) == buf_len) ? 0 : -1);
 }
 
-/* Acquire an heartbeat (ID is chosen automatically) */
-int vmfs_heartbeat_acquire(vmfs_fs_t *fs)
+/* Take an heartbeat, with the heartbeat mutex held */
+static int vmfs_heartbeat_take(vmfs_fs_t *fs)
 {
    vmfs_heartbeat_t hb;   
    u_char *buf;
-   size_t buf_len;
-   int i,res = -1;
+   u_int i,id;
+   int res = -1;
 
    /* Heartbeat already active ? */
    if (fs->hb_refcount > 0) {
       fs->hb_refcount++;
-      fs->hb_expire = vmfs_host_get_uptime() + VMFS_HEARTBEAT_EXPIRE_DELAY;
       return(0);
    }
 
-   /* Try to reuse the current ID */
-   if (!vmfs_heartbeat_lock(fs,fs->hb_id,&fs->hb))
-      return(0);
+   /* 
+    * Still held since the last release: it only needs to show we're
+    * alive, which the background thread, if any, already does. Once
+    * expired with no thread to keep it alive, another host may have
+    * reclaimed it, so it has to be locked again.
+    */
+   if (vmfs_heartbeat_active(&fs->hb) &&
+       (fs->hb_thread_active || (vmfs_host_get_uptime() < fs->hb_expire)))
+   {
+      if (!fs->hb_thread_active && (vmfs_heartbeat_update(fs,&fs->hb) == -1))
+         return(-1);
 
-   buf_len = VMFS_HB_NUM * VMFS_HB_SIZE;
+      fs->hb_refcount = 1;
+      return(0);
+   }
 
-   if (!(buf = iobuffer_alloc(buf_len)))
-      return(-1);
+   /* Try to reuse the cached slot */
+   if (!vmfs_heartbeat_lock(fs,fs->hb_id,&fs->hb)) {
+      fs->hb_seq = fs->hb.seq;
+      fs->hb_refcount = 1;
+      return(0);
+   }
 
-   if (vmfs_device_read(fs->dev,VMFS_HB_BASE,buf,buf_len) != buf_len)
+   if (!(buf = vmfs_heartbeat_read_region(fs)))
       return(-1);
 
    /* 
-    * Heartbeat is taken by someone else, find a new one.
+    * Heartbeat is taken by someone else, find a new one, starting after
+    * the cached slot.
     * To avoid high contention with SCSI reservation, we first read
     * directly the heartbeat info, and if the heartbeat is not taken, 
     * we try to acquire it definitely with reservation.
     */
-   for(i=0;i<VMFS_HB_NUM;i++) {
-      vmfs_heartbeat_read(&hb,buf+(i * VMFS_HB_SIZE));
+   for(i=1;i<VMFS_HB_NUM;i++) {
+      id = (fs->hb_id + i) % VMFS_HB_NUM;
+      vmfs_heartbeat_read(&hb,buf+(id * VMFS_HB_SIZE));
 
       if (vmfs_heartbeat_active(&hb))
          continue;
 
-      if (!vmfs_heartbeat_lock(fs,i,&fs->hb)) {
-         fs->hb_id  = i;
+      if (!vmfs_heartbeat_lock(fs,id,&fs->hb)) {
+         fs->hb_id  = id;
          fs->hb_seq = fs->hb.seq;
          fs->hb_refcount = 1;
-         fs->hb_expire = vmfs_host_get_uptime() + VMFS_HEARTBEAT_EXPIRE_DELAY;
          res = 0;
          break;
       }
@@ -228,13 +269,96 @@ int vmfs_heartbeat_acquire(vmfs_fs_t *fs)
    return(res);
 }
 
-/* Release an heartbeat */
+/* Acquire an heartbeat (ID is chosen automatically) */
+int vmfs_heartbeat_acquire(vmfs_fs_t *fs)
+{
+   int res;
+
+   pthread_mutex_lock(&fs->hb_mutex);
+   res = vmfs_heartbeat_take(fs);
+   pthread_mutex_unlock(&fs->hb_mutex);
+   return(res);
+}
+
+/* 
+ * Release an heartbeat. It stays held on disk, so that it can be reused
+ * by the next metadata operations, until the background thread lets it
+ * expire or the file system is closed.
+ */
 int vmfs_heartbeat_release(vmfs_fs_t *fs)
 {
-   if (fs->hb_refcount == 0)
+   int res = -1;
+
+   pthread_mutex_lock(&fs->hb_mutex);
+
+   if (fs->hb_refcount > 0) {
+      if (--fs->hb_refcount == 0)
+         fs->hb_expire = vmfs_host_get_uptime() + VMFS_HEARTBEAT_EXPIRE_DELAY;
+      res = 0;
+   }
+
+   pthread_mutex_unlock(&fs->hb_mutex);
+   return(res);
+}
+
+/* 
+ * Background thread: refresh the uptime of the heartbeat while it is
+ * held, and release it once unreferenced for VMFS_HEARTBEAT_EXPIRE_DELAY.
+ */
+static void *vmfs_heartbeat_thread(void *arg)
+{
+   vmfs_fs_t *fs = arg;
+   struct timespec ts;
+
+   pthread_mutex_lock(&fs->hb_mutex);
+
+   while(!fs->hb_thread_stop) {
+      clock_gettime(CLOCK_REALTIME,&ts);
+      ts.tv_sec += VMFS_HEARTBEAT_UPDATE_DELAY / 1000000;
+      pthread_cond_timedwait(&fs->hb_cond,&fs->hb_mutex,&ts);
+
+      if (fs->hb_thread_stop || !vmfs_heartbeat_active(&fs->hb))
+         continue;
+
+      if ((fs->hb_refcount == 0) && 
+          (vmfs_host_get_uptime() >= fs->hb_expire))
+         vmfs_heartbeat_unlock(fs,&fs->hb);
+      else
+         vmfs_heartbeat_update(fs,&fs->hb);
+   }
+
+   pthread_mutex_unlock(&fs->hb_mutex);
+   return NULL;
+}
+
+/* Start the background heartbeat thread */
+int vmfs_heartbeat_start_thread(vmfs_fs_t *fs)
+{
+   if (fs->hb_thread_active)
+      return(0);
+
+   fs->hb_thread_stop = 0;
+
+   if (pthread_create(&fs->hb_thread,NULL,vmfs_heartbeat_thread,fs)) {
+      fprintf(stderr,"VMFS: unable to start heartbeat thread.\n");
       return(-1);
+   }
 
-   /* The heartbeat will be eventually released by the background process */
-   fs->hb_refcount--;
+   fs->hb_thread_active = 1;
    return(0);
 }
+
+/* Stop the background heartbeat thread */
+void vmfs_heartbeat_stop_thread(vmfs_fs_t *fs)
+{
+   if (!fs->hb_thread_active)
+      return;
+
+   pthread_mutex_lock(&fs->hb_mutex);
+   fs->hb_thread_stop = 1;
+   pthread_cond_signal(&fs->hb_cond);
+   pthread_mutex_unlock(&fs->hb_mutex);
+
+   pthread_join(fs->hb_thread,NULL);
+   fs->hb_thread_active = 0;
+}
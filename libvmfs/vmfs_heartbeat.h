@@ -60,6 +60,9 @@ struct vmfs_heartbeat {
 /* Delay for heartbeat expiration when not referenced anymore */
 #define VMFS_HEARTBEAT_EXPIRE_DELAY  (3 * 1000000)
 
+/* Delay between two uptime updates by the background thread */
+#define VMFS_HEARTBEAT_UPDATE_DELAY  (1 * 1000000)
+
 static inline bool vmfs_heartbeat_active(vmfs_heartbeat_t *hb)
 {
    return(hb->magic == VMFS_HB_MAGIC_ON);
@@ -92,4 +95,10 @@ int vmfs_heartbeat_acquire(vmfs_fs_t *fs);
 /* Release an heartbeat */
 int vmfs_heartbeat_release(vmfs_fs_t *fs);
 
+/* Start the background heartbeat thread */
+int vmfs_heartbeat_start_thread(vmfs_fs_t *fs);
+
+/* Stop the background heartbeat thread */
+void vmfs_heartbeat_stop_thread(vmfs_fs_t *fs);
+
 #endif
@@ -66,3 +66,23 @@ void vmfs_host_get_uuid(uuid_t dst)
 {
    uuid_copy(dst,host_uuid);
 }
+
+/* 
+ * Get a value in [0,range) derived from the host UUID, so that hosts
+ * sharing a volume can pick different starting points, e.g. for
+ * allocations.
+ */
+uint32_t vmfs_host_get_affinity(uint32_t range)
+{
+   uint32_t hash = 2166136261U;
+   int i;
+
+   if (!range)
+      return(0);
+
+   /* FNV-1a */
+   for(i=0;i<sizeof(uuid_t);i++)
+      hash = (hash ^ host_uuid[i]) * 16777619U;
+
+   return(hash % range);
+}
@@ -30,4 +30,7 @@ uint64_t vmfs_host_get_uptime(void);
 /* Get host UUID */
 void vmfs_host_get_uuid(uuid_t dst);
 
+/* Get a value in [0,range) derived from the host UUID */
+uint32_t vmfs_host_get_affinity(uint32_t range);
+
 #endif
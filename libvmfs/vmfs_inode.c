@@ -38,7 +38,7 @@ static inline void vmfs_inode_write_blk_id(u_char *buf,u_int index,
 }
 
 /* Read an inode */
-static int vmfs_inode_read(vmfs_inode_t *inode,const u_char *buf)
+int vmfs_inode_read(vmfs_inode_t *inode,const u_char *buf)
 {
    int i;
 
@@ -137,10 +137,16 @@ int vmfs_inode_update(const vmfs_inode_t *inode,int update_blk_list)
 int vmfs_inode_get(const vmfs_fs_t *fs,uint32_t blk_id,vmfs_inode_t *inode)
 {
    DECL_ALIGNED_BUFFER_WOL(buf,VMFS_INODE_SIZE);
+   const u_char *map;
 
    if (VMFS_BLK_TYPE(blk_id) != VMFS_BLK_TYPE_FD)
       return(-1);
 
+   /* Decode in place when possible */
+   if ((map = vmfs_bitmap_map_item(fs->fdc, VMFS_BLK_FD_ENTRY(blk_id),
+                                   VMFS_BLK_FD_ITEM(blk_id))) != NULL)
+      return(vmfs_inode_read(inode,map));
+
    if (!vmfs_bitmap_get_item(fs->fdc, VMFS_BLK_FD_ENTRY(blk_id),
                              VMFS_BLK_FD_ITEM(blk_id), buf))
       return(-1);
@@ -148,23 +154,58 @@ int vmfs_inode_get(const vmfs_fs_t *fs,uint32_t blk_id,vmfs_inode_t *inode)
    return(vmfs_inode_read(inode,buf));
 }
 
+/* Allocate an in-core inode */
+static vmfs_inode_t *vmfs_inode_create(void)
+{
+   vmfs_inode_t *inode;
+
+   if (!(inode = calloc(1,sizeof(*inode))))
+      return NULL;
+
+   pthread_rwlock_init(&inode->blk_lock,NULL);
+   return inode;
+}
+
+/* Free an in-core inode */
+static void vmfs_inode_free(vmfs_inode_t *inode)
+{
+   pthread_rwlock_destroy(&inode->blk_lock);
+   free(inode);
+}
+
 /* Hash function to retrieve an in-core inode */
 static inline u_int vmfs_inode_hash(const vmfs_fs_t *fs,uint32_t blk_id)
 {
    return( (blk_id ^ (blk_id >> 9)) & (fs->inode_hash_buckets - 1) );
 }
 
-/* Register an inode in the in-core inode hash table */
-static void vmfs_inode_register(const vmfs_fs_t *fs,vmfs_inode_t *inode)
+/* Get the lock of a hash table bucket */
+static inline pthread_mutex_t *vmfs_inode_bucket_lock(const vmfs_fs_t *fs,
+                                                      u_int hb)
 {
-   u_int hb;
+   return(&fs->inode_locks[hb]);
+}
 
-   hb = vmfs_inode_hash(fs,inode->id);
+/* Find an in-core inode, with the bucket lock held */
+static vmfs_inode_t *vmfs_inode_find(const vmfs_fs_t *fs,u_int hb,
+                                     uint32_t blk_id)
+{
+   vmfs_inode_t *inode;
 
+   for(inode=fs->inodes[hb];inode;inode=inode->next)
+      if (inode->id == blk_id)
+         return inode;
+
+   return NULL;
+}
+
+/* Insert an inode in the hash table, with the bucket lock held */
+static void vmfs_inode_hash_insert(const vmfs_fs_t *fs,u_int hb,
+                                   vmfs_inode_t *inode)
+{
    inode->fs = fs;
    inode->ref_count = 1;
    
-   /* Insert into hash table */
    inode->next  = fs->inodes[hb];
    inode->pprev = &fs->inodes[hb];
 
@@ -174,53 +215,491 @@ static void vmfs_inode_register(const vmfs_fs_t *fs,vmfs_inode_t *inode)
    fs->inodes[hb] = inode;
 }
 
-/* Acquire an inode */
+/* Remove an inode from the hash table, with the bucket lock held */
+static void vmfs_inode_hash_unlink(vmfs_inode_t *inode)
+{
+   if (inode->next != NULL)
+      inode->next->pprev = inode->pprev;
+
+   *(inode->pprev) = inode->next;
+}
+
+/* Remove an inode from the LRU list, with the LRU lock held */
+static void vmfs_inode_lru_unlink(vmfs_fs_t *fs,vmfs_inode_t *inode)
+{
+   if (inode->lru_prev)
+      inode->lru_prev->lru_next = inode->lru_next;
+   else
+      fs->inode_lru_head = inode->lru_next;
+
+   if (inode->lru_next)
+      inode->lru_next->lru_prev = inode->lru_prev;
+   else
+      fs->inode_lru_tail = inode->lru_prev;
+
+   inode->lru_prev = inode->lru_next = NULL;
+   fs->inode_lru_count--;
+}
+
+/* Put an inode at the head of the LRU list, with the LRU lock held */
+static void vmfs_inode_lru_push(vmfs_fs_t *fs,vmfs_inode_t *inode)
+{
+   inode->lru_prev = NULL;
+   inode->lru_next = fs->inode_lru_head;
+
+   if (fs->inode_lru_head)
+      fs->inode_lru_head->lru_prev = inode;
+   else
+      fs->inode_lru_tail = inode;
+
+   fs->inode_lru_head = inode;
+   fs->inode_lru_count++;
+}
+
+/* Take a reference on an in-core inode, with the bucket lock held */
+static void vmfs_inode_get_ref(const vmfs_fs_t *fs,vmfs_inode_t *inode)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+
+   if (inode->ref_count++ == 0) {
+      pthread_mutex_lock(&wfs->inode_lru_lock);
+      vmfs_inode_lru_unlink(wfs,inode);
+      pthread_mutex_unlock(&wfs->inode_lru_lock);
+   }
+}
+
+/* 
+ * Register a new inode in the in-core inode hash table. An unreferenced
+ * in-core inode with the same ID is evicted first. A referenced one still
+ * owns the inode slot, so the registration is refused.
+ */
+static int vmfs_inode_register(const vmfs_fs_t *fs,vmfs_inode_t *inode)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   vmfs_inode_t *cur;
+   u_int hb = vmfs_inode_hash(fs,inode->id);
+
+   pthread_mutex_lock(vmfs_inode_bucket_lock(fs,hb));
+
+   if ((cur = vmfs_inode_find(fs,hb,inode->id)) != NULL) {
+      if (cur->ref_count > 0) {
+         pthread_mutex_unlock(vmfs_inode_bucket_lock(fs,hb));
+         return(-1);
+      }
+
+      pthread_mutex_lock(&wfs->inode_lru_lock);
+      vmfs_inode_lru_unlink(wfs,cur);
+      pthread_mutex_unlock(&wfs->inode_lru_lock);
+      vmfs_inode_hash_unlink(cur);
+   }
+
+   vmfs_inode_hash_insert(fs,hb,inode);
+   pthread_mutex_unlock(vmfs_inode_bucket_lock(fs,hb));
+
+   if (cur != NULL)
+      vmfs_inode_free(cur);
+
+   return(0);
+}
+
+/* Check whether the data of a file differs between two inode versions */
+static bool vmfs_inode_data_changed(const vmfs_inode_t *a,
+                                    const vmfs_inode_t *b)
+{
+   return((a->size != b->size) || (a->zla != b->zla) ||
+          (a->blk_count != b->blk_count) ||
+          memcmp(a->blocks,b->blocks,sizeof(a->blocks)));
+}
+
+/* Check whether an inode differs from another version of it */
+static bool vmfs_inode_changed(const vmfs_inode_t *a,const vmfs_inode_t *b)
+{
+   return((a->mdh.obj_seq != b->mdh.obj_seq) || (a->nlink != b->nlink) ||
+          (a->mtime != b->mtime) || (a->ctime != b->ctime) ||
+          (a->atime != b->atime) || (a->uid != b->uid) ||
+          (a->gid != b->gid) || (a->mode != b->mode) ||
+          (a->tbz != b->tbz) || vmfs_inode_data_changed(a,b));
+}
+
+/* 
+ * Read an in-core inode again if other hosts changed it on disk, when its
+ * last check is at least "delay" old. Local changes not written yet are
+ * more recent than the disk, and the check is put off while another thread
+ * works on metadata.
+ */
+static void vmfs_inode_revalidate(vmfs_inode_t *inode,uint64_t delay)
+{
+   DECL_ALIGNED_BUFFER_WOL(buf,VMFS_INODE_SIZE);
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+   vmfs_inode_t *disk;
+   uint64_t now;
+
+   now = vmfs_host_get_uptime();
+
+   if (now < inode->check_time + delay)
+      return;
+
+   if (pthread_mutex_trylock(&fs->txn_lock) != 0)
+      return;
+
+   if (inode->update_flags || inode->unlinked || inode->prealloc_count ||
+       !(disk = calloc(1,sizeof(*disk))))
+   {
+      pthread_mutex_unlock(&fs->txn_lock);
+      return;
+   }
+
+   if (fs->mcache)
+      vmfs_mcache_invalidate(fs->mcache,inode->mdh.pos,VMFS_INODE_SIZE);
+
+   if (vmfs_bitmap_get_item(fs->fdc,VMFS_BLK_FD_ENTRY(inode->id),
+                            VMFS_BLK_FD_ITEM(inode->id),buf) &&
+       !vmfs_inode_read(disk,buf))
+   {
+      if (vmfs_inode_changed(inode,disk)) {
+         pthread_rwlock_wrlock(&inode->blk_lock);
+
+         if (vmfs_inode_data_changed(inode,disk)) {
+            inode->blk_gen++;
+            __atomic_add_fetch(&inode->data_gen,1,__ATOMIC_ACQ_REL);
+         }
+
+         vmfs_inode_read(inode,buf);
+         pthread_rwlock_unlock(&inode->blk_lock);
+      }
+
+      inode->check_time = now;
+   }
+
+   free(disk);
+   pthread_mutex_unlock(&fs->txn_lock);
+}
+
+/* 
+ * Acquire an inode. The inode is read without the bucket lock, so another
+ * thread may have registered it in the meantime. An in-core inode is
+ * checked against the disk when it was unreferenced, or when its last
+ * check is old enough.
+ */
 vmfs_inode_t *vmfs_inode_acquire(const vmfs_fs_t *fs,uint32_t blk_id)
 {
-   vmfs_inode_t *inode;
+   vmfs_inode_t *inode,*cur;
+   uint64_t delay = VMFS_INODE_REVALIDATE_DELAY;
    u_int hb;
 
    hb = vmfs_inode_hash(fs,blk_id);
-   for(inode=fs->inodes[hb];inode;inode=inode->next)
-      if (inode->id == blk_id) {
-         inode->ref_count++;
-         return inode;
-      }
+
+   pthread_mutex_lock(vmfs_inode_bucket_lock(fs,hb));
+
+   if ((inode = vmfs_inode_find(fs,hb,blk_id)) != NULL) {
+      if (inode->ref_count == 0)
+         delay = 0;
+
+      vmfs_inode_get_ref(fs,inode);
+   }
+
+   pthread_mutex_unlock(vmfs_inode_bucket_lock(fs,hb));
+
+   if (inode != NULL) {
+      vmfs_inode_revalidate(inode,delay);
+      return inode;
+   }
    
    /* Inode not yet used, allocate room for it */
-   if (!(inode = calloc(1,sizeof(*inode))))
+   if (!(inode = vmfs_inode_create()))
       return NULL;
 
    if (vmfs_inode_get(fs,blk_id,inode) == -1) {
-      free(inode);
+      vmfs_inode_free(inode);
       return NULL;
    }
 
-   vmfs_inode_register(fs,inode);
+   inode->check_time = vmfs_host_get_uptime();
+
+   pthread_mutex_lock(vmfs_inode_bucket_lock(fs,hb));
+
+   if ((cur = vmfs_inode_find(fs,hb,blk_id)) != NULL)
+      vmfs_inode_get_ref(fs,cur);
+   else
+      vmfs_inode_hash_insert(fs,hb,inode);
+
+   pthread_mutex_unlock(vmfs_inode_bucket_lock(fs,hb));
+
+   if (cur != NULL) {
+      vmfs_inode_free(inode);
+      return cur;
+   }
+
    return inode;
 }
 
-/* Release an inode */
+/* Free the file blocks allocated ahead and left unused */
+static void vmfs_inode_prealloc_release(vmfs_inode_t *inode)
+{
+   if (inode->prealloc_pos < inode->prealloc_count)
+      vmfs_block_free_list(inode->fs,&inode->prealloc[inode->prealloc_pos],
+                           inode->prealloc_count - inode->prealloc_pos);
+
+   inode->prealloc_pos = inode->prealloc_count = 0;
+}
+
+/* Get the closest block preceding the given index in a pointer block */
+static uint32_t vmfs_inode_prev_block(const u_char *list,u_int index)
+{
+   uint32_t blk_id;
+
+   while(index-- > 0)
+      if ((blk_id = read_le32(list,index*sizeof(uint32_t))) != 0)
+         return(blk_id);
+
+   return(0);
+}
+
+/* 
+ * Get an allocation goal for the first block of a file, so that files
+ * growing at the same time start at different places instead of
+ * interleaving their blocks. It is expressed as the block preceding the
+ * chosen item, derived from the inode number.
+ */
+static uint32_t vmfs_inode_alloc_goal(const vmfs_inode_t *inode)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   uint32_t ino,goal;
+
+   if (!fs->fbb->bmh.total_items)
+      return(0);
+
+   ino = (VMFS_BLK_FD_ENTRY(inode->id) * 
+          fs->fdc->bmh.items_per_bitmap_entry) +
+         VMFS_BLK_FD_ITEM(inode->id);
+
+   /* Scale a multiplicative hash of the inode number to the item range */
+   goal = ((uint64_t)(uint32_t)(ino * 2654435761U) * 
+           fs->fbb->bmh.total_items) >> 32;
+
+   return(goal ? VMFS_BLK_FB_BUILD(goal - 1,0) : 0);
+}
+
+/* 
+ * Allocate a file block for the given position, as close as possible to
+ * the block "hint" preceding it. When the file is being extended, a run of
+ * blocks is taken at once and kept for the next writes.
+ */
+static int vmfs_inode_alloc_fb(vmfs_inode_t *inode,off_t pos,uint32_t hint,
+                               uint32_t *blk_id)
+{
+   int res;
+
+   if (!hint)
+      hint = vmfs_inode_alloc_goal(inode);
+
+   if (pos < inode->size) {
+      res = vmfs_block_alloc_range(inode->fs,VMFS_BLK_TYPE_FB,hint,1,blk_id);
+      return((res < 0) ? res : 0);
+   }
+
+   if (inode->prealloc_pos == inode->prealloc_count) {
+      res = vmfs_block_alloc_range(inode->fs,VMFS_BLK_TYPE_FB,hint,
+                                   VMFS_INODE_PREALLOC_COUNT,inode->prealloc);
+      if (res < 0)
+         return(res);
+
+      inode->prealloc_pos = 0;
+      inode->prealloc_count = res;
+   }
+
+   *blk_id = inode->prealloc[inode->prealloc_pos++];
+   return(0);
+}
+
+/* 
+ * Keep an unreferenced inode in-core, with its bucket lock held. The least
+ * recently used inodes beyond the limit are taken out of the hash table and
+ * returned for freeing. Their bucket is only tried, since locks are
+ * otherwise taken bucket first.
+ */
+static vmfs_inode_t *vmfs_inode_lru_add(vmfs_fs_t *fs,u_int hb,
+                                        vmfs_inode_t *inode)
+{
+   vmfs_inode_t *victim,*evicted = NULL;
+   u_int vb;
+
+   pthread_mutex_lock(&fs->inode_lru_lock);
+   vmfs_inode_lru_push(fs,inode);
+
+   while ((fs->inode_lru_count > fs->inode_lru_max) &&
+          ((victim = fs->inode_lru_tail) != inode))
+   {
+      vb = vmfs_inode_hash(fs,victim->id);
+
+      if ((vb != hb) && pthread_mutex_trylock(vmfs_inode_bucket_lock(fs,vb)))
+         break;
+
+      vmfs_inode_lru_unlink(fs,victim);
+      vmfs_inode_hash_unlink(victim);
+
+      if (vb != hb)
+         pthread_mutex_unlock(vmfs_inode_bucket_lock(fs,vb));
+
+      victim->next = evicted;
+      evicted = victim;
+   }
+
+   pthread_mutex_unlock(&fs->inode_lru_lock);
+   return evicted;
+}
+
+static int vmfs_inode_truncate_locked(vmfs_inode_t *inode,off_t new_len);
+
+/* 
+ * Delete an unlinked inode, with the transaction lock held. Its blocks and
+ * its descriptor are only freed once it is not in use anymore, so that the
+ * descriptor can't be reused while the inode is still in-core.
+ */
+static void vmfs_inode_delete(vmfs_inode_t *inode)
+{
+   const vmfs_fs_t *fs = inode->fs;
+
+   pthread_rwlock_wrlock(&inode->blk_lock);
+   vmfs_inode_truncate_locked(inode,0);
+   pthread_rwlock_unlock(&inode->blk_lock);
+
+   vmfs_inode_update(inode,1);
+   inode->update_flags = 0;
+   inode->unlinked = false;
+
+   if (inode->type == VMFS_FILE_TYPE_DIR)
+      vmfs_dircache_invalidate(fs,inode->id);
+
+   vmfs_block_free(fs,inode->id);
+}
+
+/* 
+ * Take the transaction lock before writing back an inode. When no
+ * transaction can be started, the lock is still taken, so that the lock
+ * order is kept. Returns whether a transaction was started.
+ */
+static int vmfs_inode_txn_begin(vmfs_fs_t *fs)
+{
+   if (vmfs_txn_begin(fs) == 0)
+      return(1);
+
+   pthread_mutex_lock(&fs->txn_lock);
+   return(0);
+}
+
+/* Drop the transaction lock taken by vmfs_inode_txn_begin() */
+static void vmfs_inode_txn_end(vmfs_fs_t *fs,int txn)
+{
+   if (txn)
+      vmfs_txn_commit(fs);
+   else
+      pthread_mutex_unlock(&fs->txn_lock);
+}
+
+/* 
+ * Release an inode. Pending changes of the last reference are written
+ * with the bucket lock held, so that nobody reads the inode from disk
+ * meanwhile. As this may allocate or free blocks, the transaction lock
+ * has to be taken first. The clean inode then stays in the hash table
+ * until it gets evicted from the LRU list, unless it has been deleted.
+ */
 void vmfs_inode_release(vmfs_inode_t *inode)
 {
-   assert(inode->ref_count > 0);
- 
-   if (--inode->ref_count == 0) {
-      if (inode->update_flags)
-         vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+   vmfs_inode_t *evicted,*next;
+   pthread_mutex_t *lock;
+   int txn = -1;
+   u_int hb;
 
-      if (inode->pprev != NULL) {
-         /* remove the inode from hash table */
-         if (inode->next != NULL)
-            inode->next->pprev = inode->pprev;
+   assert(inode->ref_count > 0);
 
-         *(inode->pprev) = inode->next;
+   /* Inodes out of the hash table (meta-files) belong to a single user */
+   if (inode->pprev == NULL) {
+      if (--inode->ref_count == 0) {
+         vmfs_inode_prealloc_release(inode);
 
-         free(inode);
+         if (inode->update_flags)
+            vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
       }
+      return;
+   }
+
+   hb = vmfs_inode_hash(fs,inode->id);
+   lock = vmfs_inode_bucket_lock(fs,hb);
+   pthread_mutex_lock(lock);
+
+   if ((inode->ref_count == 1) && (inode->update_flags || inode->unlinked ||
+       (inode->prealloc_pos < inode->prealloc_count)))
+   {
+      pthread_mutex_unlock(lock);
+      txn = vmfs_inode_txn_begin(fs);
+      pthread_mutex_lock(lock);
+   }
+
+   if (--inode->ref_count > 0) {
+      pthread_mutex_unlock(lock);
+
+      if (txn >= 0)
+         vmfs_inode_txn_end(fs,txn);
+      return;
+   }
+
+   vmfs_inode_prealloc_release(inode);
+
+   if (inode->unlinked) {
+      vmfs_inode_delete(inode);
+   } else if (inode->update_flags) {
+      vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
+      inode->update_flags = 0;
+   }
+
+   if ((inode->nlink > 0) && (fs->inode_lru_max > 0)) {
+      evicted = vmfs_inode_lru_add(fs,hb,inode);
+   } else {
+      vmfs_inode_hash_unlink(inode);
+      inode->next = NULL;
+      evicted = inode;
+   }
+
+   pthread_mutex_unlock(lock);
+
+   if (txn >= 0)
+      vmfs_inode_txn_end(fs,txn);
+
+   for(;evicted;evicted=next) {
+      next = evicted->next;
+      vmfs_inode_free(evicted);
    }
 }
 
+/* 
+ * Write back an inode still in use and give back its preallocated blocks,
+ * or delete it if it has been unlinked. This is for inodes still referenced
+ * when the filesystem is closed.
+ */
+void vmfs_inode_sync(vmfs_inode_t *inode)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+   int txn;
+
+   if (!inode->update_flags && !inode->unlinked &&
+       (inode->prealloc_pos == inode->prealloc_count))
+      return;
+
+   txn = vmfs_inode_txn_begin(fs);
+   vmfs_inode_prealloc_release(inode);
+
+   if (inode->unlinked) {
+      vmfs_inode_delete(inode);
+   } else if (inode->update_flags) {
+      vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
+      inode->update_flags = 0;
+   }
+
+   vmfs_inode_txn_end(fs,txn);
+}
+
 /* Allocate a new inode */
 int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
 {
@@ -231,7 +710,7 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
 
    time(&ct);
 
-   if (!(*inode = calloc(1,sizeof(vmfs_inode_t))))
+   if (!(*inode = vmfs_inode_create()))
       return(-ENOMEM);
 
    (*inode)->mdh.magic = VMFS_INODE_MAGIC;
@@ -246,7 +725,7 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
    (*inode)->cmode     = (*inode)->mode | vmfs_file_type2mode((*inode)->type);
 
    if ((vmfs_block_alloc(fs,VMFS_BLK_TYPE_FD,&(*inode)->id)) < 0) {
-      free(*inode);
+      vmfs_inode_free(*inode);
       return(-ENOSPC);
    }
 
@@ -261,23 +740,29 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
        (VMFS_BLK_TYPE(fdc_blk) != VMFS_BLK_TYPE_FB))
    {
       vmfs_block_free(fs,(*inode)->id);
-      free(*inode);
+      vmfs_inode_free(*inode);
       return(-ENOSPC);
    }
 
    (*inode)->mdh.pos = fdc_inode->blk_size * VMFS_BLK_FB_ITEM(fdc_blk);
    (*inode)->mdh.pos += fdc_offset % fdc_inode->blk_size;
 
+   /* Not linked yet: deleted if released before being linked */
+   (*inode)->unlinked = true;
    (*inode)->update_flags |= VMFS_INODE_SYNC_ALL;
-   vmfs_inode_register(fs,*inode);
+
+   /* The descriptor is still held by an in-core inode: leave it alone */
+   if (vmfs_inode_register(fs,*inode) == -1) {
+      vmfs_inode_free(*inode);
+      return(-EIO);
+   }
+
    return(0);
 }
 
-/* 
- * Get block ID corresponding the specified position. Pointer block
- * resolution is transparently done here.
- */
-int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
+/* Get block ID of the specified position, with the block lock held */
+static int vmfs_inode_get_block_locked(const vmfs_inode_t *inode,off_t pos,
+                                       uint32_t *blk_id)
 {
    const vmfs_fs_t *fs = inode->fs;
    u_int blk_index;
@@ -311,7 +796,7 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
 
       case VMFS_BLK_TYPE_PB:
       {
-         DECL_ALIGNED_BUFFER_WOL(buf,fs->pbc->bmh.data_size);
+         u_char buf[sizeof(uint32_t)];
          uint32_t pb_blk_id;
          uint32_t blk_per_pb;
          u_int pb_index;
@@ -331,13 +816,11 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
          if (!pb_blk_id)
             break;
 
-         if (!vmfs_bitmap_get_item(fs->pbc,
-                                   VMFS_BLK_PB_ENTRY(pb_blk_id),
-                                   VMFS_BLK_PB_ITEM(pb_blk_id),
-                                   buf))
+         if (vmfs_pbcache_read(fs,pb_blk_id,sub_index*sizeof(uint32_t),
+                               buf,sizeof(buf)) == -1)
             return(-EIO);
 
-         *blk_id = read_le32(buf,sub_index*sizeof(uint32_t));
+         *blk_id = read_le32(buf,0);
          break;
       }
 
@@ -354,6 +837,21 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
    return(0);
 }
 
+/* 
+ * Get block ID corresponding the specified position. Pointer block
+ * resolution is transparently done here.
+ */
+int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
+{
+   vmfs_inode_t *winode = (vmfs_inode_t *)inode;
+   int res;
+
+   pthread_rwlock_rdlock(&winode->blk_lock);
+   res = vmfs_inode_get_block_locked(inode,pos,blk_id);
+   pthread_rwlock_unlock(&winode->blk_lock);
+   return(res);
+}
+
 /* Aggregate a sub-block to a file block */
 static int vmfs_inode_aggregate_fb(vmfs_inode_t *inode)
 {
@@ -380,7 +878,9 @@ static int vmfs_inode_aggregate_fb(vmfs_inode_t *inode)
       goto err_sb_blk_read;
    }
 
-   if ((res = vmfs_block_alloc(fs,VMFS_BLK_TYPE_FB,&fb_blk)) < 0)
+   if ((res = vmfs_block_alloc_range(fs,VMFS_BLK_TYPE_FB,
+                                     vmfs_inode_alloc_goal(inode),
+                                     1,&fb_blk)) < 0)
       goto err_blk_alloc;
 
    fb_item = VMFS_BLK_FB_ITEM(fb_blk);
@@ -406,6 +906,7 @@ static int vmfs_inode_aggregate_fb(vmfs_inode_t *inode)
    inode->zla = VMFS_BLK_TYPE_FB;
    inode->blk_size = vmfs_fs_get_blocksize(fs);
    inode->update_flags |= VMFS_INODE_SYNC_BLK;
+   inode->blk_gen++;
 
    iobuffer_free(buf);
    return(0);
@@ -453,10 +954,13 @@ static int vmfs_inode_aggregate_pb(vmfs_inode_t *inode)
       goto err_set_item;
    }
 
+   vmfs_pbcache_update(fs,pb_blk,buf);
+
    memset(inode->blocks,0,sizeof(inode->blocks));
    inode->blocks[0] = pb_blk;
    inode->zla = VMFS_BLK_TYPE_PB;
    inode->update_flags |= VMFS_INODE_SYNC_BLK;
+   inode->blk_gen++;
 
    iobuffer_free(buf);
    return(0);
@@ -490,16 +994,15 @@ static int vmfs_inode_aggregate(vmfs_inode_t *inode,off_t pos)
    return(0);
 }
 
-/* Get a block for writing corresponding to the specified position */
-int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
+/* Get a block for writing, with the transaction and block locks held */
+static int vmfs_inode_get_wrblock_locked(vmfs_inode_t *inode,off_t pos,
+                                         uint32_t *blk_id)
 {
    const vmfs_fs_t *fs = inode->fs;
-   u_int blk_index;
+   u_int blk_index,i;
+   uint32_t hint;
    int res;
 
-   if (!vmfs_fs_readwrite(fs))
-      return(-EROFS);
-
    *blk_id = 0;
 
    if ((res = vmfs_inode_aggregate(inode,pos)) < 0)
@@ -534,24 +1037,26 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
          memset(buf,0,fs->pbc->bmh.data_size);
          inode->blocks[pb_index] = pb_blk_id;
          inode->update_flags |= VMFS_INODE_SYNC_BLK;
+         inode->blk_gen++;
          update_pb = 1;
       } else {
-         if (!vmfs_bitmap_get_item(fs->pbc,
-                                   VMFS_BLK_PB_ENTRY(pb_blk_id),
-                                   VMFS_BLK_PB_ITEM(pb_blk_id),
-                                   buf))
+         if (vmfs_pbcache_read(fs,pb_blk_id,0,buf,
+                               fs->pbc->bmh.data_size) == -1)
             return(-EIO);
 
          *blk_id = read_le32(buf,sub_index*sizeof(uint32_t));
       }
 
       if (!*blk_id) {
-         if ((res = vmfs_block_alloc(fs,VMFS_BLK_TYPE_FB,blk_id)) < 0)
+         hint = vmfs_inode_prev_block(buf,sub_index);
+
+         if ((res = vmfs_inode_alloc_fb(inode,pos,hint,blk_id)) < 0)
             return(res);
 
          write_le32(buf,sub_index*sizeof(uint32_t),*blk_id);
          inode->blk_count++;
          inode->update_flags |= VMFS_INODE_SYNC_BLK;
+         inode->blk_gen++;
          update_pb = 1;
       } else {
          if (VMFS_BLK_FB_TBZ(*blk_id)) {
@@ -562,16 +1067,24 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
             write_le32(buf,sub_index*sizeof(uint32_t),*blk_id);
             inode->tbz--;
             inode->update_flags |= VMFS_INODE_SYNC_BLK;
+            inode->blk_gen++;
             update_pb = 1;
          }
       }
 
       /* Update the pointer block on disk if it has been modified */
-      if (update_pb && !vmfs_bitmap_set_item(fs->pbc,
-                                             VMFS_BLK_PB_ENTRY(pb_blk_id),
-                                             VMFS_BLK_PB_ITEM(pb_blk_id),
-                                             buf))
-         return(-EIO);
+      if (update_pb) {
+         if (!vmfs_bitmap_set_item(fs->pbc,
+                                   VMFS_BLK_PB_ENTRY(pb_blk_id),
+                                   VMFS_BLK_PB_ITEM(pb_blk_id),
+                                   buf))
+         {
+            vmfs_pbcache_invalidate(fs,pb_blk_id);
+            return(-EIO);
+         }
+
+         vmfs_pbcache_update(fs,pb_blk_id,buf);
+      }
    } else {
       /* File Block or Sub-Block */
       blk_index = pos / inode->blk_size;
@@ -582,12 +1095,22 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
       *blk_id = inode->blocks[blk_index];
 
       if (!*blk_id) {
-         if ((res = vmfs_block_alloc(fs,inode->zla,blk_id)) < 0)
+         for(i=blk_index,hint=0;!hint && (i > 0);i--)
+            hint = inode->blocks[i-1];
+
+         if (inode->zla == VMFS_BLK_TYPE_FB)
+            res = vmfs_inode_alloc_fb(inode,pos,hint,blk_id);
+         else if ((res = vmfs_block_alloc_range(fs,inode->zla,hint,1,
+                                                blk_id)) > 0)
+            res = 0;
+
+         if (res < 0)
             return(res);
 
          inode->blocks[blk_index] = *blk_id;
          inode->blk_count++;
          inode->update_flags |= VMFS_INODE_SYNC_BLK;
+         inode->blk_gen++;
       } else {
          if ((inode->zla == VMFS_BLK_TYPE_FB) && VMFS_BLK_FB_TBZ(*blk_id)) {
             if ((res = vmfs_block_zeroize_fb(fs,*blk_id)) < 0)
@@ -597,6 +1120,7 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
             inode->blocks[blk_index] = *blk_id;
             inode->tbz--;
             inode->update_flags |= VMFS_INODE_SYNC_BLK;
+            inode->blk_gen++;
          }
       }
    }
@@ -604,19 +1128,77 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
    return(0);
 }
 
-/* Truncate file */
-int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
+/* 
+ * Look up an existing block that can be written as is, with the block
+ * lock held. Returns 0 if a block must be allocated or zeroed first.
+ */
+static uint32_t vmfs_inode_get_wrblock_fast(const vmfs_inode_t *inode,
+                                            off_t pos)
 {
-   const vmfs_fs_t *fs = inode->fs;
-   u_int i;
+   uint32_t blk_id;
+
+   switch(inode->zla) {
+      case VMFS_BLK_TYPE_SB:
+         if (pos >= inode->blk_size)
+            return(0);
+      case VMFS_BLK_TYPE_FB:
+      case VMFS_BLK_TYPE_PB:
+         break;
+      default:
+         return(0);
+   }
+
+   if (vmfs_inode_get_block_locked(inode,pos,&blk_id) < 0)
+      return(0);
+
+   if ((VMFS_BLK_TYPE(blk_id) == VMFS_BLK_TYPE_FB) && VMFS_BLK_FB_TBZ(blk_id))
+      return(0);
+
+   return(blk_id);
+}
+
+/* 
+ * Get a block for writing corresponding to the specified position.
+ * Block list changes are made under the transaction lock, which keeps
+ * concurrent writers of the inode apart, and under the block lock, which
+ * keeps readers from seeing a half updated block list. Writes to blocks
+ * already in place only take the block lock for reading.
+ */
+int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
    int res;
 
    if (!vmfs_fs_readwrite(fs))
       return(-EROFS);
 
+   pthread_rwlock_rdlock(&inode->blk_lock);
+   *blk_id = vmfs_inode_get_wrblock_fast(inode,pos);
+   pthread_rwlock_unlock(&inode->blk_lock);
+
+   if (*blk_id != 0)
+      return(0);
+
+   pthread_mutex_lock(&fs->txn_lock);
+   pthread_rwlock_wrlock(&inode->blk_lock);
+   res = vmfs_inode_get_wrblock_locked(inode,pos,blk_id);
+   pthread_rwlock_unlock(&inode->blk_lock);
+   pthread_mutex_unlock(&fs->txn_lock);
+   return(res);
+}
+
+/* Truncate file, with the transaction and block locks held */
+static int vmfs_inode_truncate_locked(vmfs_inode_t *inode,off_t new_len)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   u_int i;
+   int res;
+
    if (new_len == inode->size)
       return(0);
 
+   vmfs_inode_prealloc_release(inode);
+
    if (new_len > inode->size) {
       if ((res = vmfs_inode_aggregate(inode,new_len)) < 0)
          return(res);
@@ -632,16 +1214,21 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
       {
          u_int start,end;
 
+         uint32_t blk_ids[VMFS_INODE_BLK_COUNT];
+         u_int n = 0;
+
          start = ALIGN_NUM(new_len,inode->blk_size) / inode->blk_size;
-         end   = inode->size / inode->blk_size;
+         end   = m_min(inode->size / inode->blk_size,VMFS_INODE_BLK_COUNT-1);
 
          for(i=start;i<=end;i++) {
             if (inode->blocks[i] != 0) {
-               vmfs_block_free(fs,inode->blocks[i]);
+               blk_ids[n++] = inode->blocks[i];
                inode->blk_count--;
                inode->blocks[i] = 0;
             }
          }
+
+         vmfs_block_free_list(fs,blk_ids,n);
          break;
       }
 
@@ -686,13 +1273,31 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
 
    inode->size = new_len;
    inode->update_flags |= VMFS_INODE_SYNC_BLK;
+   inode->blk_gen++;
    return(0);
 }
 
-/* Call a function for each allocated block of an inode */
-int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
-                             vmfs_inode_foreach_block_cbk_t cbk,
-                             void *opt_arg)
+/* Truncate file */
+int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+   int res;
+
+   if (!vmfs_fs_readwrite(fs))
+      return(-EROFS);
+
+   pthread_mutex_lock(&fs->txn_lock);
+   pthread_rwlock_wrlock(&inode->blk_lock);
+   res = vmfs_inode_truncate_locked(inode,new_len);
+   pthread_rwlock_unlock(&inode->blk_lock);
+   pthread_mutex_unlock(&fs->txn_lock);
+   return(res);
+}
+
+/* Call a function for each allocated block, with the block lock held */
+static int vmfs_inode_foreach_block_locked(const vmfs_inode_t *inode,
+                                           vmfs_inode_foreach_block_cbk_t cbk,
+                                           void *opt_arg)
 {  
    const vmfs_fs_t *fs = inode->fs;
    uint64_t blk_size;
@@ -736,10 +1341,7 @@ int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
          uint32_t blk_id2;
          u_int blk_rem;
 
-         if (!vmfs_bitmap_get_item(fs->pbc,
-                                   VMFS_BLK_PB_ENTRY(blk_id),
-                                   VMFS_BLK_PB_ITEM(blk_id),
-                                   buf))
+         if (vmfs_pbcache_read(fs,blk_id,0,buf,fs->pbc->bmh.data_size) == -1)
             return(-1);
 
          /* Compute remaining blocks */
@@ -759,6 +1361,20 @@ int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
    return(0);
 }
 
+/* Call a function for each allocated block of an inode */
+int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
+                             vmfs_inode_foreach_block_cbk_t cbk,
+                             void *opt_arg)
+{
+   vmfs_inode_t *winode = (vmfs_inode_t *)inode;
+   int res;
+
+   pthread_rwlock_rdlock(&winode->blk_lock);
+   res = vmfs_inode_foreach_block_locked(inode,cbk,opt_arg);
+   pthread_rwlock_unlock(&winode->blk_lock);
+   return(res);
+}
+
 /* Get inode status */
 int vmfs_inode_stat(const vmfs_inode_t *inode,struct stat *buf)
 {
@@ -790,10 +1406,56 @@ int vmfs_inode_stat_from_blkid(const vmfs_fs_t *fs,uint32_t blk_id,
    return(0);
 }
 
+/* 
+ * Attribute changes are made under the transaction lock, as the inode
+ * may be written back meanwhile by the release of another reference.
+ */
+
 /* Change permissions */
 int vmfs_inode_chmod(vmfs_inode_t *inode,mode_t mode)
 {
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+
+   pthread_mutex_lock(&fs->txn_lock);
    inode->mode = mode;
    inode->update_flags |= VMFS_INODE_SYNC_META;
+   pthread_mutex_unlock(&fs->txn_lock);
+   return(0);
+}
+
+/* Change owner, -1 leaves an ID unchanged */
+int vmfs_inode_chown(vmfs_inode_t *inode,uid_t uid,gid_t gid)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+
+   pthread_mutex_lock(&fs->txn_lock);
+
+   if (uid != (uid_t)-1)
+      inode->uid = uid;
+
+   if (gid != (gid_t)-1)
+      inode->gid = gid;
+
+   inode->update_flags |= VMFS_INODE_SYNC_META;
+   pthread_mutex_unlock(&fs->txn_lock);
+   return(0);
+}
+
+/* Change access and modification times, NULL leaves a time unchanged */
+int vmfs_inode_utime(vmfs_inode_t *inode,const time_t *atime,
+                     const time_t *mtime)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+
+   pthread_mutex_lock(&fs->txn_lock);
+
+   if (atime != NULL)
+      inode->atime = *atime;
+
+   if (mtime != NULL)
+      inode->mtime = *mtime;
+
+   inode->update_flags |= VMFS_INODE_SYNC_META;
+   pthread_mutex_unlock(&fs->txn_lock);
    return(0);
 }
@@ -24,6 +24,20 @@
 #define VMFS_INODE_SIZE  0x800
 #define VMFS_INODE_BLK_COUNT      0x100
 
+/* 
+ * Number of file blocks allocated ahead of a writer extending a file.
+ * They are marked allocated on disk right away, so they are lost (and
+ * reported as such by fsck) if the host crashes before they are used
+ * or given back.
+ */
+#define VMFS_INODE_PREALLOC_COUNT 16
+
+/* 
+ * Delay after which an in-core inode still in use is checked again against
+ * the disk, where other hosts may change it, in usecs.
+ */
+#define VMFS_INODE_REVALIDATE_DELAY  1000000
+
 #define VMFS_INODE_MAGIC  0x10c00001
 
 struct vmfs_inode_raw {
@@ -106,7 +120,29 @@ struct vmfs_inode {
    const vmfs_fs_t *fs;
    vmfs_inode_t **pprev,*next;
    u_int ref_count;
+
+   /* The last link is gone, delete the inode with its last reference */
+   bool unlinked;
+
+   /* Position in the list of unreferenced inodes kept in-core */
+   vmfs_inode_t *lru_prev,*lru_next;
    u_int update_flags;
+
+   /* Host uptime of the last check against the on-disk inode */
+   uint64_t check_time;
+
+   /* Protects the block list, which writers update in several steps */
+   pthread_rwlock_t blk_lock;
+
+   /* Incremented each time the block list is modified */
+   u_int blk_gen;
+
+   /* Incremented atomically before and after each file data write */
+   u_int data_gen;
+
+   /* File blocks allocated ahead of the writer, not yet in the file */
+   uint32_t prealloc[VMFS_INODE_PREALLOC_COUNT];
+   u_int prealloc_pos,prealloc_count;
 };
 
 /* Callback function for vmfs_inode_foreach_block() */
@@ -115,6 +151,9 @@ typedef void (*vmfs_inode_foreach_block_cbk_t)(const vmfs_inode_t *inode,
                                                uint32_t blk_id,
                                                void *opt_arg);
 
+/* Read an inode */
+int vmfs_inode_read(vmfs_inode_t *inode,const u_char *buf);
+
 /* Update an inode on disk */
 int vmfs_inode_update(const vmfs_inode_t *inode,int update_blk_list);
 
@@ -127,6 +166,9 @@ vmfs_inode_t *vmfs_inode_acquire(const vmfs_fs_t *fs,uint32_t blk_id);
 /* Release an inode */
 void vmfs_inode_release(vmfs_inode_t *inode);
 
+/* Write back or delete an inode still in use when closing the filesystem */
+void vmfs_inode_sync(vmfs_inode_t *inode);
+
 /* Allocate a new inode */
 int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode);
 
@@ -156,4 +198,11 @@ int vmfs_inode_stat_from_blkid(const vmfs_fs_t *fs,uint32_t blk_id,
 /* Change permissions */
 int vmfs_inode_chmod(vmfs_inode_t *inode,mode_t mode);
 
+/* Change owner, -1 leaves an ID unchanged */
+int vmfs_inode_chown(vmfs_inode_t *inode,uid_t uid,gid_t gid);
+
+/* Change access and modification times, NULL leaves a time unchanged */
+int vmfs_inode_utime(vmfs_inode_t *inode,const time_t *atime,
+                     const time_t *mtime);
+
 #endif
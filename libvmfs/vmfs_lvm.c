@@ -20,26 +20,17 @@
  */
 
 #include <stdlib.h>
+#include <pthread.h>
 #include "vmfs.h"
 
-/* 
- * Until we uncover the details of the segment descriptors format,
- * it is useless to try to do something more efficient.
- */
-
-static vmfs_volume_t *vmfs_lvm_get_extent_from_offset(const vmfs_lvm_t *lvm,
-                                                      off_t pos)
+/* Get the extent holding a given LVM position */
+static inline vmfs_volume_t *
+vmfs_lvm_get_extent_from_offset(const vmfs_lvm_t *lvm,off_t pos)
 {
-   int extent;
-   off_t segment = pos / VMFS_LVM_SEGMENT_SIZE;
-
-   for (extent = 0; extent < lvm->loaded_extents; extent++) {
-      if ((segment >= lvm->extents[extent]->vol_info.first_segment) &&
-          (segment <= lvm->extents[extent]->vol_info.last_segment))
-        return(lvm->extents[extent]);
-   }
+   if (pos < 0)
+      return NULL;
 
-   return(NULL);
+   return(vmfs_lvm_get_segment_extent(lvm,pos / VMFS_LVM_SEGMENT_SIZE));
 }
 
 /* Get extent size */
@@ -50,23 +41,103 @@ static inline uint64_t vmfs_lvm_extent_size(const vmfs_volume_t *extent)
 
 typedef ssize_t (*vmfs_vol_io_func)(const vmfs_device_t *,off_t,u_char *,size_t);
 
-/* Read a raw block of data on logical volume */
+/* Part of an LVM request falling in a single extent */
+struct vmfs_lvm_io_piece {
+   vmfs_volume_t *extent;
+   off_t offset;
+   u_char *buf;
+   size_t len;
+   vmfs_vol_io_func func;
+   ssize_t res;
+   pthread_t thread;
+   int threaded;
+};
+
+/* Do the I/O for a piece of request */
+static void *vmfs_lvm_io_piece(void *arg)
+{
+   struct vmfs_lvm_io_piece *p = arg;
+
+   p->res = p->func(&p->extent->dev,p->offset,p->buf,p->len);
+   return NULL;
+}
+
+/* 
+ * Do I/O on logical volume, splitting the request where it crosses
+ * extent boundaries. When the request is large enough, the pieces are
+ * dispatched in parallel, each extent being a separate file or LUN.
+ */
 static inline ssize_t vmfs_lvm_io(const vmfs_lvm_t *lvm,off_t pos,u_char *buf,
                                   size_t len,vmfs_vol_io_func func)
 {
-   vmfs_volume_t *extent = vmfs_lvm_get_extent_from_offset(lvm,pos);
+   struct vmfs_lvm_io_piece pieces[VMFS_LVM_MAX_EXTENTS];
+   vmfs_volume_t *extent;
+   ssize_t total = 0;
+   size_t clen,total_len = len;
+   off_t offset;
+   int i,count,parallel;
+
+   for(count=0;len > 0;count++) {
+      if (!(extent = vmfs_lvm_get_extent_from_offset(lvm,pos)) ||
+          (count == VMFS_LVM_MAX_EXTENTS))
+         break;
+
+      offset = pos - (uint64_t)extent->vol_info.first_segment *
+                        VMFS_LVM_SEGMENT_SIZE;
+      clen = m_min(len,vmfs_lvm_extent_size(extent) - offset);
+
+      /* Common case: the whole request is on a single extent */
+      if ((count == 0) && (clen == len))
+         return(func(&extent->dev,offset,buf,clen));
+
+      pieces[count].extent   = extent;
+      pieces[count].offset   = offset;
+      pieces[count].buf      = buf;
+      pieces[count].len      = clen;
+      pieces[count].func     = func;
+      pieces[count].threaded = 0;
+
+      pos += clen;
+      buf += clen;
+      len -= clen;
+   }
 
-   if (!extent)
+   if (count == 0)
       return(-1);
 
-   pos -= (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
-   if ((pos + len) > vmfs_lvm_extent_size(extent)) {
-      /* TODO: Handle this case */
-      fprintf(stderr,"VMFS: i/o spanned over several extents is unsupported\n");
-      return(-1);
+   if ((parallel = (total_len >= VMFS_LVM_PARALLEL_MIN_IO))) {
+      for(i=1;i<count;i++)
+         pieces[i].threaded = !pthread_create(&pieces[i].thread,NULL,
+                                              vmfs_lvm_io_piece,&pieces[i]);
    }
 
-   return(func(&extent->dev,pos,buf,len));
+   for(i=0;i<count;i++) {
+      if (pieces[i].threaded) {
+         pthread_join(pieces[i].thread,NULL);
+         continue;
+      }
+
+      vmfs_lvm_io_piece(&pieces[i]);
+
+      /* Don't go further after an error when doing pieces in order */
+      if (!parallel && (pieces[i].res != pieces[i].len)) {
+         count = i + 1;
+         break;
+      }
+   }
+
+   /* Report what was transferred before the first error or short I/O */
+   for(i=0;i<count;i++) {
+      if (pieces[i].res < 0)
+         return((i == 0) ? pieces[i].res : total);
+
+      total += pieces[i].res;
+
+      if (pieces[i].res != pieces[i].len)
+         break;
+   }
+
+   return(total);
 }
 
 /* Read a raw block of data on logical volume */
@@ -85,6 +156,163 @@ static ssize_t vmfs_lvm_write(const vmfs_device_t *dev,off_t pos,
    return(vmfs_lvm_io(lvm,pos,(u_char *)buf,len,(vmfs_vol_io_func)vmfs_device_write));
 }
 
+typedef ssize_t (*vmfs_vol_iov_func)(const vmfs_device_t *,off_t,
+                                     const struct iovec *,int);
+
+/* 
+ * Do vectored I/O on logical volume. The vector is passed unchanged to the
+ * extent when it holds the whole request, and split per buffer otherwise.
+ */
+static ssize_t vmfs_lvm_iov(const vmfs_lvm_t *lvm,off_t pos,
+                            const struct iovec *iov,int iovcnt,
+                            vmfs_vol_io_func func,vmfs_vol_iov_func vfunc)
+{
+   vmfs_volume_t *extent;
+   ssize_t res,total = 0;
+   off_t offset;
+   size_t len;
+   int i;
+
+   if (!(extent = vmfs_lvm_get_extent_from_offset(lvm,pos)))
+      return(-1);
+
+   for(i=0,len=0;i<iovcnt;i++)
+      len += iov[i].iov_len;
+
+   offset = pos - (uint64_t)extent->vol_info.first_segment *
+                     VMFS_LVM_SEGMENT_SIZE;
+
+   if ((offset + len) <= vmfs_lvm_extent_size(extent))
+      return(vfunc(&extent->dev,offset,iov,iovcnt));
+
+   for(i=0;i<iovcnt;i++) {
+      res = vmfs_lvm_io(lvm,pos+total,iov[i].iov_base,iov[i].iov_len,func);
+
+      if (res < 0)
+         return(res);
+
+      total += res;
+
+      if (res != iov[i].iov_len)
+         break;
+   }
+
+   return(total);
+}
+
+/* Read raw data on logical volume into several buffers */
+static ssize_t vmfs_lvm_readv(const vmfs_device_t *dev,off_t pos,
+                              const struct iovec *iov,int iovcnt)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   return(vmfs_lvm_iov(lvm,pos,iov,iovcnt,vmfs_device_read,
+                       vmfs_device_readv));
+}
+
+/* Write several buffers of raw data on logical volume */
+static ssize_t vmfs_lvm_writev(const vmfs_device_t *dev,off_t pos,
+                               const struct iovec *iov,int iovcnt)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   return(vmfs_lvm_iov(lvm,pos,iov,iovcnt,
+                       (vmfs_vol_io_func)vmfs_device_write,
+                       vmfs_device_writev));
+}
+
+/* Get the extent fully holding a request, if any */
+static vmfs_volume_t *vmfs_lvm_get_req_extent(const vmfs_lvm_t *lvm,
+                                              const vmfs_io_req_t *req,
+                                              off_t *base)
+{
+   vmfs_volume_t *extent = vmfs_lvm_get_extent_from_offset(lvm,req->pos);
+
+   if (!extent)
+      return NULL;
+
+   *base = (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
+
+   if (req->pos - *base + req->len > vmfs_lvm_extent_size(extent))
+      return NULL;
+
+   return extent;
+}
+
+/* 
+ * Read a batch of requests on logical volume. Consecutive requests on the
+ * same extent are handed to it as a single batch.
+ */
+static int vmfs_lvm_read_batch(const vmfs_device_t *dev,
+                               vmfs_io_req_t *reqs,int count)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   vmfs_volume_t *extent;
+   vmfs_io_req_t *ext_reqs;
+   off_t base,next_base;
+   int i,j,n,res = 0;
+
+   ext_reqs = malloc(count * sizeof(*ext_reqs));
+
+   for(i=0;i<count;i+=n) {
+      extent = ext_reqs ? vmfs_lvm_get_req_extent(lvm,&reqs[i],&base) : NULL;
+
+      /* Requests spanning over several extents are done one at a time */
+      if (!extent) {
+         reqs[i].res = vmfs_lvm_read(dev,reqs[i].pos,reqs[i].buf,reqs[i].len);
+         if (reqs[i].res != reqs[i].len)
+            res = -1;
+         n = 1;
+         continue;
+      }
+
+      for(n=0;(i+n < count) &&
+              (vmfs_lvm_get_req_extent(lvm,&reqs[i+n],&next_base) == extent);
+          n++)
+      {
+         ext_reqs[n] = reqs[i+n];
+         ext_reqs[n].pos -= base;
+      }
+
+      if (vmfs_device_read_batch(&extent->dev,ext_reqs,n) < 0)
+         res = -1;
+
+      for(j=0;j<n;j++)
+         reqs[i+j].res = ext_reqs[j].res;
+   }
+
+   free(ext_reqs);
+   return(res);
+}
+
+/* Get direct access to data of memory mapped extents */
+static const u_char *vmfs_lvm_map(const vmfs_device_t *dev,off_t pos,
+                                  size_t len)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   vmfs_io_req_t req = { .pos = pos, .len = len };
+   vmfs_volume_t *extent;
+   off_t base;
+
+   if (!(extent = vmfs_lvm_get_req_extent(lvm,&req,&base)))
+      return NULL;
+
+   return(vmfs_device_map(&extent->dev,pos - base,len));
+}
+
+/* Locate data held by a single extent */
+static int vmfs_lvm_locate(const vmfs_device_t *dev,off_t pos,size_t len,
+                           off_t *fd_pos)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   vmfs_io_req_t req = { .pos = pos, .len = len };
+   vmfs_volume_t *extent;
+   off_t base;
+
+   if (!(extent = vmfs_lvm_get_req_extent(lvm,&req,&base)))
+      return(-1);
+
+   return(vmfs_device_locate(&extent->dev,pos - base,len,fd_pos));
+}
+
 /* Reserve the underlying volume given a LVM position */
 static int vmfs_lvm_reserve(const vmfs_device_t *dev,off_t pos)
 {
@@ -94,7 +322,8 @@ static int vmfs_lvm_reserve(const vmfs_device_t *dev,off_t pos)
    if (!extent)
       return(-1);
 
-   return(vmfs_device_reserve(&extent->dev, 0));
+   return(vmfs_device_reserve(&extent->dev,pos -
+          (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE));
 }
 
 /* Release the underlying volume given a LVM position */
@@ -106,7 +335,8 @@ static int vmfs_lvm_release(const vmfs_device_t *dev,off_t pos)
    if (!extent)
       return(-1);
 
-   return(vmfs_device_release(&extent->dev, 0));
+   return(vmfs_device_release(&extent->dev,pos -
+          (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE));
 }
 
 /* Create a volume structure */
@@ -172,12 +402,67 @@ static void vmfs_lvm_close(vmfs_device_t *dev)
    while(lvm->loaded_extents--)
       vmfs_device_close(&lvm->extents[lvm->loaded_extents]->dev);
 
+   free(lvm->segments);
    free(lvm);
 }
 
+/* 
+ * Build the segment table, giving the extent holding each segment of the
+ * logical volume.
+ */
+static int vmfs_lvm_build_segments(vmfs_lvm_t *lvm)
+{
+   vmfs_volume_t *extent;
+   uint32_t i,seg;
+   int e;
+
+   lvm->num_segments = 0;
+
+   for (e = 0; e < lvm->loaded_extents; e++) {
+      extent = lvm->extents[e];
+
+      if ((extent->vol_info.last_segment < extent->vol_info.first_segment) ||
+          (extent->vol_info.last_segment - extent->vol_info.first_segment + 1
+           != extent->vol_info.num_segments))
+      {
+         fprintf(stderr, "VMFS: Inconsistent segment information for the %s"
+                         " file/device\n", extent->device);
+         return(-1);
+      }
+
+      lvm->num_segments = m_max(lvm->num_segments,
+                                extent->vol_info.last_segment + 1);
+   }
+
+   free(lvm->segments);
+
+   if (!(lvm->segments = calloc(lvm->num_segments,sizeof(*lvm->segments))))
+      return(-1);
+
+   for (e = 0; e < lvm->loaded_extents; e++) {
+      extent = lvm->extents[e];
+
+      for (i = 0; i < extent->vol_info.num_segments; i++) {
+         seg = extent->vol_info.first_segment + i;
+
+         if (lvm->segments[seg]) {
+            fprintf(stderr, "VMFS: The %s and %s files/devices overlap\n",
+                    lvm->segments[seg]->device, extent->device);
+            return(-1);
+         }
+
+         lvm->segments[seg] = extent;
+      }
+   }
+
+   return(0);
+}
+
 /* Open an LVM */
 int vmfs_lvm_open(vmfs_lvm_t *lvm)
 {
+   int i;
+
    if (!lvm->flags.allow_missing_extents && 
        (lvm->loaded_extents != lvm->lvm_info.num_extents)) 
    {
@@ -185,9 +470,20 @@ int vmfs_lvm_open(vmfs_lvm_t *lvm)
       return(-1);
    }
 
+   if (vmfs_lvm_build_segments(lvm) == -1)
+      return(-1);
+
    lvm->dev.read = vmfs_lvm_read;
-   if (lvm->flags.read_write)
+   lvm->dev.readv = vmfs_lvm_readv;
+   lvm->dev.read_batch = vmfs_lvm_read_batch;
+   for (i = 0; (i < lvm->loaded_extents) && lvm->extents[i]->dev.map; i++);
+   if (i == lvm->loaded_extents)
+      lvm->dev.map = vmfs_lvm_map;
+   if (lvm->flags.read_write) {
       lvm->dev.write = vmfs_lvm_write;
+      lvm->dev.writev = vmfs_lvm_writev;
+   }
+   lvm->dev.locate = vmfs_lvm_locate;
    lvm->dev.reserve = vmfs_lvm_reserve;
    lvm->dev.release = vmfs_lvm_release;
    lvm->dev.close = vmfs_lvm_close;
@@ -22,6 +22,9 @@
 
 #define VMFS_LVM_SEGMENT_SIZE (256 * 1024 * 1024)
 
+/* Minimum size of a request spanning extents to do its pieces in parallel */
+#define VMFS_LVM_PARALLEL_MIN_IO (1024 * 1024)
+
 struct vmfs_lvminfo {
    uuid_t uuid;
    uint32_t num_extents;
@@ -43,6 +46,10 @@ struct vmfs_lvm {
 
    /* extents */
    vmfs_volume_t *extents[VMFS_LVM_MAX_EXTENTS];
+
+   /* Extent holding each segment (NULL for missing extents) */
+   vmfs_volume_t **segments;
+   uint32_t num_segments;
 };
 
 /* Create a volume structure */
@@ -54,6 +61,15 @@ int vmfs_lvm_add_extent(vmfs_lvm_t *lvm, vmfs_volume_t *vol);
 /* Open an LVM */
 int vmfs_lvm_open(vmfs_lvm_t *lvm);
 
+/* Get the extent holding a given segment */
+static inline vmfs_volume_t *vmfs_lvm_get_segment_extent(const vmfs_lvm_t *lvm,
+                                                         uint32_t segment)
+{
+   if (segment >= lvm->num_segments)
+      return NULL;
+   return lvm->segments[segment];
+}
+
 /* Returns whether a given device is a vmfs_lvm */
 bool vmfs_device_is_lvm(vmfs_device_t *dev);
 
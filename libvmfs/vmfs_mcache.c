@@ -0,0 +1,504 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * VMFS metadata block cache.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "vmfs.h"
+
+/* Create a metadata cache with the given size in bytes */
+vmfs_mcache_t *vmfs_mcache_create(size_t budget)
+{
+   vmfs_mcache_t *mc;
+   u_int i;
+
+   if (!(mc = calloc(1,sizeof(*mc))))
+      return NULL;
+
+   for(i=0;i<VMFS_MCACHE_SHARDS;i++)
+      pthread_mutex_init(&mc->shards[i].lock,NULL);
+
+   mc->max_blocks = budget / VMFS_MCACHE_BLK_SIZE / VMFS_MCACHE_SHARDS;
+   mc->max_blocks = m_max(mc->max_blocks,4);
+   mc->max_a1in   = mc->max_blocks / 4;
+   mc->max_a1out  = mc->max_blocks / 2;
+   return mc;
+}
+
+/* Destroy a metadata cache */
+void vmfs_mcache_destroy(vmfs_mcache_t *mc)
+{
+   vmfs_mcache_entry_t *entry,*next;
+   u_int i,q;
+
+   if (!mc)
+      return;
+
+   for(i=0;i<VMFS_MCACHE_SHARDS;i++) {
+      for(q=0;q<VMFS_MCACHE_QUEUES;q++) {
+         for(entry=mc->shards[i].q_head[q];entry;entry=next) {
+            next = entry->q_next;
+            iobuffer_free(entry->buf);
+            free(entry);
+         }
+      }
+
+      pthread_mutex_destroy(&mc->shards[i].lock);
+   }
+
+   free(mc);
+}
+
+/* Declare a device region as metadata */
+int vmfs_mcache_add_region(vmfs_mcache_t *mc,off_t pos,size_t len)
+{
+   struct vmfs_mcache_region *r;
+   u_int i;
+
+   /* Merge with an adjacent region when possible */
+   for(i=0;i<mc->nr_regions;i++) {
+      r = &mc->regions[i];
+
+      if ((pos <= r->end) && (pos + len >= r->start)) {
+         r->start = m_min(r->start,pos);
+         r->end   = m_max(r->end,pos + (off_t)len);
+         return(0);
+      }
+   }
+
+   if (mc->nr_regions == VMFS_MCACHE_MAX_REGIONS)
+      return(-1);
+
+   r = &mc->regions[mc->nr_regions++];
+   r->start = pos;
+   r->end   = pos + len;
+   return(0);
+}
+
+/* Check if a device range overlaps a metadata region */
+static int vmfs_mcache_overlaps_meta(const vmfs_mcache_t *mc,
+                                     off_t pos,size_t len)
+{
+   u_int i;
+
+   for(i=0;i<mc->nr_regions;i++)
+      if ((pos < mc->regions[i].end) &&
+          (pos + (off_t)len > mc->regions[i].start))
+         return(1);
+
+   return(0);
+}
+
+/* Check if a device range is entirely within a metadata region */
+static int vmfs_mcache_is_meta(const vmfs_mcache_t *mc,off_t pos,size_t len)
+{
+   u_int i;
+
+   for(i=0;i<mc->nr_regions;i++)
+      if ((pos >= mc->regions[i].start) &&
+          (pos + (off_t)len <= mc->regions[i].end))
+         return(1);
+
+   return(0);
+}
+
+/* Get the shard holding a block */
+static inline vmfs_mcache_shard_t *vmfs_mcache_shard(vmfs_mcache_t *mc,
+                                                     off_t blk)
+{
+   return(&mc->shards[(blk ^ (blk >> 7)) % VMFS_MCACHE_SHARDS]);
+}
+
+/* Hash function for a block number, within a shard */
+static inline u_int vmfs_mcache_hash(off_t blk)
+{
+   return((blk ^ (blk >> 9) ^ (blk >> 21)) % VMFS_MCACHE_HASH_BUCKETS);
+}
+
+/* Remove an entry from its queue */
+static void vmfs_mcache_q_unlink(vmfs_mcache_shard_t *s,
+                                 vmfs_mcache_entry_t *entry)
+{
+   u_int q = entry->queue;
+
+   if (entry->q_prev)
+      entry->q_prev->q_next = entry->q_next;
+   else
+      s->q_head[q] = entry->q_next;
+
+   if (entry->q_next)
+      entry->q_next->q_prev = entry->q_prev;
+   else
+      s->q_tail[q] = entry->q_prev;
+
+   s->q_count[q]--;
+}
+
+/* Put an entry at the head of a queue */
+static void vmfs_mcache_q_push(vmfs_mcache_shard_t *s,
+                               vmfs_mcache_entry_t *entry,u_int q)
+{
+   entry->queue  = q;
+   entry->q_prev = NULL;
+   entry->q_next = s->q_head[q];
+
+   if (s->q_head[q])
+      s->q_head[q]->q_prev = entry;
+   else
+      s->q_tail[q] = entry;
+
+   s->q_head[q] = entry;
+   s->q_count[q]++;
+}
+
+/* Insert an entry in the hash table */
+static void vmfs_mcache_hash_insert(vmfs_mcache_shard_t *s,
+                                    vmfs_mcache_entry_t *entry)
+{
+   u_int hb = vmfs_mcache_hash(entry->blk);
+
+   entry->next  = s->buckets[hb];
+   entry->pprev = &s->buckets[hb];
+
+   if (entry->next != NULL)
+      entry->next->pprev = &entry->next;
+
+   s->buckets[hb] = entry;
+}
+
+/* Remove an entry from the hash table */
+static void vmfs_mcache_hash_unlink(vmfs_mcache_entry_t *entry)
+{
+   if (entry->next != NULL)
+      entry->next->pprev = entry->pprev;
+
+   *(entry->pprev) = entry->next;
+}
+
+/* Find a block, either resident or ghost */
+static vmfs_mcache_entry_t *vmfs_mcache_find(vmfs_mcache_shard_t *s,
+                                             off_t blk)
+{
+   vmfs_mcache_entry_t *entry;
+
+   for(entry=s->buckets[vmfs_mcache_hash(blk)];entry;entry=entry->next)
+      if (entry->blk == blk)
+         return entry;
+
+   return NULL;
+}
+
+/* Drop an entry entirely */
+static void vmfs_mcache_drop(vmfs_mcache_shard_t *s,vmfs_mcache_entry_t *entry)
+{
+   vmfs_mcache_q_unlink(s,entry);
+   vmfs_mcache_hash_unlink(entry);
+   iobuffer_free(entry->buf);
+   free(entry);
+}
+
+/* 
+ * Make room for a new resident block. Blocks leaving A1in are remembered
+ * in A1out, blocks leaving Am are forgotten. Returns a buffer to recycle,
+ * if any.
+ */
+static u_char *vmfs_mcache_reclaim(vmfs_mcache_t *mc,vmfs_mcache_shard_t *s)
+{
+   vmfs_mcache_entry_t *entry;
+   u_char *buf;
+
+   if (s->q_count[VMFS_MCACHE_A1IN] + s->q_count[VMFS_MCACHE_AM] <
+       mc->max_blocks)
+      return NULL;
+
+   s->evictions++;
+
+   if ((s->q_count[VMFS_MCACHE_A1IN] > mc->max_a1in) ||
+       !s->q_tail[VMFS_MCACHE_AM])
+   {
+      entry = s->q_tail[VMFS_MCACHE_A1IN];
+      vmfs_mcache_q_unlink(s,entry);
+      buf = entry->buf;
+      entry->buf = NULL;
+      vmfs_mcache_q_push(s,entry,VMFS_MCACHE_A1OUT);
+
+      if (s->q_count[VMFS_MCACHE_A1OUT] > mc->max_a1out)
+         vmfs_mcache_drop(s,s->q_tail[VMFS_MCACHE_A1OUT]);
+   } else {
+      entry = s->q_tail[VMFS_MCACHE_AM];
+      buf = entry->buf;
+      entry->buf = NULL;
+      vmfs_mcache_drop(s,entry);
+   }
+
+   return buf;
+}
+
+/* Get the generation of each shard, before reading from the device */
+static void vmfs_mcache_get_gens(vmfs_mcache_t *mc,u_int *gens)
+{
+   u_int i;
+
+   for(i=0;i<VMFS_MCACHE_SHARDS;i++) {
+      pthread_mutex_lock(&mc->shards[i].lock);
+      gens[i] = mc->shards[i].gen;
+      pthread_mutex_unlock(&mc->shards[i].lock);
+   }
+}
+
+/* 
+ * Insert the content of a block read from the device at time "now". It is
+ * dropped if a write or an invalidation hit the shard since the generations
+ * "gens" were taken, as the device may have been read before it. A block
+ * that became resident meanwhile is at least as recent, so it is kept,
+ * unless it has expired.
+ */
+static void vmfs_mcache_insert(vmfs_mcache_t *mc,off_t blk,const u_char *data,
+                               const u_int *gens,uint64_t now)
+{
+   vmfs_mcache_shard_t *s = vmfs_mcache_shard(mc,blk);
+   vmfs_mcache_entry_t *entry;
+   u_char *buf;
+   u_int q = VMFS_MCACHE_A1IN;
+
+   pthread_mutex_lock(&s->lock);
+   s->misses++;
+
+   if (s->gen != gens[s - mc->shards])
+      goto done;
+
+   if ((entry = vmfs_mcache_find(s,blk)) != NULL) {
+      if (entry->buf) {
+         if (entry->expire <= now) {
+            memcpy(entry->buf,data,VMFS_MCACHE_BLK_SIZE);
+            entry->expire = now + VMFS_MCACHE_TTL;
+         }
+         goto done;
+      }
+
+      /* Seen again after eviction from A1in: promote to Am */
+      vmfs_mcache_q_unlink(s,entry);
+      vmfs_mcache_hash_unlink(entry);
+      q = VMFS_MCACHE_AM;
+   } else if (!(entry = calloc(1,sizeof(*entry)))) {
+      goto done;
+   }
+
+   buf = vmfs_mcache_reclaim(mc,s);
+
+   if (!buf && !(buf = iobuffer_alloc(VMFS_MCACHE_BLK_SIZE))) {
+      free(entry);
+      goto done;
+   }
+
+   memcpy(buf,data,VMFS_MCACHE_BLK_SIZE);
+   entry->blk = blk;
+   entry->buf = buf;
+   entry->expire = now + VMFS_MCACHE_TTL;
+   vmfs_mcache_hash_insert(s,entry);
+   vmfs_mcache_q_push(s,entry,q);
+
+ done:
+   pthread_mutex_unlock(&s->lock);
+}
+
+/* 
+ * Look up a resident block, updating its position in the queues, and copy
+ * a part of it. Returns -1 if the block is not resident or has expired.
+ */
+static int vmfs_mcache_lookup(vmfs_mcache_t *mc,off_t blk,size_t blk_ofs,
+                              u_char *buf,size_t len,uint64_t now)
+{
+   vmfs_mcache_shard_t *s = vmfs_mcache_shard(mc,blk);
+   vmfs_mcache_entry_t *entry;
+
+   pthread_mutex_lock(&s->lock);
+
+   if (!(entry = vmfs_mcache_find(s,blk)) || !entry->buf ||
+       (entry->expire <= now))
+   {
+      pthread_mutex_unlock(&s->lock);
+      return(-1);
+   }
+
+   s->hits++;
+
+   if ((entry->queue == VMFS_MCACHE_AM) &&
+       (entry != s->q_head[VMFS_MCACHE_AM]))
+   {
+      vmfs_mcache_q_unlink(s,entry);
+      vmfs_mcache_q_push(s,entry,VMFS_MCACHE_AM);
+   }
+
+   memcpy(buf,entry->buf+blk_ofs,len);
+   pthread_mutex_unlock(&s->lock);
+   return(0);
+}
+
+/* 
+ * Compute the part of a block overlapping a device range: offset in the
+ * block, offset in the range, and length.
+ */
+static inline size_t vmfs_mcache_overlap(off_t blk,off_t pos,size_t len,
+                                         size_t *blk_ofs,size_t *buf_ofs)
+{
+   off_t lo,hi;
+
+   lo = m_max(pos,blk * VMFS_MCACHE_BLK_SIZE);
+   hi = m_min(pos + (off_t)len,(blk + 1) * VMFS_MCACHE_BLK_SIZE);
+
+   *blk_ofs = lo - blk * VMFS_MCACHE_BLK_SIZE;
+   *buf_ofs = lo - pos;
+   return(hi - lo);
+}
+
+/* 
+ * Read data from a device through its cache. Only reads within metadata
+ * regions are cached, everything else goes straight to the device.
+ */
+ssize_t vmfs_mcache_read(const vmfs_device_t *dev,off_t pos,
+                         u_char *buf,size_t len)
+{
+   vmfs_mcache_t *mc = dev->cache;
+   size_t blk_ofs,buf_ofs,clen,span;
+   u_int gens[VMFS_MCACHE_SHARDS];
+   off_t blk,end,i;
+   u_char *data,*tmp;
+   uint64_t now;
+   ssize_t res;
+
+   if ((len == 0) || (len > VMFS_MCACHE_MAX_IO) ||
+       !vmfs_mcache_is_meta(mc,pos,len))
+      return(dev->read(dev,pos,buf,len));
+
+   now = vmfs_host_get_uptime();
+
+   blk = pos / VMFS_MCACHE_BLK_SIZE;
+   end = (pos + len + VMFS_MCACHE_BLK_SIZE - 1) / VMFS_MCACHE_BLK_SIZE;
+
+   for(;blk<end;blk++) {
+      clen = vmfs_mcache_overlap(blk,pos,len,&blk_ofs,&buf_ofs);
+
+      if (vmfs_mcache_lookup(mc,blk,blk_ofs,buf+buf_ofs,clen,now) == -1)
+         break;
+   }
+
+   if (blk == end)
+      return(len);
+
+   /* Fetch the remaining blocks with a single device read */
+   span = (end - blk) * VMFS_MCACHE_BLK_SIZE;
+
+   if (!(tmp = iobuffer_alloc(span)))
+      return(dev->read(dev,pos,buf,len));
+
+   vmfs_mcache_get_gens(mc,gens);
+   res = dev->read(dev,blk * VMFS_MCACHE_BLK_SIZE,tmp,span);
+
+   if (res != span) {
+      iobuffer_free(tmp);
+      return(dev->read(dev,pos,buf,len));
+   }
+
+   for(i=blk;i<end;i++) {
+      data = tmp + (i - blk) * VMFS_MCACHE_BLK_SIZE;
+      vmfs_mcache_insert(mc,i,data,gens,now);
+
+      clen = vmfs_mcache_overlap(i,pos,len,&blk_ofs,&buf_ofs);
+      memcpy(buf+buf_ofs,data+blk_ofs,clen);
+   }
+
+   iobuffer_free(tmp);
+   return(len);
+}
+
+/* Update cached blocks after data has been written to the device */
+void vmfs_mcache_update(vmfs_mcache_t *mc,off_t pos,
+                        const u_char *buf,size_t len)
+{
+   vmfs_mcache_shard_t *s;
+   vmfs_mcache_entry_t *entry;
+   size_t blk_ofs,buf_ofs,clen;
+   off_t blk,end;
+
+   if ((len == 0) || !vmfs_mcache_overlaps_meta(mc,pos,len))
+      return;
+
+   blk = pos / VMFS_MCACHE_BLK_SIZE;
+   end = (pos + len + VMFS_MCACHE_BLK_SIZE - 1) / VMFS_MCACHE_BLK_SIZE;
+
+   for(;blk<end;blk++) {
+      s = vmfs_mcache_shard(mc,blk);
+      pthread_mutex_lock(&s->lock);
+      s->gen++;
+
+      if ((entry = vmfs_mcache_find(s,blk)) && entry->buf) {
+         clen = vmfs_mcache_overlap(blk,pos,len,&blk_ofs,&buf_ofs);
+         memcpy(entry->buf+blk_ofs,buf+buf_ofs,clen);
+      }
+
+      pthread_mutex_unlock(&s->lock);
+   }
+}
+
+/* Drop cached blocks of a device range */
+void vmfs_mcache_invalidate(vmfs_mcache_t *mc,off_t pos,size_t len)
+{
+   vmfs_mcache_shard_t *s;
+   vmfs_mcache_entry_t *entry;
+   off_t blk,end;
+
+   if ((len == 0) || !vmfs_mcache_overlaps_meta(mc,pos,len))
+      return;
+
+   blk = pos / VMFS_MCACHE_BLK_SIZE;
+   end = (pos + len + VMFS_MCACHE_BLK_SIZE - 1) / VMFS_MCACHE_BLK_SIZE;
+
+   for(;blk<end;blk++) {
+      s = vmfs_mcache_shard(mc,blk);
+      pthread_mutex_lock(&s->lock);
+      s->gen++;
+
+      if ((entry = vmfs_mcache_find(s,blk)) && entry->buf)
+         vmfs_mcache_drop(s,entry);
+
+      pthread_mutex_unlock(&s->lock);
+   }
+}
+
+/* Show cache statistics */
+void vmfs_mcache_show_stats(const vmfs_mcache_t *mc)
+{
+   uint64_t hits = 0,misses = 0,evictions = 0;
+   u_int i,blocks = 0;
+
+   for(i=0;i<VMFS_MCACHE_SHARDS;i++) {
+      hits      += mc->shards[i].hits;
+      misses    += mc->shards[i].misses;
+      evictions += mc->shards[i].evictions;
+      blocks    += mc->shards[i].q_count[VMFS_MCACHE_A1IN] +
+                   mc->shards[i].q_count[VMFS_MCACHE_AM];
+   }
+
+   printf("Metadata cache: %u/%u blocks, %u regions, "
+          "%"PRIu64" hits, %"PRIu64" misses, %"PRIu64" evictions\n",
+          blocks,mc->max_blocks * VMFS_MCACHE_SHARDS,mc->nr_regions,
+          hits,misses,evictions);
+}
@@ -0,0 +1,132 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_MCACHE_H
+#define VMFS_MCACHE_H
+
+/* 
+ * Metadata block cache. Device blocks belonging to registered metadata
+ * regions (the meta-files) are kept in-core, using the 2Q replacement
+ * policy: blocks enter a FIFO queue on their first access, and only move
+ * to the LRU queue if they are accessed again after having been evicted
+ * from the FIFO. Writes go through the cache to the device. Other hosts
+ * may change metadata behind our back, so resident blocks are read again
+ * once they are older than VMFS_MCACHE_TTL.
+ */
+
+/* Default cache size, in bytes */
+#define VMFS_MCACHE_DEFAULT_BUDGET  (16 * 1024 * 1024)
+
+/* Cache granularity */
+#define VMFS_MCACHE_BLK_SIZE   M_DIO_BLK_SIZE
+
+/* Time a resident block is served without reading the device, in usecs */
+#define VMFS_MCACHE_TTL        1000000
+
+/* Larger reads are never cached */
+#define VMFS_MCACHE_MAX_IO     0x10000
+
+#define VMFS_MCACHE_SHARDS        8
+#define VMFS_MCACHE_HASH_BUCKETS  512
+
+/* Maximum number of metadata regions */
+#define VMFS_MCACHE_MAX_REGIONS   64
+
+/* Queues of the 2Q policy */
+enum vmfs_mcache_queue {
+   VMFS_MCACHE_A1IN = 0,   /* FIFO of blocks seen once */
+   VMFS_MCACHE_AM,         /* LRU of blocks seen several times */
+   VMFS_MCACHE_A1OUT,      /* Ghost FIFO of blocks evicted from A1in */
+   VMFS_MCACHE_QUEUES,
+};
+
+typedef struct vmfs_mcache_entry vmfs_mcache_entry_t;
+
+struct vmfs_mcache_entry {
+   off_t blk;
+   u_char *buf;        /* NULL for ghost entries */
+   u_int queue;
+
+   /* Host uptime after which the content has to be read again */
+   uint64_t expire;
+
+   /* Hash chain */
+   vmfs_mcache_entry_t **pprev,*next;
+
+   /* Queue (most recent first) */
+   vmfs_mcache_entry_t *q_prev,*q_next;
+};
+
+typedef struct vmfs_mcache_shard vmfs_mcache_shard_t;
+
+struct vmfs_mcache_shard {
+   vmfs_mcache_entry_t *buckets[VMFS_MCACHE_HASH_BUCKETS];
+   vmfs_mcache_entry_t *q_head[VMFS_MCACHE_QUEUES];
+   vmfs_mcache_entry_t *q_tail[VMFS_MCACHE_QUEUES];
+   u_int q_count[VMFS_MCACHE_QUEUES];
+
+   /* 
+    * Incremented each time a block of the shard is written or invalidated,
+    * so that blocks read from the device meanwhile are not cached.
+    */
+   u_int gen;
+
+   /* Statistics */
+   uint64_t hits,misses,evictions;
+
+   pthread_mutex_t lock;
+};
+
+struct vmfs_mcache_region {
+   off_t start,end;
+};
+
+/* === Metadata block cache === */
+struct vmfs_mcache {
+   /* Capacity of each shard, in blocks */
+   u_int max_blocks,max_a1in,max_a1out;
+
+   struct vmfs_mcache_region regions[VMFS_MCACHE_MAX_REGIONS];
+   u_int nr_regions;
+
+   vmfs_mcache_shard_t shards[VMFS_MCACHE_SHARDS];
+};
+
+/* Create a metadata cache with the given size in bytes */
+vmfs_mcache_t *vmfs_mcache_create(size_t budget);
+
+/* Destroy a metadata cache */
+void vmfs_mcache_destroy(vmfs_mcache_t *mc);
+
+/* Declare a device region as metadata */
+int vmfs_mcache_add_region(vmfs_mcache_t *mc,off_t pos,size_t len);
+
+/* Read data from a device through its cache */
+ssize_t vmfs_mcache_read(const vmfs_device_t *dev,off_t pos,
+                         u_char *buf,size_t len);
+
+/* Update cached blocks after data has been written to the device */
+void vmfs_mcache_update(vmfs_mcache_t *mc,off_t pos,
+                        const u_char *buf,size_t len);
+
+/* Drop cached blocks of a device range */
+void vmfs_mcache_invalidate(vmfs_mcache_t *mc,off_t pos,size_t len);
+
+/* Show cache statistics */
+void vmfs_mcache_show_stats(const vmfs_mcache_t *mc);
+
+#endif
@@ -53,21 +53,136 @@ int vmfs_metadata_hdr_write(const vmfs_metadata_hdr_t *mdh,u_char *buf)
    return(0);
 }
 
-/* Lock and read metadata at specified position */
-int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
-                       vmfs_metadata_hdr_t *mdh)
+/* Find a deferred header write of a transaction */
+static int vmfs_txn_find_pending(const vmfs_txn_t *txn,off_t pos)
+{
+   int i;
+
+   for(i=0;i<txn->pending_count;i++)
+      if (txn->pending[i].pos == pos)
+         return(i);
+
+   return(-1);
+}
+
+/* Check if the metadata at the given position is owned by the transaction */
+bool vmfs_txn_holds(const vmfs_fs_t *fs,off_t pos)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   bool res = 0;
+   int idx;
+
+   pthread_mutex_lock(&wfs->txn_lock);
+
+   if (fs->txn.depth && ((idx = vmfs_txn_find_pending(&fs->txn,pos)) != -1))
+      res = (fs->txn.pending[idx].hb_lock == 0);
+
+   pthread_mutex_unlock(&wfs->txn_lock);
+   return(res);
+}
+
+/* 
+ * Record the header of a metadata object, to be written at commit.
+ * Returns -1 if it has to be written right away.
+ */
+static int vmfs_txn_defer_hdr(vmfs_fs_t *fs,const vmfs_metadata_hdr_t *mdh)
+{
+   vmfs_txn_t *txn = &fs->txn;
+   int idx;
+
+   if ((idx = vmfs_txn_find_pending(txn,mdh->pos)) == -1) {
+      if (txn->pending_count == VMFS_TXN_MAX_PENDING)
+         return(-1);
+
+      idx = txn->pending_count++;
+   }
+
+   txn->pending[idx] = *mdh;
+   return(0);
+}
+
+/* Check if the volume is reserved by the transaction at the given position */
+static bool vmfs_txn_reserved(const vmfs_txn_t *txn,off_t pos)
+{
+   int i;
+
+   if (txn->depth) {
+      for(i=0;i<txn->reserve_count;i++)
+         if (txn->reserve_pos[i] == pos)
+            return(1);
+   }
+
+   return(0);
+}
+
+/* 
+ * Reserve the volume holding the given position. Returns 1 when the
+ * reservation is held by the current transaction, 0 when it has to be
+ * released by the caller. Devices without reservations are never held:
+ * other hosts only see the lock headers there.
+ */
+static int vmfs_txn_reserve(vmfs_fs_t *fs,off_t pos)
+{
+   vmfs_txn_t *txn = &fs->txn;
+   int res;
+
+   if (vmfs_txn_reserved(txn,pos))
+      return(1);
+
+   if ((res = vmfs_device_reserve(fs->dev,pos)) <= 0)
+      return(res);
+
+   if (txn->depth && (txn->reserve_count < VMFS_TXN_MAX_RESERVE)) {
+      txn->reserve_pos[txn->reserve_count++] = pos;
+      return(1);
+   }
+
+   return(0);
+}
+
+/* Write a metadata header only */
+static int vmfs_metadata_write_hdr(vmfs_fs_t *fs,const vmfs_metadata_hdr_t *mdh)
+{
+   DECL_ALIGNED_BUFFER(buf,VMFS_METADATA_HDR_SIZE);
+
+   vmfs_metadata_hdr_write(mdh,buf);
+
+   if (vmfs_device_write(fs->dev,mdh->pos,buf,buf_len) != buf_len)
+   {
+      fprintf(stderr,"VMFS: unable to write metadata header.\n");
+      return(-1);
+   }
+
+   return(0);
+}
+
+/* 
+ * Lock and read metadata at specified position. The transaction state is
+ * shared by all threads, so the transaction lock is held meanwhile.
+ */
+static int vmfs_metadata_lock_txn(vmfs_fs_t *fs,off_t pos,
+                                  u_char *buf,size_t buf_len,
+                                  vmfs_metadata_hdr_t *mdh)
 {
+   int held;
+
    /* Acquire heartbeat */
    if (vmfs_heartbeat_acquire(fs) == -1)
       return(-1);
 
    /* Reserve volume */
-   if (vmfs_device_reserve(fs->dev,pos) == -1) {
+   if ((held = vmfs_txn_reserve(fs,pos)) == -1) {
       fprintf(stderr,"VMFS: unable to reserve volume.\n");
       goto err_reserve;
    }
 
-   /* Read the complete metadata for the caller */
+   /* 
+    * Read the complete metadata for the caller. Another host may have
+    * changed it, so don't trust the cache.
+    */
+   if (fs->mcache)
+      vmfs_mcache_invalidate(fs->mcache,pos,buf_len);
+
    if (vmfs_device_read(fs->dev,pos,buf,buf_len) != buf_len) {
       fprintf(stderr,"VMFS: unable to read metadata.\n");
       goto err_io;
@@ -75,7 +190,11 @@ int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
 
    vmfs_metadata_hdr_read(mdh,buf);
    
-   if (mdh->hb_lock != 0)
+   /* 
+    * Metadata unlocked earlier in the transaction still looks locked on
+    * disk, but nobody else could take it since.
+    */
+   if ((mdh->hb_lock != 0) && !(held && vmfs_txn_holds(fs,pos)))
       goto err_io;
 
    /* Update metadata information */
@@ -86,6 +205,14 @@ int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
    uuid_copy(mdh->hb_uuid,fs->hb.uuid);
    vmfs_metadata_hdr_write(mdh,buf);
 
+   /* 
+    * Nobody can see the metadata while the transaction holds the
+    * reservation, so the header is only written at commit, or along
+    * with the metadata update.
+    */
+   if (held && !vmfs_txn_defer_hdr(fs,mdh))
+      return(0);
+
    /* Rewrite the metadata header only */
    if (vmfs_device_write(fs->dev,pos,buf,VMFS_METADATA_HDR_SIZE)
        != VMFS_METADATA_HDR_SIZE)
@@ -94,31 +221,113 @@ int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
       goto err_io;
    }
 
-   vmfs_device_release(fs->dev,pos);
+   if (!held)
+      vmfs_device_release(fs->dev,pos);
    return(0);
 
  err_io:
-   vmfs_device_release(fs->dev,pos);
+   if (!held)
+      vmfs_device_release(fs->dev,pos);
  err_reserve:
    vmfs_heartbeat_release(fs);
    return(-1);
 }
 
-/* Unlock metadata */
-int vmfs_metadata_unlock(vmfs_fs_t *fs,vmfs_metadata_hdr_t *mdh)
+/* Lock and read metadata at specified position */
+int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
+                       vmfs_metadata_hdr_t *mdh)
 {
-   DECL_ALIGNED_BUFFER(buf,VMFS_METADATA_HDR_SIZE);
+   int res;
 
+   pthread_mutex_lock(&fs->txn_lock);
+   res = vmfs_metadata_lock_txn(fs,pos,buf,buf_len,mdh);
+   pthread_mutex_unlock(&fs->txn_lock);
+   return(res);
+}
+
+/* Unlock metadata, with the transaction lock held */
+static int vmfs_metadata_unlock_txn(vmfs_fs_t *fs,vmfs_metadata_hdr_t *mdh)
+{
    mdh->hb_lock = 0;
    uuid_clear(mdh->hb_uuid);
-   vmfs_metadata_hdr_write(mdh,buf);
+
+   /* 
+    * Defer the header write to the commit of the transaction, as long as
+    * it holds the reservation.
+    */
+   if (vmfs_txn_reserved(&fs->txn,mdh->pos) && !vmfs_txn_defer_hdr(fs,mdh))
+      return(vmfs_heartbeat_release(fs));
 
    /* Rewrite the metadata header only */
-   if (vmfs_device_write(fs->dev,mdh->pos,buf,buf_len) != buf_len)
-   {
-      fprintf(stderr,"VMFS: unable to write metadata header.\n");
+   if (vmfs_metadata_write_hdr(fs,mdh) == -1)
       return(-1);
-   }
 
    return(vmfs_heartbeat_release(fs));
 }
+
+/* Unlock metadata */
+int vmfs_metadata_unlock(vmfs_fs_t *fs,vmfs_metadata_hdr_t *mdh)
+{
+   int res;
+
+   pthread_mutex_lock(&fs->txn_lock);
+   res = vmfs_metadata_unlock_txn(fs,mdh);
+   pthread_mutex_unlock(&fs->txn_lock);
+   return(res);
+}
+
+/* 
+ * Start a metadata transaction (transactions can be nested). Other
+ * threads wait for the outermost commit before touching metadata.
+ */
+int vmfs_txn_begin(vmfs_fs_t *fs)
+{
+   pthread_mutex_lock(&fs->txn_lock);
+
+   if (fs->txn.depth > 0) {
+      fs->txn.depth++;
+      return(0);
+   }
+
+   /* Keep the heartbeat for the whole transaction */
+   if (vmfs_heartbeat_acquire(fs) == -1) {
+      pthread_mutex_unlock(&fs->txn_lock);
+      return(-1);
+   }
+
+   fs->txn.depth = 1;
+   fs->txn.reserve_count = 0;
+   fs->txn.pending_count = 0;
+   return(0);
+}
+
+/* 
+ * Commit a metadata transaction: write the headers of the metadata it
+ * unlocked, then release the volume reservations and the heartbeat.
+ */
+int vmfs_txn_commit(vmfs_fs_t *fs)
+{
+   vmfs_txn_t *txn = &fs->txn;
+   int i,res = 0;
+
+   if (txn->depth == 0)
+      return(-1);
+
+   /* The transaction lock is held once per vmfs_txn_begin() */
+   if (--txn->depth > 0) {
+      pthread_mutex_unlock(&fs->txn_lock);
+      return(0);
+   }
+
+   for(i=0;i<txn->pending_count;i++)
+      if (vmfs_metadata_write_hdr(fs,&txn->pending[i]) == -1)
+         res = -1;
+
+   for(i=0;i<txn->reserve_count;i++)
+      vmfs_device_release(fs->dev,txn->reserve_pos[i]);
+
+   txn->pending_count = txn->reserve_count = 0;
+   vmfs_heartbeat_release(fs);
+   pthread_mutex_unlock(&fs->txn_lock);
+   return(res);
+}
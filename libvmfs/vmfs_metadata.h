@@ -54,6 +54,30 @@ struct vmfs_metadata_hdr {
    uint64_t mtime;
 };
 
+/* Maximum number of volume reservations held by a transaction */
+#define VMFS_TXN_MAX_RESERVE  16
+
+/* Maximum number of metadata header writes deferred by a transaction */
+#define VMFS_TXN_MAX_PENDING  32
+
+/* 
+ * Metadata transaction: a heartbeat reference and the volume reservations
+ * are held until commit, and the lock/unlock header writes of the
+ * metadata touched in the meantime are coalesced into one write each, at
+ * commit.
+ */
+struct vmfs_txn {
+   u_int depth;
+
+   /* Metadata positions reserved on their underlying volume */
+   u_int reserve_count;
+   off_t reserve_pos[VMFS_TXN_MAX_RESERVE];
+
+   /* Metadata headers not written yet */
+   u_int pending_count;
+   vmfs_metadata_hdr_t pending[VMFS_TXN_MAX_PENDING];
+};
+
 static inline bool vmfs_metadata_is_locked(vmfs_metadata_hdr_t *mdh)
 {
    return(mdh->hb_lock != 0);
@@ -72,4 +96,13 @@ int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
 /* Unlock metadata */
 int vmfs_metadata_unlock(vmfs_fs_t *fs,vmfs_metadata_hdr_t *mdh);
 
+/* Start a metadata transaction (transactions can be nested) */
+int vmfs_txn_begin(vmfs_fs_t *fs);
+
+/* Commit a metadata transaction */
+int vmfs_txn_commit(vmfs_fs_t *fs);
+
+/* Check if the metadata at the given position is owned by the transaction */
+bool vmfs_txn_holds(const vmfs_fs_t *fs,off_t pos);
+
 #endif
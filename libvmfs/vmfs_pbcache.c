@@ -0,0 +1,279 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * VMFS pointer block cache.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "vmfs.h"
+
+/* Create a pointer block cache */
+vmfs_pbcache_t *vmfs_pbcache_create(u_int max_entries)
+{
+   vmfs_pbcache_t *pbc;
+
+   if (!(pbc = calloc(1,sizeof(*pbc))))
+      return NULL;
+
+   pbc->max_entries = max_entries;
+   pthread_mutex_init(&pbc->lock,NULL);
+   return pbc;
+}
+
+/* Destroy a pointer block cache */
+void vmfs_pbcache_destroy(vmfs_pbcache_t *pbc)
+{
+   vmfs_pbcache_entry_t *entry,*next;
+
+   if (!pbc)
+      return;
+
+   for(entry=pbc->lru_head;entry;entry=next) {
+      next = entry->lru_next;
+      iobuffer_free(entry->buf);
+      free(entry);
+   }
+
+   pthread_mutex_destroy(&pbc->lock);
+   free(pbc);
+}
+
+/* Hash function for a pointer block ID */
+static inline u_int vmfs_pbcache_hash(uint32_t blk_id)
+{
+   return((blk_id ^ (blk_id >> 6) ^ (blk_id >> 28)) %
+          VMFS_PBCACHE_HASH_BUCKETS);
+}
+
+/* Remove an entry from the LRU list */
+static void vmfs_pbcache_lru_unlink(vmfs_pbcache_t *pbc,
+                                    vmfs_pbcache_entry_t *entry)
+{
+   if (entry->lru_prev)
+      entry->lru_prev->lru_next = entry->lru_next;
+   else
+      pbc->lru_head = entry->lru_next;
+
+   if (entry->lru_next)
+      entry->lru_next->lru_prev = entry->lru_prev;
+   else
+      pbc->lru_tail = entry->lru_prev;
+}
+
+/* Put an entry at the head of the LRU list */
+static void vmfs_pbcache_lru_push(vmfs_pbcache_t *pbc,
+                                  vmfs_pbcache_entry_t *entry)
+{
+   entry->lru_prev = NULL;
+   entry->lru_next = pbc->lru_head;
+
+   if (pbc->lru_head)
+      pbc->lru_head->lru_prev = entry;
+   else
+      pbc->lru_tail = entry;
+
+   pbc->lru_head = entry;
+}
+
+/* Remove an entry from the hash table */
+static void vmfs_pbcache_hash_unlink(vmfs_pbcache_entry_t *entry)
+{
+   if (entry->next != NULL)
+      entry->next->pprev = entry->pprev;
+
+   *(entry->pprev) = entry->next;
+}
+
+/* Find a cached pointer block */
+static vmfs_pbcache_entry_t *vmfs_pbcache_find(vmfs_pbcache_t *pbc,
+                                               uint32_t blk_id)
+{
+   vmfs_pbcache_entry_t *entry;
+
+   for(entry=pbc->buckets[vmfs_pbcache_hash(blk_id)];entry;entry=entry->next)
+      if (entry->blk_id == blk_id)
+         return entry;
+
+   return NULL;
+}
+
+/* 
+ * Get a free entry for the given pointer block, recycling the least
+ * recently used one when the cache is full.
+ */
+static vmfs_pbcache_entry_t *vmfs_pbcache_alloc(const vmfs_fs_t *fs,
+                                                uint32_t blk_id)
+{
+   vmfs_pbcache_t *pbc = fs->pbcache;
+   vmfs_pbcache_entry_t *entry;
+   u_int hb;
+
+   if ((pbc->entries >= pbc->max_entries) && pbc->lru_tail) {
+      entry = pbc->lru_tail;
+      vmfs_pbcache_lru_unlink(pbc,entry);
+      vmfs_pbcache_hash_unlink(entry);
+   } else {
+      if (!(entry = calloc(1,sizeof(*entry))))
+         return NULL;
+
+      if (!(entry->buf = iobuffer_alloc(fs->pbc->bmh.data_size))) {
+         free(entry);
+         return NULL;
+      }
+
+      pbc->entries++;
+   }
+
+   entry->blk_id = blk_id;
+
+   hb = vmfs_pbcache_hash(blk_id);
+   entry->next  = pbc->buckets[hb];
+   entry->pprev = &pbc->buckets[hb];
+
+   if (entry->next != NULL)
+      entry->next->pprev = &entry->next;
+
+   pbc->buckets[hb] = entry;
+   vmfs_pbcache_lru_push(pbc,entry);
+   return entry;
+}
+
+/* Release an entry */
+static void vmfs_pbcache_free(vmfs_pbcache_t *pbc,vmfs_pbcache_entry_t *entry)
+{
+   vmfs_pbcache_lru_unlink(pbc,entry);
+   vmfs_pbcache_hash_unlink(entry);
+   iobuffer_free(entry->buf);
+   free(entry);
+   pbc->entries--;
+}
+
+/* Look up a cached pointer block and copy a part of it, with the lock held */
+static int vmfs_pbcache_copy(vmfs_pbcache_t *pbc,uint32_t pb_blk,
+                             size_t offset,u_char *buf,size_t len)
+{
+   vmfs_pbcache_entry_t *entry;
+
+   if (!(entry = vmfs_pbcache_find(pbc,pb_blk)))
+      return(-1);
+
+   if (entry != pbc->lru_head) {
+      vmfs_pbcache_lru_unlink(pbc,entry);
+      vmfs_pbcache_lru_push(pbc,entry);
+   }
+
+   memcpy(buf,entry->buf + offset,len);
+   return(0);
+}
+
+/* 
+ * Copy a part of a pointer block, reading it from the PBC if not cached.
+ * The cache lock is not held during the read, so another thread may have
+ * inserted the block in the meantime, in which case its copy is kept.
+ */
+int vmfs_pbcache_read(const vmfs_fs_t *fs,uint32_t pb_blk,size_t offset,
+                      u_char *buf,size_t len)
+{
+   vmfs_pbcache_t *pbc = fs->pbcache;
+   vmfs_pbcache_entry_t *entry;
+   size_t pb_size = fs->pbc->bmh.data_size;
+   u_char *tmp;
+   int res;
+
+   if (offset + len > pb_size)
+      return(-1);
+
+   pthread_mutex_lock(&pbc->lock);
+
+   if (!vmfs_pbcache_copy(pbc,pb_blk,offset,buf,len)) {
+      pbc->hits++;
+      pthread_mutex_unlock(&pbc->lock);
+      return(0);
+   }
+
+   pbc->misses++;
+   pthread_mutex_unlock(&pbc->lock);
+
+   if (!(tmp = iobuffer_alloc(pb_size)))
+      return(-1);
+
+   if (!vmfs_bitmap_get_item(fs->pbc,
+                             VMFS_BLK_PB_ENTRY(pb_blk),
+                             VMFS_BLK_PB_ITEM(pb_blk),
+                             tmp))
+   {
+      iobuffer_free(tmp);
+      return(-1);
+   }
+
+   pthread_mutex_lock(&pbc->lock);
+
+   if ((res = vmfs_pbcache_copy(pbc,pb_blk,offset,buf,len)) == -1) {
+      if ((entry = vmfs_pbcache_alloc(fs,pb_blk)) != NULL)
+         memcpy(entry->buf,tmp,pb_size);
+
+      memcpy(buf,tmp + offset,len);
+      res = 0;
+   }
+
+   pthread_mutex_unlock(&pbc->lock);
+   iobuffer_free(tmp);
+   return(res);
+}
+
+/* Update the cached content of a pointer block after it has been written */
+int vmfs_pbcache_update(const vmfs_fs_t *fs,uint32_t pb_blk,const u_char *buf)
+{
+   vmfs_pbcache_t *pbc = fs->pbcache;
+   vmfs_pbcache_entry_t *entry;
+   int res = 0;
+
+   pthread_mutex_lock(&pbc->lock);
+
+   if (!(entry = vmfs_pbcache_find(pbc,pb_blk)) &&
+       !(entry = vmfs_pbcache_alloc(fs,pb_blk)))
+      res = -1;
+   else
+      memcpy(entry->buf,buf,fs->pbc->bmh.data_size);
+
+   pthread_mutex_unlock(&pbc->lock);
+   return(res);
+}
+
+/* Drop a pointer block from the cache */
+void vmfs_pbcache_invalidate(const vmfs_fs_t *fs,uint32_t pb_blk)
+{
+   vmfs_pbcache_t *pbc = fs->pbcache;
+   vmfs_pbcache_entry_t *entry;
+
+   pthread_mutex_lock(&pbc->lock);
+
+   if ((entry = vmfs_pbcache_find(pbc,pb_blk)) != NULL)
+      vmfs_pbcache_free(pbc,entry);
+
+   pthread_mutex_unlock(&pbc->lock);
+}
+
+/* Show cache statistics */
+void vmfs_pbcache_show_stats(const vmfs_pbcache_t *pbc)
+{
+   printf("Pointer block cache: %u/%u entries, "
+          "%"PRIu64" hits, %"PRIu64" misses\n",
+          pbc->entries,pbc->max_entries,pbc->hits,pbc->misses);
+}
@@ -0,0 +1,74 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_PBCACHE_H
+#define VMFS_PBCACHE_H
+
+/* Maximum number of pointer blocks kept in-core */
+#define VMFS_PBCACHE_MAX_ENTRIES  256
+
+#define VMFS_PBCACHE_HASH_BUCKETS  128
+
+typedef struct vmfs_pbcache_entry vmfs_pbcache_entry_t;
+
+struct vmfs_pbcache_entry {
+   uint32_t blk_id;
+   u_char *buf;
+
+   /* Hash chain */
+   vmfs_pbcache_entry_t **pprev,*next;
+
+   /* LRU list (most recently used first) */
+   vmfs_pbcache_entry_t *lru_prev,*lru_next;
+};
+
+/* === Pointer block cache === */
+struct vmfs_pbcache {
+   u_int max_entries;
+   u_int entries;
+
+   vmfs_pbcache_entry_t *buckets[VMFS_PBCACHE_HASH_BUCKETS];
+   vmfs_pbcache_entry_t *lru_head,*lru_tail;
+
+   /* Statistics */
+   uint64_t hits,misses;
+
+   pthread_mutex_t lock;
+};
+
+/* Create a pointer block cache */
+vmfs_pbcache_t *vmfs_pbcache_create(u_int max_entries);
+
+/* Destroy a pointer block cache */
+void vmfs_pbcache_destroy(vmfs_pbcache_t *pbc);
+
+/* 
+ * Copy a part of a pointer block, reading it from the PBC if not cached.
+ */
+int vmfs_pbcache_read(const vmfs_fs_t *fs,uint32_t pb_blk,size_t offset,
+                      u_char *buf,size_t len);
+
+/* Update the cached content of a pointer block after it has been written */
+int vmfs_pbcache_update(const vmfs_fs_t *fs,uint32_t pb_blk,const u_char *buf);
+
+/* Drop a pointer block from the cache */
+void vmfs_pbcache_invalidate(const vmfs_fs_t *fs,uint32_t pb_blk);
+
+/* Show cache statistics */
+void vmfs_pbcache_show_stats(const vmfs_pbcache_t *pbc);
+
+#endif
@@ -24,7 +24,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <assert.h>
 
 #include "vmfs.h"
@@ -50,28 +52,280 @@ static ssize_t vmfs_vol_write(const vmfs_device_t *dev,off_t pos,
    return(m_pwrite(vol->fd,buf,len,pos));
 }
 
-/* Volume reservation */
+/* Read raw data on logical volume into several buffers */
+static ssize_t vmfs_vol_readv(const vmfs_device_t *dev,off_t pos,
+                              const struct iovec *iov,int iovcnt)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+   pos += vol->vmfs_base + 0x1000000;
+
+   return(m_preadv(vol->fd,iov,iovcnt,pos));
+}
+
+/* Write several buffers of raw data on logical volume */
+static ssize_t vmfs_vol_writev(const vmfs_device_t *dev,off_t pos,
+                               const struct iovec *iov,int iovcnt)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+   pos += vol->vmfs_base + 0x1000000;
+
+   return(m_pwritev(vol->fd,iov,iovcnt,pos));
+}
+
+/* 
+ * Read a batch of requests on logical volume. The asynchronous I/O context
+ * serves one thread at a time: other threads read synchronously meanwhile.
+ */
+static int vmfs_vol_read_batch(const vmfs_device_t *dev,
+                               vmfs_io_req_t *reqs,int count)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+   off_t base = vol->vmfs_base + 0x1000000;
+   int i,res = 0;
+   u_int depth;
+
+   if (pthread_mutex_trylock(&vol->aio_lock) != 0)
+      return(vmfs_aio_read_batch_sync(vol->fd,base,reqs,count));
+
+   if (!vol->aio && !vol->aio_unavailable) {
+      depth = vol->flags.aio_depth ? vol->flags.aio_depth :
+                                     VMFS_AIO_QUEUE_DEPTH;
+
+      if (!(vol->aio = vmfs_aio_create(depth)))
+         vol->aio_unavailable = 1;
+      else if (vol->flags.debug_level > 0)
+         printf("VMFS: using io_uring for batched reads on %s\n",
+                vol->device);
+   }
+
+   if (!vol->aio) {
+      pthread_mutex_unlock(&vol->aio_lock);
+      return(vmfs_aio_read_batch_sync(vol->fd,base,reqs,count));
+   }
+
+   res = vmfs_aio_read_batch(vol->aio,vol->fd,base,reqs,count);
+   pthread_mutex_unlock(&vol->aio_lock);
+
+   if (res == 0)
+      return(0);
+
+   res = 0;
+
+   /* Retry failed requests synchronously */
+   for(i=0;i<count;i++) {
+      if ((reqs[i].res != reqs[i].len) &&
+          (vmfs_aio_read_batch_sync(vol->fd,base,&reqs[i],1) < 0))
+         res = -1;
+   }
+
+   return(res);
+}
+
+/* Get direct access to data of a memory mapped volume */
+static const u_char *vmfs_vol_map(const vmfs_device_t *dev,off_t pos,
+                                  size_t len)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+   pos += vol->vmfs_base + 0x1000000;
+
+   if ((pos < 0) || (pos + len > vol->map_size))
+      return NULL;
+
+   return(vol->map + pos);
+}
+
+/* Read a raw block of data on a memory mapped volume */
+static ssize_t vmfs_vol_mmap_read(const vmfs_device_t *dev,off_t pos,
+                                  u_char *buf,size_t len)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+   pos += vol->vmfs_base + 0x1000000;
+
+   if ((pos < 0) || (pos >= vol->map_size))
+      return(0);
+
+   len = m_min(len,vol->map_size - pos);
+   memcpy(buf,vol->map + pos,len);
+   return(len);
+}
+
+/* Read raw data on a memory mapped volume into several buffers */
+static ssize_t vmfs_vol_mmap_readv(const vmfs_device_t *dev,off_t pos,
+                                   const struct iovec *iov,int iovcnt)
+{
+   ssize_t res,len = 0;
+   int i;
+
+   for(i=0;i<iovcnt;i++) {
+      res = vmfs_vol_mmap_read(dev,pos+len,iov[i].iov_base,iov[i].iov_len);
+      len += res;
+
+      if (res != iov[i].iov_len)
+         break;
+   }
+
+   return(len);
+}
+
+/* Read a batch of requests on a memory mapped volume */
+static int vmfs_vol_mmap_read_batch(const vmfs_device_t *dev,
+                                    vmfs_io_req_t *reqs,int count)
+{
+   int i,res = 0;
+
+   for(i=0;i<count;i++) {
+      reqs[i].res = vmfs_vol_mmap_read(dev,reqs[i].pos,reqs[i].buf,
+                                       reqs[i].len);
+      if (reqs[i].res != reqs[i].len)
+         res = -1;
+   }
+
+   return(res);
+}
+
+/* 
+ * Locate data on the volume file. Block devices are opened with O_DIRECT,
+ * so only ranges aligned for direct I/O are located there. The page cache
+ * is not involved, so data written by other hosts is always seen.
+ */
+static int vmfs_vol_locate(const vmfs_device_t *dev,off_t pos,size_t len,
+                           off_t *fd_pos)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+
+   *fd_pos = pos + vol->vmfs_base + 0x1000000;
+
+   if (vol->is_blkdev && (!ALIGN_CHECK(*fd_pos,VMFS_VOL_LOCATE_ALIGN) ||
+                          !ALIGN_CHECK(len,VMFS_VOL_LOCATE_ALIGN)))
+      return(-1);
+
+   return(vol->fd);
+}
+
+/* 
+ * Map a read-only image file in memory. Reads are then served from the
+ * page cache without a system call per request.
+ */
+static int vmfs_vol_mmap(vmfs_volume_t *vol,const struct stat *st)
+{
+   void *map;
+
+   if (vol->flags.read_write || !S_ISREG(st->st_mode) ||
+       (st->st_size <= 0) || (st->st_size != (size_t)st->st_size))
+      return(-1);
+
+   map = mmap(NULL,st->st_size,PROT_READ,MAP_SHARED,vol->fd,0);
+
+   if (map == MAP_FAILED) {
+      if (vol->flags.debug_level > 0)
+         perror("VMFS: mmap");
+      return(-1);
+   }
+
+   vol->map = map;
+   vol->map_size = st->st_size;
+
+   if (vol->flags.debug_level > 0)
+      printf("VMFS: %s mapped in memory\n",vol->device);
+
+   return(0);
+}
+
+/* 
+ * Volume reservation. The SCSI reservation covers the whole LUN, so only
+ * the first of nested reservations has to be issued.
+ */
 static int vmfs_vol_reserve(const vmfs_device_t *dev, off_t pos)
 {
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
-   return(scsi_reserve(vol->fd));
+   int res = 1;
+
+   pthread_mutex_lock(&vol->reserve_lock);
+
+   if ((vol->scsi_reservation == 0) && (scsi_reserve(vol->fd) < 0))
+      res = -1;
+   else
+      vol->scsi_reservation++;
+
+   pthread_mutex_unlock(&vol->reserve_lock);
+   return(res);
 }
 
 /* Volume release */
 static int vmfs_vol_release(const vmfs_device_t *dev, off_t pos)
 {
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
-   return(scsi_release(vol->fd));
+   int res = 0;
+
+   pthread_mutex_lock(&vol->reserve_lock);
+
+   if (vol->scsi_reservation == 0)
+      res = -1;
+   else if (--vol->scsi_reservation == 0)
+      res = scsi_release(vol->fd);
+
+   pthread_mutex_unlock(&vol->reserve_lock);
+   return(res);
+}
+
+/* 
+ * Set or remove a record lock on the metadata header at the given volume
+ * position. Metadata objects are always locked through their header, so
+ * processes working on the same image file only wait for each other when
+ * they touch the same object.
+ */
+static int vmfs_vol_lock_range(const vmfs_volume_t *vol,off_t pos,short type)
+{
+   struct flock fl;
+
+   fl.l_type   = type;
+   fl.l_whence = SEEK_SET;
+   fl.l_start  = vol->vmfs_base + 0x1000000 + pos;
+   fl.l_len    = VMFS_METADATA_HDR_SIZE;
+   fl.l_pid    = 0;
+
+   while(fcntl(vol->fd,F_SETLKW,&fl) == -1) {
+      if (errno != EINTR) {
+         if (vol->flags.debug_level > 0)
+            perror("VMFS: fcntl");
+         return(-1);
+      }
+   }
+
+   return(0);
+}
+
+/* Image file reservation */
+static int vmfs_vol_file_reserve(const vmfs_device_t *dev, off_t pos)
+{
+   if (vmfs_vol_lock_range((const vmfs_volume_t *)dev,pos,F_WRLCK) == -1)
+      return(-1);
+
+   return(1);
+}
+
+/* Image file release */
+static int vmfs_vol_file_release(const vmfs_device_t *dev, off_t pos)
+{
+   return(vmfs_vol_lock_range((const vmfs_volume_t *)dev,pos,F_UNLCK));
 }
 
 /* 
  * Check if physical volume support reservation.
+ * Image files opened read/write rely on record locks instead, which are
+ * only honoured by other processes on the same system.
  * TODO: We should probably check some capabilities info.
  */
-static int vmfs_vol_check_reservation(vmfs_volume_t *vol)
+static int vmfs_vol_check_reservation(vmfs_volume_t *vol,const struct stat *st)
 {
    int res[2];
 
+   if (S_ISREG(st->st_mode) && vol->flags.read_write) {
+      vol->dev.reserve = vmfs_vol_file_reserve;
+      vol->dev.release = vmfs_vol_file_release;
+      return(1);
+   }
+
    /* The device must be a block device */
    if (!vol->is_blkdev)
       return(0);
@@ -151,6 +405,11 @@ static void vmfs_vol_close(vmfs_device_t *dev)
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
    if (!vol)
       return;
+   vmfs_aio_destroy(vol->aio);
+   pthread_mutex_destroy(&vol->aio_lock);
+   pthread_mutex_destroy(&vol->reserve_lock);
+   if (vol->map)
+      munmap(vol->map,vol->map_size);
    close(vol->fd);
    free(vol->device);
    free(vol->vol_info.name);
@@ -178,6 +437,8 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
    }
 
    vol->flags = flags;
+   pthread_mutex_init(&vol->aio_lock,NULL);
+   pthread_mutex_init(&vol->reserve_lock,NULL);
    fstat(vol->fd,&st);
    vol->is_blkdev = S_ISBLK(st.st_mode);
 #if defined(O_DIRECT) || defined(DIRECTIO_ON)
@@ -223,15 +484,27 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
    if (vol->is_blkdev && (scsi_get_lun(vol->fd) != vol->vol_info.lun))
       fprintf(stderr,"VMFS: Warning: Lun ID mismatch on %s\n", vol->device);
 
-   vmfs_vol_check_reservation(vol);
+   vmfs_vol_check_reservation(vol,&st);
 
    if (vol->flags.debug_level > 0) {
       printf("VMFS: volume opened successfully\n");
    }
 
-   vol->dev.read = vmfs_vol_read;
-   if (vol->flags.read_write)
+   if (flags.mmap && (vmfs_vol_mmap(vol,&st) == 0)) {
+      vol->dev.read = vmfs_vol_mmap_read;
+      vol->dev.readv = vmfs_vol_mmap_readv;
+      vol->dev.read_batch = vmfs_vol_mmap_read_batch;
+      vol->dev.map = vmfs_vol_map;
+   } else {
+      vol->dev.read = vmfs_vol_read;
+      vol->dev.readv = vmfs_vol_readv;
+      vol->dev.read_batch = vmfs_vol_read_batch;
+   }
+   if (vol->flags.read_write) {
       vol->dev.write = vmfs_vol_write;
+      vol->dev.writev = vmfs_vol_writev;
+   }
+   vol->dev.locate = vmfs_vol_locate;
    vol->dev.close = vmfs_vol_close;
    vol->dev.uuid = &vol->vol_info.lvm_uuid;
 
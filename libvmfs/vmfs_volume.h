@@ -24,6 +24,13 @@
 #define VMFS_VOLINFO_BASE   0x100000
 #define VMFS_VOLINFO_MAGIC  0xc001d00d
 
+/* 
+ * Alignment of the ranges located on block devices, which are read with
+ * O_DIRECT. libfuse reads them into page aligned buffers when it doesn't
+ * splice, and 4KB covers the logical block size of all disks.
+ */
+#define VMFS_VOL_LOCATE_ALIGN  0x1000
+
 struct vmfs_volinfo_raw {
    uint32_t magic;
    uint32_t ver;
@@ -122,7 +129,19 @@ struct vmfs_volume {
    int fd;
    vmfs_flags_t flags;
    int is_blkdev;
-   int scsi_reservation;
+
+   /* Number of nested SCSI reservations */
+   u_int scsi_reservation;
+   pthread_mutex_t reserve_lock;
+
+   /* Memory mapping of image files opened read-only */
+   u_char *map;
+   size_t map_size;
+
+   /* Asynchronous I/O context, set up on first use */
+   vmfs_aio_t *aio;
+   int aio_unavailable;
+   pthread_mutex_t aio_lock;
 
    /* VMFS volume base */
    off_t vmfs_base;
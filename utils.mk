@@ -62,6 +62,20 @@ $$(call result,$$(HAS_$$(__name)))
 endef
 LINK_CHECK = $(eval $(call _LINK_CHECK,$(1),$(2)))
 
+#Usage: $(call HEADER_CHECK,name,header)
+# Try to compile a simple program including the given header
+# Sets HAS_NAME
+define _HEADER_CHECK
+$$(call checking,$(2))
+__name := $(call UC,$(1))
+__$$(__name) := $$(shell printf '\043include <$(2)>\nint main(void) { return(0); }\n' > __conftest.c; $(CC) -o __conftest __conftest.c 2> /dev/null && echo yes || echo no; rm -f __conftest*)
+ifeq ($$(__$$(__name)),yes)
+HAS_$$(__name) := 1
+endif
+$$(call result,$$(HAS_$$(__name)))
+endef
+HEADER_CHECK = $(eval $(call _HEADER_CHECK,$(1),$(2)))
+
 GEN_VERSION = $(shell \
 	(if [ -d .git ]; then \
 		VER=$$(git describe --match "v[0-9].*" --abbrev=0 HEAD); \
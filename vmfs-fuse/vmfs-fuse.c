@@ -39,6 +39,24 @@ static inline fuse_ino_t blkid2ino(uint32_t blk_id)
    return((fuse_ino_t)blk_id);
 }
 
+/*
+ * Reply with the entry of an inode. The inode reference is kept until the
+ * kernel forgets about its lookup.
+ */
+static void vmfs_fuse_reply_entry(fuse_req_t req, vmfs_inode_t *inode)
+{
+   struct fuse_entry_param entry = { 0, };
+
+   vmfs_inode_stat(inode,&entry.attr);
+   entry.ino = entry.attr.st_ino = blkid2ino(inode->id);
+   entry.generation = 1;
+   entry.attr_timeout = 1.0;
+   entry.entry_timeout = 1.0;
+
+   if (fuse_reply_entry(req, &entry))
+      vmfs_inode_release(inode);
+}
+
 static void vmfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
                              struct fuse_file_info *fi)
 {
@@ -60,25 +78,29 @@ static void vmfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
    struct stat stbuf = { 0, };
    vmfs_inode_t *inode;
 
+   /* Inodes stay in-core after release, changes have to reach the disk */
+   if (!vmfs_fs_readwrite(fs)) {
+      fuse_reply_err(req, EROFS);
+      return;
+   }
+
    if (!(inode = vmfs_inode_acquire(fs,ino2blkid(ino)))) {
       fuse_reply_err(req, ENOENT);
       return;
    }
 
    if (to_set & FUSE_SET_ATTR_MODE)
-      inode->mode = attr->st_mode;
-
-   if (to_set & FUSE_SET_ATTR_UID)
-      inode->uid = attr->st_uid;
+      vmfs_inode_chmod(inode,attr->st_mode);
 
-   if (to_set & FUSE_SET_ATTR_GID)
-      inode->gid = attr->st_gid;
+   if (to_set & (FUSE_SET_ATTR_UID|FUSE_SET_ATTR_GID))
+      vmfs_inode_chown(inode,
+                       (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : -1,
+                       (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : -1);
 
-   if (to_set & FUSE_SET_ATTR_ATIME)
-      inode->atime = attr->st_atime;
-
-   if (to_set & FUSE_SET_ATTR_MTIME)
-      inode->atime = attr->st_mtime;
+   if (to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME))
+      vmfs_inode_utime(inode,
+                       (to_set & FUSE_SET_ATTR_ATIME) ? &attr->st_atime : NULL,
+                       (to_set & FUSE_SET_ATTR_MTIME) ? &attr->st_mtime : NULL);
 
    if (to_set & FUSE_SET_ATTR_SIZE)
       vmfs_inode_truncate(inode,attr->st_size);
@@ -126,7 +148,6 @@ static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
 static void vmfs_fuse_mknod(fuse_req_t req,fuse_ino_t parent,const char *name,
                             mode_t mode, dev_t rdev)
 {   
-   struct fuse_entry_param entry = { 0, };
    vmfs_inode_t *inode;
    vmfs_dir_t *dir;
    int res;
@@ -142,21 +163,12 @@ static void vmfs_fuse_mknod(fuse_req_t req,fuse_ino_t parent,const char *name,
    }
 
    vmfs_dir_close(dir);
-
-   vmfs_inode_stat(inode,&entry.attr);
-   entry.ino = entry.attr.st_ino = blkid2ino(inode->id);
-   entry.generation = 1;
-   entry.attr_timeout = 1.0;
-   entry.entry_timeout = 1.0;
-   fuse_reply_entry(req, &entry);
-
-   vmfs_inode_release(inode);
+   vmfs_fuse_reply_entry(req, inode);
 }
 
 static void vmfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
                             const char *name, mode_t mode) 
 {
-   struct fuse_entry_param entry = { 0, };
    vmfs_inode_t *inode;
    vmfs_dir_t *dir;
    int res;
@@ -172,16 +184,7 @@ static void vmfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
    }
 
    vmfs_dir_close(dir);
-
-   vmfs_inode_stat(inode,&entry.attr);
-   entry.ino = entry.attr.st_ino = blkid2ino(inode->id);
-   entry.generation = 1;
-   entry.attr_timeout = 1.0;
-   entry.entry_timeout = 1.0;
-
-   fuse_reply_entry(req, &entry);
-
-   vmfs_inode_release(inode);
+   vmfs_fuse_reply_entry(req, inode);
 }
 
 static void vmfs_fuse_unlink(fuse_req_t req,fuse_ino_t parent,const char *name) 
@@ -229,25 +232,41 @@ static void vmfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
       fuse_reply_err(req, ENOTDIR);
 }
 
+/* Fill the reply with as many entries as fit in the requested size */
 static void vmfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                               off_t off, struct fuse_file_info *fi)
 {
-   char buf[size];
+   vmfs_dir_t *d = (vmfs_dir_t *)(unsigned long)fi->fh;
    const vmfs_dirent_t *entry;
    struct stat st = {0, };
-   size_t sz;
+   size_t len = 0, sz;
+   char *buf;
 
-   if (!fi->fh) {
+   if (!d) {
       fuse_reply_err(req, EBADF);
       return;
    }
-   if ((entry = vmfs_dir_read((vmfs_dir_t *)(unsigned long)fi->fh))) {
+
+   if (!(buf = malloc(size))) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+   }
+
+   /* Requests carry their position, don't rely on the handle's */
+   vmfs_dir_seek(d, off);
+
+   while ((entry = vmfs_dir_read(d))) {
       st.st_mode = vmfs_file_type2mode(entry->type);
       st.st_ino = blkid2ino(entry->block_id);
-      sz = fuse_add_direntry(req, buf, size, entry->name, &st, off + 1);
-      fuse_reply_buf(req, buf, sz);
-   } else
-      fuse_reply_buf(req, NULL, 0);
+      sz = fuse_add_direntry(req, buf + len, size - len, entry->name, &st,
+                             d->pos);
+      if (sz > size - len)
+         break;
+      len += sz;
+   }
+
+   fuse_reply_buf(req, len ? buf : NULL, len);
+   free(buf);
 }
 
 static void vmfs_fuse_releasedir(fuse_req_t req, fuse_ino_t ino,
@@ -286,10 +305,10 @@ static void vmfs_fuse_statfs(fuse_req_t req, fuse_ino_t ino)
 static void vmfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
                              const char *name)
 {
-   struct fuse_entry_param entry = { 0, };
    vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
    vmfs_dir_t *d = vmfs_dir_open_from_blkid(fs, ino2blkid(parent));
    const vmfs_dirent_t *rec;
+   vmfs_inode_t *inode;
 
    if (!d) {
       fuse_reply_err(req, ENOENT);
@@ -298,18 +317,52 @@ static void vmfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 
    rec = vmfs_dir_lookup(d, name);
 
-   if (rec && !vmfs_inode_stat_from_blkid(fs, rec->block_id, &entry.attr)) {
-      entry.ino = entry.attr.st_ino = blkid2ino(rec->block_id);
-      entry.generation = 1;
-      entry.attr_timeout = 1.0;
-      entry.entry_timeout = 1.0;
-      fuse_reply_entry(req, &entry);
-   } else
+   if (rec && (inode = vmfs_inode_acquire(fs, rec->block_id)))
+      vmfs_fuse_reply_entry(req, inode);
+   else
       fuse_reply_err(req, ENOENT);
 
    vmfs_dir_close(d);
 }
 
+/* Drop the inode references taken for the kernel's lookups */
+static void vmfs_fuse_forget_inode(vmfs_fs_t *fs, fuse_ino_t ino,
+                                   unsigned long nlookup)
+{
+   vmfs_inode_t *inode;
+
+   if (!(inode = vmfs_inode_acquire(fs, ino2blkid(ino))))
+      return;
+
+   while (nlookup--)
+      vmfs_inode_release(inode);
+
+   vmfs_inode_release(inode);
+}
+
+static void vmfs_fuse_forget(fuse_req_t req, fuse_ino_t ino,
+                             unsigned long nlookup)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
+
+   vmfs_fuse_forget_inode(fs, ino, nlookup);
+   fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= 29
+static void vmfs_fuse_forget_multi(fuse_req_t req, size_t count,
+                                   struct fuse_forget_data *forgets)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
+   size_t i;
+
+   for (i = 0; i < count; i++)
+      vmfs_fuse_forget_inode(fs, forgets[i].ino, forgets[i].nlookup);
+
+   fuse_reply_none(req);
+}
+#endif
+
 static void vmfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
                            struct fuse_file_info *fi)
 {
@@ -338,32 +391,95 @@ static void vmfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
       return;
    }      
 
-   if ((res = vmfs_file_create(dir,name,mode,&inode)) < 0) {
+   res = vmfs_file_create(dir,name,mode,&inode);
+   vmfs_dir_close(dir);
+
+   if (res < 0) {
       fuse_reply_err(req, -res);
       return;
    }
 
-   vmfs_dir_close(dir);
-
    if (!(f = vmfs_file_open_from_inode(inode))) {
       vmfs_inode_release(inode);
       fuse_reply_err(req,ENOMEM);
+      return;
    }
 
    fi->fh = (uint64_t)(unsigned long)f;
 
+   /* The file handle owns the inode, the lookup count needs another ref */
+   vmfs_inode_acquire(fs,inode->id);
+
    vmfs_inode_stat(inode,&entry.attr);
    entry.ino = entry.attr.st_ino = blkid2ino(inode->id);
    entry.generation = 1;
    entry.attr_timeout = 1.0;
    entry.entry_timeout = 1.0;
-   fuse_reply_create(req,&entry,fi);
+
+   if (fuse_reply_create(req,&entry,fi))
+      vmfs_inode_release(inode);
 }
 
+#if FUSE_VERSION >= 29
+/* Maximum number of file descriptor ranges in a read reply */
+#define VMFS_FUSE_MAX_BUFS  16
+
+/* 
+ * Reply to a read with the ranges of the underlying files holding the data,
+ * so that libfuse can splice them to the kernel instead of copying them
+ * through our buffers. Returns -1 when some of the data can't be located,
+ * e.g. in holes or sub-blocks.
+ */
+static int vmfs_fuse_read_fd(fuse_req_t req, vmfs_file_t *f, size_t size,
+                             off_t off)
+{
+   struct fuse_bufvec *bufv;
+   struct fuse_buf *buf;
+   uint64_t file_size;
+   size_t len;
+   int fd, count = 0;
+
+   file_size = vmfs_file_get_size(f);
+
+   if (off >= file_size)
+      return(-1);
+
+   size = m_min(size, file_size - off);
+
+   if (!(bufv = calloc(1, sizeof(*bufv) +
+                          (VMFS_FUSE_MAX_BUFS - 1) * sizeof(*buf))))
+      return(-1);
+
+   while (size > 0) {
+      len = size;
+
+      if ((count == VMFS_FUSE_MAX_BUFS) ||
+          ((fd = vmfs_file_locate(f, off, &len, &bufv->buf[count].pos)) < 0))
+      {
+         free(bufv);
+         return(-1);
+      }
+
+      buf = &bufv->buf[count++];
+      buf->size = len;
+      buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      buf->fd = fd;
+
+      off += len;
+      size -= len;
+   }
+
+   bufv->count = count;
+   fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+   free(bufv);
+   return(0);
+}
+#endif
+
 static void vmfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                            off_t off, struct fuse_file_info *fi)
 {
-   char buf[size];
+   char *buf;
    ssize_t sz;
 
    if (!fi->fh) {
@@ -371,15 +487,26 @@ static void vmfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
       return;
    }
 
+#if FUSE_VERSION >= 29
+   if (!vmfs_fuse_read_fd(req, (vmfs_file_t *)(unsigned long)fi->fh,
+                          size, off))
+      return;
+#endif
+
+   if (!(buf = malloc(size))) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+   }
+
    sz = vmfs_file_pread((vmfs_file_t *)(unsigned long)fi->fh,
                         (u_char *)buf, size, off);
 
-   if (sz < 0) {
+   if (sz < 0)
       fuse_reply_err(req, -sz);
-      return;
-   }
+   else
+      fuse_reply_buf(req, buf, sz);
 
-   fuse_reply_buf(req, buf, sz);
+   free(buf);
 }
 
 static void vmfs_fuse_write(fuse_req_t req, fuse_ino_t ino, 
@@ -415,7 +542,19 @@ static void vmfs_fuse_release(fuse_req_t req, fuse_ino_t ino,
    fuse_reply_err(req, 0);
 }
 
+#if FUSE_VERSION >= 29
+/* Let libfuse splice read replies to the kernel when it can */
+static void vmfs_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+   conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+                                  FUSE_CAP_SPLICE_MOVE);
+}
+#endif
+
 const static struct fuse_lowlevel_ops vmfs_oper = {
+#if FUSE_VERSION >= 29
+   .init = vmfs_fuse_init,
+#endif
    .getattr = vmfs_fuse_getattr,
    .setattr = vmfs_fuse_setattr,
    .readlink = vmfs_fuse_readlink,
@@ -428,6 +567,10 @@ const static struct fuse_lowlevel_ops vmfs_oper = {
    .releasedir = vmfs_fuse_releasedir,
    .statfs = vmfs_fuse_statfs,
    .lookup = vmfs_fuse_lookup,
+   .forget = vmfs_fuse_forget,
+#if FUSE_VERSION >= 29
+   .forget_multi = vmfs_fuse_forget_multi,
+#endif
    .open = vmfs_fuse_open,
    .create = vmfs_fuse_create,
    .read = vmfs_fuse_read,
@@ -440,11 +583,13 @@ struct vmfs_fuse_opts {
    char *paths[VMFS_LVM_MAX_EXTENTS + 1];
    char *mountpoint;
    int foreground;
+   int singlethread;
 };
 
 static const struct fuse_opt vmfs_fuse_args[] = {
   { "-d", offsetof(struct vmfs_fuse_opts, foreground), 1 },
   { "-f", offsetof(struct vmfs_fuse_opts, foreground), 1 },
+  { "-s", offsetof(struct vmfs_fuse_opts, singlethread), 1 },
   FUSE_OPT_KEY("-d", FUSE_OPT_KEY_KEEP),
 };
 
@@ -506,9 +651,16 @@ int main(int argc, char *argv[])
                                   sizeof(vmfs_oper), fs);
       if (session != NULL) {
          fuse_daemonize(opts.foreground);
+#ifdef VMFS_WRITE
+         /* Started after daemonizing, since threads don't survive fork() */
+         vmfs_heartbeat_start_thread(fs);
+#endif
          if (fuse_set_signal_handlers(session) != -1) {
             fuse_session_add_chan(session, chan);
-            err = fuse_session_loop(session);
+            if (opts.singlethread)
+               err = fuse_session_loop(session);
+            else
+               err = fuse_session_loop_mt(session);
             fuse_remove_signal_handlers(session);
             fuse_session_remove_chan(chan);
          }
@@ -131,14 +131,48 @@ static int cmd_remove(vmfs_fs_t *fs,int argc,char *argv[])
    return(0);
 }
 
+static int cmd_layout(vmfs_fs_t *fs,int argc,char *argv[])
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)fs->dev;
+   vmfs_volume_t *extent;
+   uint32_t seg, start;
+   int i;
+
+   printf("Logical volume: %u extent(s), %u segment(s) of %u MB\n",
+          lvm->lvm_info.num_extents, lvm->num_segments,
+          VMFS_LVM_SEGMENT_SIZE / (1024 * 1024));
+
+   printf("\nExtents:\n");
+   for (i = 0; i < lvm->loaded_extents; i++) {
+      extent = lvm->extents[i];
+      printf("  %-30s segments %5u-%-5u (%u MB)\n", extent->device,
+             extent->vol_info.first_segment, extent->vol_info.last_segment,
+             extent->vol_info.num_segments *
+                (VMFS_LVM_SEGMENT_SIZE / (1024 * 1024)));
+   }
+
+   printf("\nSegment map:\n");
+   for (seg = 0; seg < lvm->num_segments; seg = start) {
+      extent = lvm->segments[seg];
+      for (start = seg + 1;
+           (start < lvm->num_segments) && (lvm->segments[start] == extent);
+           start++);
+      printf("  %5u-%-5u %s\n", seg, start - 1,
+             extent ? extent->device : "(missing)");
+   }
+   return(0);
+}
+
 struct cmd {
    char *name;
    char *description;
    int (*fn)(vmfs_fs_t *fs,int argc,char *argv[]);
+   int read_write;
 };
 
 struct cmd cmd_array[] = {
-   { "remove", "Remove an extent", cmd_remove },
+   { "remove", "Remove an extent", cmd_remove, 1 },
+   { "layout", "Show extents and segments layout", cmd_layout, 0 },
    { NULL, }
 };
 
@@ -193,7 +227,7 @@ int main(int argc,char *argv[])
 
    flags.packed = 0;
 
-   flags.read_write = 1;
+   flags.read_write = cmd->read_write;
 
    argv[arg] = NULL;
    if (!(fs = vmfs_fs_open(&argv[1], flags))) {